@@ -16,7 +16,7 @@
 ** Features:
 **
 **     * Launched from inetd/xinetd/stunnel4, or as a stand-alone server
-**     * One process per request
+**     * One process per connection, or a pool of pre-forked workers
 **     * Deliver static content or run CGI or SCGI
 **     * Virtual sites based on the "Host:" property of the HTTP header
 **     * Runs in a chroot jail
@@ -92,6 +92,61 @@
 **
 **  --port N         Run in standalone mode listening on TCP port N
 **
+**  --workers N      In standalone mode, pre-fork N long-lived worker processes
+**                   that each accept and serve connections in a loop, instead
+**                   of forking a new process for every connection.  The
+**                   parent only supervises and respawns workers.  On Linux,
+**                   idle keep-alive connections wait in an epoll set in
+**                   the worker instead of each holding a process.
+**
+**  --reuseport BOOLEAN  With --workers, have each worker bind its own
+**                   SO_REUSEPORT listening socket so that the kernel
+**                   spreads incoming connections across the workers.
+**
+**  --backlog N      The listen() backlog for each listening socket.
+**                   Default 20.
+**
+**  --max-requests N Close a keep-alive connection after it has carried
+**                   N+1 requests.  Default 100.  0 means no limit.
+**
+**  --keepalive-timeout SEC  How long a keep-alive connection may sit idle
+**                   waiting for its next request.  Default 15.
+**
+**  --max-lifetime SEC  Close a keep-alive connection after the first
+**                   response that ends more than SEC seconds after the
+**                   connection was opened.  Default 0, meaning no limit.
+**
+**  --shed-load PCT  With --workers, stop honoring keep-alive when PCT
+**                   percent or more of the other workers are busy serving
+**                   requests, so that connections turn over faster under
+**                   load.  Default 90.  0 disables load shedding.
+**
+**  --file-cache N   Keep up to N recently served static files open, along
+**                   with their stat() information, so that repeat requests
+**                   skip the filesystem lookups.  Default 64.  0 disables
+**                   the cache.
+**
+**  --file-cache-ttl SEC  Check that a cached file has not changed when it
+**                   is used more than SEC seconds after the last check.
+**                   Default 2.
+**
+**  --scgi-spares N  In a --workers process, after each SCGI request on a
+**                   connection that stays open, start a spare connection
+**                   to the same SCGI server for the next request to use,
+**                   and keep spares for up to N distinct servers.  Ignored
+**                   without --workers.  Default 0, which disables spares.
+**
+**  --spool-post BOOLEAN  Give CGI programs their POST content on a
+**                   seekable standard input, held in an anonymous memory
+**                   file (or an unlinked file in /tmp where memfd_create()
+**                   is unavailable), rather than streaming it through a
+**                   pipe.  The content is read completely before the CGI
+**                   program starts.  Default 0.
+**
+**  --scgi-dns-ttl SEC  Reuse the resolved address of an SCGI server for
+**                   SEC seconds before looking the name up again.
+**                   Default 60.
+**
 **  --user USER      Define the user under which the process should run if
 **                   originally launched as root.  This process will refuse to
 **                   run as root (for security).  If this option is omitted and
@@ -104,6 +159,42 @@
 **                   FILE name is expanded using strftime() if it contains
 **                   at least one '%' and is not too long.
 **
+**  --log-ring N     With --workers, have the workers pass log entries
+**                   through a ring of N slots in shared memory to a
+**                   separate log-writer process, so that no worker does
+**                   any log I/O.  Default 0, meaning no ring.
+**
+**  --log-flush SEC  Log entries are collected in memory and written
+**                   together.  Write them out once the oldest is SEC seconds
+**                   old, and whenever the process is about to wait for
+**                   input.  Default 1.  0 writes each entry at once.
+**
+**  --log-binary BOOLEAN  Write the log file in a compact binary format
+**                   instead of CSV.  Repeated strings such as the
+**                   user agent are stored once per block of entries.
+**                   Default 0.
+**
+**  --log-phases BOOLEAN  Add seven fields to each CSV log entry giving
+**                   the microseconds spent in each phase of the request:
+**                   parsing the header, finding the *.website directory,
+**                   finding the file, checking -auth, starting CGI or
+**                   connecting to SCGI, waiting for the CGI or SCGI reply
+**                   header, and sending the reply.  Default 0.
+**
+**  --log-decode FILE  Convert binary log FILE ("-" for standard input)
+**                   into the usual CSV format on standard output, then
+**                   exit.  Dates are shown in the local time zone of
+**                   the decoding process.  Set TZ to match the server.
+**
+**  --status-auth FILE  Serve live server statistics at the URL
+**                   /-server-status, to clients that pass the checks in
+**                   FILE.  FILE has the same format as the "-auth"
+**                   files of item (7) above and is interpreted inside
+**                   the chroot jail.  Add "?format=prometheus" to the URL
+**                   for the Prometheus text exposition format.  Without
+**                   this option, /-server-status is not found, like any
+**                   other URL with a path element that begins with "-".
+**
 **  --https          Indicates that input is coming over SSL and is being
 **                   decoded upstream, perhaps by stunnel.  (This program
 **                   only understands plaintext.)
@@ -206,8 +297,25 @@
 **      relight: relight-command
 **
 ** The first line specifies the location and TCP/IP port of the SCGI server
-** that will handle the request.  Subsequent lines determine what to do if
-** the SCGI server cannot be contacted.  If the "relight:" line is present,
+** that will handle the request.  Additional "SCGI hostname port" lines
+** name further, identical SCGI servers.  Each request goes to the server
+** chosen by a consistent hash of its PATH_INFO, so a given path keeps
+** going to the same server while the set of servers is unchanged.  A
+** server that cannot be contacted is passed over, and the next server in
+** hash order is tried.  A server that has failed is avoided for 1 second,
+** then 2, 4 and so on up to 64 seconds while it keeps failing, and is
+** only tried ahead of time if every server is being avoided.  In a
+** stand-alone server this record of failures is shared by all of the
+** server's processes.
+**
+** An optional "connect-timeout: MILLISECONDS" line bounds how long to
+** wait for a connection to each server.  The default is 2000.  When a
+** server name resolves to several addresses, a connection attempt is
+** started on the next address every 250 milliseconds until one
+** succeeds, so one unresponsive address does not hold up the others.
+**
+** The remaining lines determine what to do if no SCGI server can be
+** contacted.  If the "relight:" line is present,
 ** then the relight-command is run using system() and the connection is
 ** retried after a 1-second delay.  Use "&" at the end of the relight-command
 ** to run it in the background.  Make sure the relight-command does not
@@ -240,6 +348,9 @@
 ** Because of security rule (7), there is no way for the content of the "-auth"
 ** file to leak out via HTTP request.
 */
+#if defined(linux) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE  /* For splice() and memfd_create() */
+#endif
 #include <stdio.h>
 #include <ctype.h>
 #include <syslog.h>
@@ -255,8 +366,10 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <time.h>
 #include <sys/times.h>
 #include <netdb.h>
@@ -267,6 +380,59 @@
 #include <sys/sendfile.h>
 #endif
 #include <assert.h>
+#include <setjmp.h>
+#include <poll.h>
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#ifdef ALTHTTPD_BENCH
+#include <dirent.h>
+#include <sys/ptrace.h>
+#endif
+
+/*
+** Static tracepoints for bpftrace, perf or SystemTap.  Where <sys/sdt.h>
+** is available, each PROBEn() is a USDT probe "althttpd:NAME" that costs
+** a single nop instruction unless a tracer is attached.  Elsewhere, or
+** when compiled with -DALTHTTPD_NO_PROBES, they compile to nothing.
+** List them with "bpftrace -l 'usdt:/path/to/althttpd:*'".
+**
+**    request__start    nRequest
+**    header__parsed    nRequest, nIn, zMethod, zScript
+**    file__resolved    zFile, file size
+**    response__start   status text, nOut
+**    sendfile__done    bytes sent, bytes intended
+**    cgi__spawn        process id, zFile
+**    cgi__exit         process id, wait status
+**    scgi__connect     server host, server port, socket
+**    scgi__reply       nIn, nOut
+**    log__write        line number code of MakeLogEntry(), reply status,
+**                      nIn, nOut
+*/
+#if !defined(ALTHTTPD_NO_PROBES) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define PROBE1(N,A)         DTRACE_PROBE1(althttpd,N,A)
+#  define PROBE2(N,A,B)       DTRACE_PROBE2(althttpd,N,A,B)
+#  define PROBE3(N,A,B,C)     DTRACE_PROBE3(althttpd,N,A,B,C)
+#  define PROBE4(N,A,B,C,D)   DTRACE_PROBE4(althttpd,N,A,B,C,D)
+# endif
+#endif
+#ifndef PROBE1
+# define PROBE1(N,A)
+# define PROBE2(N,A,B)
+# define PROBE3(N,A,B,C)
+# define PROBE4(N,A,B,C,D)
+#endif
 
 /*
 ** Configure the server by setting the following macros and recompiling.
@@ -280,6 +446,18 @@
 #ifndef MAX_CPU
 #define MAX_CPU 30                /* Max CPU cycles in seconds */
 #endif
+#ifndef WORKER_CPU_BUDGET
+#define WORKER_CPU_BUDGET 1000    /* Worker lifetime CPU, units of MAX_CPU */
+#endif
+#ifndef MAX_HEADER_SIZE
+#define MAX_HEADER_SIZE 16384     /* Max bytes in an HTTP request header */
+#endif
+#ifndef MAX_HEADER_FIELD
+#define MAX_HEADER_FIELD 64       /* Max header fields examined per request */
+#endif
+#ifndef ARENA_CHUNK_SIZE
+#define ARENA_CHUNK_SIZE 16384    /* Bytes of per-request memory on hand */
+#endif
 
 /*
 ** We record most of the state information as global variables.  This
@@ -287,8 +465,9 @@
 ** makes the executable smaller...
 */
 static char *zRoot = 0;          /* Root directory of the website */
-static char *zTmpNam = 0;        /* Name of a temporary file */
-static char zTmpNamBuf[500];     /* Space to hold the temporary filename */
+static int fdPostBody = -1;      /* Pipe carrying POST content to a CGI */
+static pid_t pidFeeder = 0;      /* Process writing POST content to the pipe */
+static int spoolPost = 0;        /* Give CGI a seekable copy of POST content */
 static char *zProtocol = 0;      /* The protocol being using by the browser */
 static char *zMethod = 0;        /* The method.  Must be GET */
 static char *zScript = 0;        /* The object to retrieve */
@@ -323,6 +502,10 @@ static int nOut = 0;             /* Number of bytes of output */
 static char zReplyStatus[4];     /* Reply status code */
 static int statusSent = 0;       /* True after status line is sent */
 static char *zLogFile = 0;       /* Log to this file */
+static int logFlush = 1;         /* Max seconds a log entry stays buffered */
+static int logBinary = 0;        /* Write the log in the binary format */
+static int logPhases = 0;        /* Log the time taken by each phase */
+static char *zStatusAuth = 0;    /* -auth file for the /-server-status page */
 static int debugFlag = 0;        /* True if being debugged */
 static struct timeval beginTime; /* Time when this process starts */
 static int closeConnection = 0;  /* True to send Connection: close in reply */
@@ -342,6 +525,26 @@ static char *zScgi = 0;          /* Value of the SCGI env variable */
 static int rangeStart = 0;       /* Start of a Range: request */
 static int rangeEnd = 0;         /* End of a Range: request */
 static int maxCpu = MAX_CPU;     /* Maximum CPU time per process */
+static int nWorker = 0;          /* Number of pre-forked workers. 0 for none */
+static int inWorker = 0;         /* True if this is a long-lived worker */
+static sigjmp_buf workerEnd;     /* Where a worker goes after a connection */
+static int nListener = 0;        /* Number of listening sockets */
+static int aListener[20];        /* The listening sockets */
+static int listenBacklog = 20;   /* Backlog for listen() on each socket */
+static int reusePort = 0;        /* Each worker binds its own SO_REUSEPORT */
+static int maxRequest = 100;     /* Keep-alive requests per connection */
+static int keepAliveTimeout = 15; /* Max seconds idle between requests */
+static int maxLifetime = 0;      /* Max seconds of keep-alive.  0 for none */
+static int shedLoad = 90;        /* Busy percent at which keep-alive stops */
+static time_t connBegin = 0;     /* When the current connection was opened */
+static int iWorker = 0;          /* Index of this worker in aBusy[] */
+static pid_t supervisor = 0;     /* Process id of the parent of the workers */
+static int nFileCache = 64;      /* Max entries in the static file cache */
+static int fileCacheTtl = 2;     /* Seconds before a cache entry is rechecked */
+static int fdContent = -1;       /* Static content file not in the cache */
+static int nScgiSpare = 0;       /* Max SCGI servers with a spare connection */
+static int scgiDnsTtl = 60;      /* Seconds to reuse an SCGI server address */
+static volatile unsigned char *aBusy = 0;  /* Shared. Which workers are busy */
 
 /*
 ** Mapping between CGI variable names and values stored in
@@ -381,6 +584,58 @@ static struct {
 };
 
 
+/*
+** Strings that live only for the duration of one request are carved
+** from a bump-pointer arena that ArenaReset() empties at the start of
+** each request.  The first ARENA_CHUNK_SIZE bytes are static.  Should a
+** request need more than that, additional chunks come from malloc()
+** and are released by the next ArenaReset().  Memory obtained from
+** the arena must never be passed to free().
+*/
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+  ArenaChunk *pNext;        /* Next older overflow chunk */
+};
+static char zArenaFirst[ARENA_CHUNK_SIZE]; /* The static first chunk */
+static char *zArenaFree = zArenaFirst;  /* Next unused arena byte */
+static size_t nArenaFree = ARENA_CHUNK_SIZE; /* Bytes left in the chunk */
+static ArenaChunk *pArenaChunk = 0;    /* Overflow chunks from malloc() */
+
+/*
+** Release all memory obtained from ArenaAlloc().
+*/
+static void ArenaReset(void){
+  while( pArenaChunk ){
+    ArenaChunk *pNext = pArenaChunk->pNext;
+    free(pArenaChunk);
+    pArenaChunk = pNext;
+  }
+  zArenaFree = zArenaFirst;
+  nArenaFree = ARENA_CHUNK_SIZE;
+}
+
+/*
+** Allocate memory that lasts until the next ArenaReset().  Return NULL
+** if malloc() fails.  Most callers want SafeMalloc() instead.
+*/
+static char *ArenaAlloc(size_t size){
+  char *p;
+  if( size>nArenaFree ){
+    size_t nChunk = size>ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    ArenaChunk *pNew;
+    pNew = (ArenaChunk*)malloc( sizeof(ArenaChunk) + nChunk );
+    if( pNew==0 ) return 0;
+    pNew->pNext = pArenaChunk;
+    pArenaChunk = pNew;
+    zArenaFree = (char*)&pNew[1];
+    nArenaFree = nChunk;
+  }
+  p = zArenaFree;
+  zArenaFree += size;
+  nArenaFree -= size;
+  return p;
+}
+
 /*
 ** Double any double-quote characters in a string.
 */
@@ -393,7 +648,7 @@ static char *Escape(char *z){
   if( c==0 ) return z;
   n = 1;
   for(i++; (c=z[i])!=0; i++){ if( c=='"' ) n++; }
-  zOut = malloc( i+n+1 );
+  zOut = ArenaAlloc( i+n+1 );
   if( zOut==0 ) return "";
   for(i=j=0; (c=z[i])!=0; i++){
     zOut[j++] = c;
@@ -411,1962 +666,6731 @@ static long long int tvms(struct timeval *p){
 }
 
 /*
-** Make an entry in the log file.  If the HTTP connection should be
-** closed, then terminate this process.  Otherwise return.
+** Finish with the current connection.  Normally this terminates the
+** process.  A long-lived worker instead returns to WorkerLoop() to wait
+** for the next connection.
 */
-static void MakeLogEntry(int exitCode, int lineNum){
-  FILE *log;
-  if( zTmpNam ){
-    unlink(zTmpNam);
+static void althttpd_exit(int iCode){
+  if( pidFeeder>0 ){
+    kill(pidFeeder, SIGKILL);
+    waitpid(pidFeeder, 0, 0);
+    pidFeeder = 0;
   }
-  if( zLogFile && !omitLog ){
-    struct timeval now;
-    struct tm *pTm;
-    struct rusage self, children;
-    int waitStatus;
-    char *zRM = zRemoteUser ? zRemoteUser : "";
-    char *zFilename;
-    size_t sz;
-    char zDate[200];
-    char zExpLogFile[500];
+  if( inWorker ){
+    fflush(stdout);
+    siglongjmp(workerEnd, 1);
+  }
+  exit(iCode);
+}
 
-    if( zScript==0 ) zScript = "";
-    if( zRealScript==0 ) zRealScript = "";
-    if( zRemoteAddr==0 ) zRemoteAddr = "";
-    if( zHttpHost==0 ) zHttpHost = "";
-    if( zReferer==0 ) zReferer = "";
-    if( zAgent==0 ) zAgent = "";
-    gettimeofday(&now, 0);
-    pTm = localtime(&now.tv_sec);
-    strftime(zDate, sizeof(zDate), "%Y-%m-%d %H:%M:%S", pTm);
-    sz = strftime(zExpLogFile, sizeof(zExpLogFile), zLogFile, pTm);
-    if( sz>0 && sz<sizeof(zExpLogFile)-2 ){
-      zFilename = zExpLogFile;
-    }else{
-      zFilename = zLogFile;
-    }
-    waitpid(-1, &waitStatus, WNOHANG);
-    getrusage(RUSAGE_SELF, &self);
-    getrusage(RUSAGE_CHILDREN, &children);
-    if( (log = fopen(zFilename,"a"))!=0 ){
-#ifdef COMBINED_LOG_FORMAT
-      strftime(zDate, sizeof(zDate), "%d/%b/%Y:%H:%M:%S %Z", pTm);
-      fprintf(log, "%s - - [%s] \"%s %s %s\" %s %d \"%s\" \"%s\"\n",
-              zRemoteAddr, zDate, zMethod, zScript, zProtocol,
-              zReplyStatus, nOut, zReferer, zAgent);
-#else
-      strftime(zDate, sizeof(zDate), "%Y-%m-%d %H:%M:%S", pTm);
-      /* Log record files:
-      **  (1) Date and time
-      **  (2) IP address
-      **  (3) URL being accessed
-      **  (4) Referer
-      **  (5) Reply status
-      **  (6) Bytes received
-      **  (7) Bytes sent
-      **  (8) Self user time
-      **  (9) Self system time
-      ** (10) Children user time
-      ** (11) Children system time
-      ** (12) Total wall-clock time
-      ** (13) Request number for same TCP/IP connection
-      ** (14) User agent
-      ** (15) Remote user
-      ** (16) Bytes of URL that correspond to the SCRIPT_NAME
-      ** (17) Line number in source file
-      */
-      fprintf(log,
-        "%s,%s,\"%s://%s%s\",\"%s\","
-           "%s,%d,%d,%lld,%lld,%lld,%lld,%lld,%d,\"%s\",\"%s\",%d,%d\n",
-        zDate, zRemoteAddr, zHttp, Escape(zHttpHost), Escape(zScript),
-        Escape(zReferer), zReplyStatus, nIn, nOut,
-        tvms(&self.ru_utime) - tvms(&priorSelf.ru_utime),
-        tvms(&self.ru_stime) - tvms(&priorSelf.ru_stime),
-        tvms(&children.ru_utime) - tvms(&priorChild.ru_utime),
-        tvms(&children.ru_stime) - tvms(&priorChild.ru_stime),
-        tvms(&now) - tvms(&beginTime),
-        nRequest, Escape(zAgent), Escape(zRM),
-        (int)(strlen(zHttp)+strlen(zHttpHost)+strlen(zRealScript)+3),
-        lineNum
-      );
-      priorSelf = self;
-      priorChild = children;
+/*
+** Log entries are formatted into zLogBuf[] and written to the log file
+** with a single write() when the buffer fills, when the oldest entry is
+** logFlush seconds old, when the process is about to wait for input, and
+** at exit.  The log file stays open until the strftime() expansion of its
+** name changes or the file is renamed away, so an entry usually costs no
+** system calls beyond getrusage().
+*/
+#ifndef LOG_BUFFER_SIZE
+# define LOG_BUFFER_SIZE 16384
 #endif
-      fclose(log);
-      nIn = nOut = 0;
+static char zLogBuf[LOG_BUFFER_SIZE];  /* Entries not yet written */
+static int nLogBuf = 0;          /* Bytes of content in zLogBuf[] */
+static time_t tLogFirst = 0;     /* When the oldest entry was buffered */
+static pid_t pidLog = 0;         /* Process that owns the buffered entries */
+static int fdLog = -1;           /* The open log file */
+static char zLogOpen[500];       /* Name of the open log file */
+#define LOG_BLOCK_HDR 8          /* Size of a binary log block header */
+
+/*
+** Write any buffered log entries to the log file.  Entries inherited by
+** a child process across fork() belong to the parent and are discarded.
+*/
+static void LogFlush(void){
+  if( nLogBuf==0 ) return;
+  if( fdLog>=0 && pidLog==getpid() ){
+    char *z = zLogBuf;
+    int n = nLogBuf;
+    if( logBinary ){
+      /* Fill in the payload size in the binary block header */
+      unsigned int sz = (unsigned int)(n - LOG_BLOCK_HDR);
+      z[4] = (char)(sz & 0xff);
+      z[5] = (char)((sz>>8) & 0xff);
+      z[6] = (char)((sz>>16) & 0xff);
+      z[7] = (char)((sz>>24) & 0xff);
+    }
+    while( n>0 ){
+      int got = (int)write(fdLog, z, n);
+      if( got<0 && errno==EINTR ) continue;
+      if( got<=0 ) break;
+      z += got;
+      n -= got;
     }
   }
-  if( closeConnection ){
-    exit(exitCode);
-  }
-  statusSent = 0;
+  nLogBuf = 0;
 }
 
 /*
-** Allocate memory safely
+** Flush the log buffer if its oldest entry has been there long enough.
 */
-static char *SafeMalloc( size_t size ){
-  char *p;
-
-  p = (char*)malloc(size);
-  if( p==0 ){
-    strcpy(zReplyStatus, "998");
-    MakeLogEntry(1,100);  /* LOG: Malloc() failed */
-    exit(1);
-  }
-  return p;
+static void LogFlushIfOld(time_t now){
+  if( nLogBuf>0 && now - tLogFirst >= logFlush ) LogFlush();
 }
 
 /*
-** Set the value of environment variable zVar to zValue.
+** Make sure the log file zName is open.  Return 0 on success or -1 if the
+** file cannot be opened.  Every second or so, also check that the open
+** file has not been renamed or removed, as a log rotation would do.
 */
-static void SetEnv(const char *zVar, const char *zValue){
-  char *z;
-  size_t len;
-  if( zValue==0 ) zValue="";
-  /* Disable an attempted bashdoor attack */
-  if( strncmp(zValue,"() {",4)==0 ) zValue = "";
-  len = strlen(zVar) + strlen(zValue) + 2;
-  z = SafeMalloc(len);
-  sprintf(z,"%s=%s",zVar,zValue);
-  putenv(z);
+static int LogOpen(const char *zName, time_t now){
+  static time_t tCheck = 0;
+  struct stat sA, sB;
+  if( fdLog>=0 && strcmp(zName, zLogOpen)==0 ){
+    if( now==tCheck ) return 0;
+    tCheck = now;
+    if( stat(zName, &sA)==0 && fstat(fdLog, &sB)==0
+     && sA.st_ino==sB.st_ino && sA.st_dev==sB.st_dev
+    ){
+      return 0;
+    }
+  }
+  LogFlush();
+  if( fdLog>=0 ) close(fdLog);
+  fdLog = open(zName, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0666);
+  if( fdLog<0 ) return -1;
+  if( strlen(zName)<sizeof(zLogOpen) ){
+    strcpy(zLogOpen, zName);
+  }else{
+    zLogOpen[0] = 0;
+  }
+  tCheck = now;
+  if( pidLog==0 ) atexit(LogFlush);
+  pidLog = getpid();
+  return 0;
 }
 
 /*
-** Remove the first space-delimited token from a string and return
-** a pointer to it.  Add a NULL to the string to terminate the token.
-** Make *zLeftOver point to the start of the next token.
+** Append a formatted entry to the log buffer, flushing the buffer first if
+** the entry will not fit.  An entry too big for the buffer is written
+** directly.
 */
-static char *GetFirstElement(char *zInput, char **zLeftOver){
-  char *zResult = 0;
-  if( zInput==0 ){
-    if( zLeftOver ) *zLeftOver = 0;
-    return 0;
+static void LogAppend(time_t now, const char *zFormat, ...){
+  va_list ap;
+  int n;
+  if( nLogBuf>0 && pidLog!=getpid() ) nLogBuf = 0;
+  va_start(ap, zFormat);
+  n = vsnprintf(&zLogBuf[nLogBuf], sizeof(zLogBuf)-nLogBuf, zFormat, ap);
+  va_end(ap);
+  if( n>=0 && nLogBuf+n<(int)sizeof(zLogBuf) ){
+    if( nLogBuf==0 ){
+      tLogFirst = now;
+      pidLog = getpid();
+    }
+    nLogBuf += n;
+    return;
   }
-  while( isspace(*(unsigned char*)zInput) ){ zInput++; }
-  zResult = zInput;
-  while( *zInput && !isspace(*(unsigned char*)zInput) ){ zInput++; }
-  if( *zInput ){
-    *zInput = 0;
-    zInput++;
-    while( isspace(*(unsigned char*)zInput) ){ zInput++; }
+  LogFlush();
+  if( n<0 ) return;
+  if( n<(int)sizeof(zLogBuf) ){
+    va_start(ap, zFormat);
+    vsnprintf(zLogBuf, sizeof(zLogBuf), zFormat, ap);
+    va_end(ap);
+  }else{
+    va_start(ap, zFormat);
+    vdprintf(fdLog, zFormat, ap);
+    va_end(ap);
+    n = 0;
   }
-  if( zLeftOver ){ *zLeftOver = zInput; }
-  return zResult;
+  tLogFirst = now;
+  pidLog = getpid();
+  nLogBuf = n;
 }
 
 /*
-** Make a copy of a string into memory obtained from malloc.
+** Server-wide statistics, kept in memory that the supervisor maps before
+** it forks, so that every process of a stand-alone server adds to the
+** same counters.  Counters are updated with atomic operations.  When
+** there is no supervisor, pStats points to memory private to this
+** process.
+**
+** Latency is recorded in histograms, one for each phase of a request,
+** with the bucket bounds in aStatsBound[] (microseconds) plus a final
+** unbounded bucket.
 */
-static char *StrDup(const char *zSrc){
-  char *zDest;
-  size_t size;
+#define STATS_NBUCKET 14
+static const int aStatsBound[STATS_NBUCKET] = {
+  500, 1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+#define STATS_PHASE_TOTAL    0   /* Whole request */
+#define STATS_PHASE_HEADER   1   /* Parse the request header */
+#define STATS_PHASE_HOST     2   /* Find the *.website directory */
+#define STATS_PHASE_PATH     3   /* Find the file */
+#define STATS_PHASE_AUTH     4   /* Check an -auth file */
+#define STATS_PHASE_START    5   /* Start CGI, or connect to SCGI */
+#define STATS_PHASE_BACKEND  6   /* Wait for the CGI or SCGI reply header */
+#define STATS_PHASE_SEND     7   /* Send the reply */
+#define STATS_NPHASE         8
+static const char *azStatsPhase[STATS_NPHASE] = {
+  "total", "header", "host", "path", "auth", "start", "backend", "send"
+};
+typedef struct StatsHist StatsHist;
+struct StatsHist {
+  unsigned long long aCount[STATS_NBUCKET+1];  /* Requests in each bucket */
+  unsigned long long nSum;                     /* Sum of all, microseconds */
+};
+typedef struct ServerStats ServerStats;
+struct ServerStats {
+  long long tStart;                  /* When the server started */
+  unsigned long long nConn;          /* Connections accepted */
+  unsigned long long nRequest;       /* Requests completed */
+  unsigned long long aClass[6];      /* Requests by reply status 1xx..5xx.
+                                     ** aClass[0] for anything else */
+  unsigned long long nIn, nOut;      /* Bytes received and sent */
+  unsigned long long nScgiHit;       /* SCGI requests that used a spare */
+  unsigned long long nScgiMiss;      /* SCGI requests that found no spare */
+  unsigned long long nScgiReconnect; /* Spares found broken and replaced */
+  int nChild;                        /* Connection processes, no --workers */
+  int nWorker;                       /* Entries in anConn[] */
+  StatsHist aHist[STATS_NPHASE];     /* Latency of each phase */
+  int anConn[1];                     /* Connections held by each worker */
+};
+static ServerStats sLocalStats;          /* Used when nothing is shared */
+static ServerStats *pStats = &sLocalStats;  /* The statistics */
+static int nInStats = 0;         /* Part of nIn already added to pStats */
+static int nOutStats = 0;        /* Part of nOut already added to pStats */
 
-  if( zSrc==0 ) return 0;
-  size = strlen(zSrc) + 1;
-  zDest = (char*)SafeMalloc( size );
-  strcpy(zDest,zSrc);
-  return zDest;
-}
-static char *StrAppend(char *zPrior, const char *zSep, const char *zSrc){
-  char *zDest;
-  size_t size;
-  size_t n0, n1, n2;
+#define STATS_ADD(X,N)  __atomic_fetch_add(&pStats->X, (N), __ATOMIC_RELAXED)
 
-  if( zSrc==0 ) return 0;
-  if( zPrior==0 ) return StrDup(zSrc);
-  n0 = strlen(zPrior);
-  n1 = strlen(zSep);
-  n2 = strlen(zSrc);
-  size = n0+n1+n2+1;
-  zDest = (char*)SafeMalloc( size );
-  memcpy(zDest, zPrior, n0);
-  free(zPrior);
-  memcpy(&zDest[n0],zSep,n1);
-  memcpy(&zDest[n0+n1],zSrc,n2+1);
-  return zDest;
+/*
+** Create the shared statistics block.  Call this before forking.
+*/
+static void StatsInit(void){
+  size_t sz = sizeof(ServerStats) + nWorker*sizeof(int);
+  void *pShared;
+  pShared = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if( pShared!=MAP_FAILED ){
+    pStats = pShared;
+    pStats->nWorker = nWorker;
+  }
+  pStats->tStart = time(0);
 }
 
 /*
-** Compare two ETag values. Return 0 if they match and non-zero if they differ.
-**
-** The one on the left might be a NULL pointer and it might be quoted.
+** Add iUs microseconds to the latency histogram for phase iPhase.
 */
-static int CompareEtags(const char *zA, const char *zB){
-  if( zA==0 ) return 1;
-  if( zA[0]=='"' ){
-    int lenB = (int)strlen(zB);
-    if( strncmp(zA+1, zB, lenB)==0 && zA[lenB+1]=='"' ) return 0;
-  }
-  return strcmp(zA, zB);
+static void StatsLatency(int iPhase, long long iUs){
+  int i;
+  if( iUs<0 ) iUs = 0;
+  for(i=0; i<STATS_NBUCKET && iUs>aStatsBound[i]; i++){}
+  STATS_ADD(aHist[iPhase].aCount[i], 1);
+  STATS_ADD(aHist[iPhase].nSum, (unsigned long long)iUs);
 }
 
 /*
-** Break a line at the first \n or \r character seen.
+** Record the number of connections that this worker holds.
 */
-static void RemoveNewline(char *z){
-  if( z==0 ) return;
-  while( *z && *z!='\n' && *z!='\r' ){ z++; }
-  *z = 0;
+static void StatsWorkerConn(int nConn){
+  if( inWorker && iWorker<pStats->nWorker ) pStats->anConn[iWorker] = nConn;
 }
 
-/* Render seconds since 1970 as an RFC822 date string.  Return
-** a pointer to that string in a static buffer.
+/*
+** Microseconds on a monotonic clock.
 */
-static char *Rfc822Date(time_t t){
-  struct tm *tm;
-  static char zDate[100];
-  tm = gmtime(&t);
-  strftime(zDate, sizeof(zDate), "%a, %d %b %Y %H:%M:%S %Z", tm);
-  return zDate;
+static long long MonotonicUs(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
 }
 
 /*
-** Print a date tag in the header.  The name of the tag is zTag.
-** The date is determined from the unix timestamp given.
+** The time taken by each phase of the current request.  PhaseMark(i)
+** charges the time since the previous mark to phase i, so a phase can
+** be visited more than once.  The marks cost one read of the monotonic
+** clock each.
 */
-static int DateTag(const char *zTag, time_t t){
-  return printf("%s: %s\r\n", zTag, Rfc822Date(t));
+static long long tPhase = 0;           /* Time of the previous mark */
+static int aPhaseUs[STATS_NPHASE];     /* Microseconds in each phase */
+static unsigned int mPhase = 0;        /* Phases reached.  1<<i for phase i */
+
+/*
+** Start timing the phases of a new request.
+*/
+static void PhaseBegin(void){
+  memset(aPhaseUs, 0, sizeof(aPhaseUs));
+  mPhase = 0;
+  tPhase = MonotonicUs();
 }
 
 /*
-** Parse an RFC822-formatted timestamp as we'd expect from HTTP and return
-** a Unix epoch time. <= zero is returned on failure.
+** End a stretch of phase iPhase.
 */
-time_t ParseRfc822Date(const char *zDate){
-  int mday, mon, year, yday, hour, min, sec;
-  char zIgnore[4];
-  char zMonth[4];
-  static const char *const azMonths[] =
-    {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
-     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-  if( 7==sscanf(zDate, "%3[A-Za-z], %d %3[A-Za-z] %d %d:%d:%d", zIgnore,
-                       &mday, zMonth, &year, &hour, &min, &sec)){
-    if( year > 1900 ) year -= 1900;
-    for(mon=0; mon<12; mon++){
-      if( !strncmp( azMonths[mon], zMonth, 3 )){
-        int nDay;
-        int isLeapYr;
-        static int priorDays[] =
-         {  0, 31, 59, 90,120,151,181,212,243,273,304,334 };
-        isLeapYr = year%4==0 && (year%100!=0 || (year+300)%400==0);
-        yday = priorDays[mon] + mday - 1;
-        if( isLeapYr && mon>1 ) yday++;
-        nDay = (year-70)*365 + (year-69)/4 - year/100 + (year+300)/400 + yday;
-        return ((time_t)(nDay*24 + hour)*60 + min)*60 + sec;
-      }
-    }
-  }
-  return 0;
+static void PhaseMark(int iPhase){
+  long long now = MonotonicUs();
+  aPhaseUs[iPhase] += (int)(now - tPhase);
+  mPhase |= 1<<iPhase;
+  tPhase = now;
 }
 
 /*
-** Test procedure for ParseRfc822Date
+** Count the request that is just finishing.
 */
-void TestParseRfc822Date(void){
-  time_t t1, t2;
-  for(t1=0; t1<0x7fffffff; t1 += 127){
-    t2 = ParseRfc822Date(Rfc822Date(t1));
-    assert( t1==t2 );
+static void StatsRequestDone(void){
+  struct timeval now;
+  int c = zReplyStatus[0];
+  int i;
+  gettimeofday(&now, 0);
+  STATS_ADD(nRequest, 1);
+  STATS_ADD(aClass[c>='1' && c<='5' ? c-'0' : 0], 1);
+  STATS_ADD(nIn, (unsigned long long)(nIn - nInStats));
+  STATS_ADD(nOut, (unsigned long long)(nOut - nOutStats));
+  nInStats = nIn;
+  nOutStats = nOut;
+  StatsLatency(STATS_PHASE_TOTAL, tvms(&now) - tvms(&beginTime));
+  for(i=1; i<STATS_NPHASE; i++){
+    if( mPhase & (1<<i) ) StatsLatency(i, aPhaseUs[i]);
   }
 }
 
 /*
-** Print the first line of a response followed by the server type.
+** One access-log entry, holding everything needed to format it.  The
+** strings are packed into z[], each terminated by a zero byte, in the
+** order of the LOGSTR_* codes.  Strings that do not fit are truncated.
 */
-static void StartResponse(const char *zResultCode){
-  time_t now;
-  time(&now);
-  if( statusSent ) return;
-  nOut += printf("%s %s\r\n", zProtocol, zResultCode);
-  strncpy(zReplyStatus, zResultCode, 3);
-  zReplyStatus[3] = 0;
-  if( zReplyStatus[0]>='4' ){
-    closeConnection = 1;
-  }
-  if( closeConnection ){
-    nOut += printf("Connection: close\r\n");
-  }else{
-    nOut += printf("Connection: keep-alive\r\n");
+#ifndef LOG_RECORD_TEXT
+# define LOG_RECORD_TEXT 2000
+#endif
+#define LOGSTR_ADDR       0    /* Remote IP address */
+#define LOGSTR_SCHEME     1    /* "http" or "https" */
+#define LOGSTR_HOST       2    /* HTTP_HOST */
+#define LOGSTR_SCRIPT     3    /* Request URI */
+#define LOGSTR_REFERER    4    /* Referer: */
+#define LOGSTR_AGENT      5    /* User-Agent: */
+#define LOGSTR_USER       6    /* REMOTE_USER */
+#define LOGSTR_METHOD     7    /* Request method */
+#define LOGSTR_PROTOCOL   8    /* Request protocol */
+#define LOGSTR_COUNT      9
+typedef struct LogRecord LogRecord;
+struct LogRecord {
+  long long tNow;          /* Time of the entry, in seconds */
+  long long aUs[5];        /* Self user, self system, children user,
+                           ** children system and wall-clock microseconds */
+  int nIn, nOut;           /* Bytes received and sent */
+  int nRequest;            /* Request number on this connection */
+  int nScriptName;         /* Bytes of URL that are the SCRIPT_NAME */
+  int lineNum;             /* Line number in the source file */
+  char zStatus[4];         /* Reply status */
+  int nPhase;              /* Entries in aPhase[].  0 if not logged */
+  int aPhase[STATS_NPHASE-1];  /* aPhaseUs[1] and following */
+  unsigned short aiStr[LOGSTR_COUNT];  /* Offset of each string in z[] */
+  char z[LOG_RECORD_TEXT]; /* Text of the strings */
+};
+
+/*
+** Pack string zVal into p as its iStr-th string.  n is the number of
+** bytes of p->z[] already used.  Return the new number of bytes used.
+*/
+static int LogRecordString(LogRecord *p, int iStr, const char *zVal, int n){
+  int len = zVal ? (int)strlen(zVal) : 0;
+  if( len > LOG_RECORD_TEXT - 1 - n - (LOGSTR_COUNT - 1 - iStr) ){
+    len = LOG_RECORD_TEXT - 1 - n - (LOGSTR_COUNT - 1 - iStr);
   }
-  nOut += DateTag("Date", now);
-  statusSent = 1;
+  p->aiStr[iStr] = (unsigned short)n;
+  if( len>0 ) memcpy(&p->z[n], zVal, len);
+  p->z[n+len] = 0;
+  return n + len + 1;
 }
 
+#ifdef COMBINED_LOG_FORMAT
+# define LOG_DATE_FORMAT "%d/%b/%Y:%H:%M:%S %Z"
+#else
+# define LOG_DATE_FORMAT "%Y-%m-%d %H:%M:%S"
+#endif
+
 /*
-** Tell the client that there is no such document
+** Append log entry p to the log buffer as text.  zDate is the time of
+** the entry, already formatted.
 */
-static void NotFound(int lineno){
-  StartResponse("404 Not Found");
-  nOut += printf(
-    "Content-type: text/html; charset=utf-8\r\n"
-    "\r\n"
-    "<head><title lineno=\"%d\">Not Found</title></head>\n"
-    "<body><h1>Document Not Found</h1>\n"
-    "The document %s is not available on this server\n"
-    "</body>\n", lineno, zScript);
-  MakeLogEntry(0, lineno);
-  exit(0);
+static void LogRecordText(LogRecord *p, const char *zDate){
+  time_t tNow = (time_t)p->tNow;
+#define LOGSTR(I) (&p->z[p->aiStr[I]])
+#ifdef COMBINED_LOG_FORMAT
+  LogAppend(tNow,
+          "%s - - [%s] \"%s %s %s\" %s %d \"%s\" \"%s\"\n",
+          LOGSTR(LOGSTR_ADDR), zDate, LOGSTR(LOGSTR_METHOD),
+          LOGSTR(LOGSTR_SCRIPT), LOGSTR(LOGSTR_PROTOCOL),
+          p->zStatus, p->nOut, LOGSTR(LOGSTR_REFERER), LOGSTR(LOGSTR_AGENT));
+#else
+  /* Log record files:
+  **  (1) Date and time
+  **  (2) IP address
+  **  (3) URL being accessed
+  **  (4) Referer
+  **  (5) Reply status
+  **  (6) Bytes received
+  **  (7) Bytes sent
+  **  (8) Self user time
+  **  (9) Self system time
+  ** (10) Children user time
+  ** (11) Children system time
+  ** (12) Total wall-clock time
+  ** (13) Request number for same TCP/IP connection
+  ** (14) User agent
+  ** (15) Remote user
+  ** (16) Bytes of URL that correspond to the SCRIPT_NAME
+  ** (17) Line number in source file
+  ** (18) With --log-phases, microseconds spent in each of the phases
+  **  ..  STATS_PHASE_HEADER through STATS_PHASE_SEND, one field each
+  ** (24)
+  */
+  char zPhase[STATS_NPHASE*12];
+  int i, n = 0;
+  zPhase[0] = 0;
+  for(i=0; i<p->nPhase; i++){
+    n += snprintf(&zPhase[n], sizeof(zPhase)-n, ",%d", p->aPhase[i]);
+  }
+  LogAppend(tNow,
+    "%s,%s,\"%s://%s%s\",\"%s\","
+       "%s,%d,%d,%lld,%lld,%lld,%lld,%lld,%d,\"%s\",\"%s\",%d,%d%s\n",
+    zDate, LOGSTR(LOGSTR_ADDR), LOGSTR(LOGSTR_SCHEME),
+    Escape(LOGSTR(LOGSTR_HOST)), Escape(LOGSTR(LOGSTR_SCRIPT)),
+    Escape(LOGSTR(LOGSTR_REFERER)), p->zStatus, p->nIn, p->nOut,
+    p->aUs[0], p->aUs[1], p->aUs[2], p->aUs[3], p->aUs[4],
+    p->nRequest, Escape(LOGSTR(LOGSTR_AGENT)), Escape(LOGSTR(LOGSTR_USER)),
+    p->nScriptName, p->lineNum, zPhase
+  );
+#endif
+#undef LOGSTR
 }
 
 /*
-** Tell the client that they are not welcomed here.
+** The binary log format, used with --log-binary.
+**
+** The file is a sequence of blocks, one for each write() of the log
+** buffer.  A block starts with the 4 bytes "AHL\001" and a 4-byte
+** little-endian count of the bytes that follow in the block.  Then come
+** the entries, each a 2-byte little-endian size followed by that many
+** bytes of content.  Content beyond what a decoder understands is
+** ignored, so fields can be added at the end.
+**
+** Numbers are stored as varints of 7 bits per byte, least significant
+** group first, with the 0x80 bit set on all bytes but the last.  Signed
+** values are zig-zag encoded first.  An entry holds, in order:
+**
+**     Seconds since the previous entry in the block (or since 1970)
+**     The five aUs[] times
+**     nIn, nOut, nRequest, nScriptName, lineNum
+**     The reply status, then the LOGSTR_* strings in order
+**     Optionally, the number of phase times, then each time
+**
+** Each string is a varint T.  If T is even, T/2 bytes of text follow.
+** If T is odd, the string is the same as the (T/2)-th text string that
+** appeared earlier in the block, counting from zero.  Because each block
+** stands alone, separate processes can append to the same file.
 */
-static void Forbidden(int lineno){
-  StartResponse("403 Forbidden");
-  nOut += printf(
-    "Content-type: text/plain; charset=utf-8\r\n"
-    "\r\n"
-    "Access denied\n"
-  );
-  closeConnection = 1;
-  MakeLogEntry(0, lineno);
-  exit(0);
-}
+#ifndef LOG_INTERN_SLOTS
+# define LOG_INTERN_SLOTS 512      /* Must be a power of two */
+#endif
+typedef struct LogIntern LogIntern;
+struct LogIntern {
+  unsigned int h;           /* Hash of the string */
+  int iOfst;                /* Offset of the text in zLogBuf[] */
+  int nByte;                /* Length of the text */
+  int iLit;                 /* Which text string of the block.  -1: unused */
+};
+static LogIntern aLogIntern[LOG_INTERN_SLOTS];  /* Strings in this block */
+static int nLogIntern = 0;       /* Entries in use in aLogIntern[] */
+static int nLogLit = 0;          /* Text strings so far in this block */
+static long long tLogPrev = 0;   /* Time of the previous entry in the block */
+
+#define LOG_ZIGZAG(X) \
+    (((unsigned long long)(X)<<1) ^ (unsigned long long)((X)>>63))
 
 /*
-** Tell the client that authorization is required to access the
-** document.
+** Write v as a varint into a[].  Return the number of bytes used.
 */
-static void NotAuthorized(const char *zRealm){
-  StartResponse("401 Authorization Required");
-  nOut += printf(
-    "WWW-Authenticate: Basic realm=\"%s\"\r\n"
-    "Content-type: text/html; charset=utf-8\r\n"
-    "\r\n"
-    "<head><title>Not Authorized</title></head>\n"
-    "<body><h1>401 Not Authorized</h1>\n"
-    "A login and password are required for this document\n"
-    "</body>\n", zRealm);
-  MakeLogEntry(0, 110);  /* LOG: Not authorized */
+static int LogPutVarint(unsigned char *a, unsigned long long v){
+  int n = 0;
+  while( v>=0x80 ){
+    a[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  a[n++] = (unsigned char)v;
+  return n;
 }
 
 /*
-** Tell the client that there is an error in the script.
+** Write string z of n bytes into the log buffer at offset i, either as
+** text or as a reference to an identical earlier string in the block.
+** Return the number of bytes used.
 */
-static void CgiError(void){
-  StartResponse("500 Error");
-  nOut += printf(
-    "Content-type: text/html; charset=utf-8\r\n"
-    "\r\n"
-    "<head><title>CGI Program Error</title></head>\n"
-    "<body><h1>CGI Program Error</h1>\n"
-    "The CGI program %s generated an error\n"
-    "</body>\n", zScript);
-  MakeLogEntry(0, 120);  /* LOG: CGI Error */
-  exit(0);
+static int LogPutString(int i, const char *z, int n){
+  unsigned char *a = (unsigned char*)&zLogBuf[i];
+  unsigned int h = 2166136261u;
+  int j, k, iSlot;
+  for(j=0; j<n; j++) h = (h ^ (unsigned char)z[j])*16777619u;
+  iSlot = h & (LOG_INTERN_SLOTS-1);
+  while( aLogIntern[iSlot].iLit>=0 ){
+    LogIntern *pI = &aLogIntern[iSlot];
+    if( pI->h==h && pI->nByte==n && memcmp(&zLogBuf[pI->iOfst], z, n)==0 ){
+      return LogPutVarint(a, (unsigned long long)pI->iLit*2 + 1);
+    }
+    iSlot = (iSlot+1) & (LOG_INTERN_SLOTS-1);
+  }
+  k = LogPutVarint(a, (unsigned long long)n*2);
+  memcpy(&a[k], z, n);
+  if( nLogIntern < LOG_INTERN_SLOTS/2 ){
+    aLogIntern[iSlot].h = h;
+    aLogIntern[iSlot].iOfst = i + k;
+    aLogIntern[iSlot].nByte = n;
+    aLogIntern[iSlot].iLit = nLogLit;
+    nLogIntern++;
+  }
+  nLogLit++;
+  return k + n;
 }
 
 /*
-** This is called if we timeout or catch some other kind of signal.
-** Log an error code which is 900+iSig and then quit.
+** Append log entry p to the log buffer in the binary format.
 */
-static void Timeout(int iSig){
-  if( !debugFlag ){
-    if( zScript && zScript[0] ){
-      char zBuf[10];
-      zBuf[0] = '9';
-      zBuf[1] = '0' + (iSig/10)%10;
-      zBuf[2] = '0' + iSig%10;
-      zBuf[3] = 0;
-      strcpy(zReplyStatus, zBuf);
-      MakeLogEntry(0, 130);  /* LOG: Timeout */
+static void LogRecordBinary(LogRecord *p){
+  time_t tNow = (time_t)p->tNow;
+  unsigned char *a;
+  int i, n, nMax;
+  int aLen[LOGSTR_COUNT];
+  if( nLogBuf>0 && pidLog!=getpid() ) nLogBuf = 0;
+
+  /* Make sure the entry fits, even if no string is a repeat */
+  nMax = 2 + (11 + STATS_NPHASE)*10 + 3 + 3;
+  for(i=0; i<LOGSTR_COUNT; i++){
+    aLen[i] = (int)strlen(&p->z[p->aiStr[i]]);
+    nMax += 3 + aLen[i];
+  }
+  if( nLogBuf>0 && nLogBuf+nMax>(int)sizeof(zLogBuf) ) LogFlush();
+  if( nLogBuf==0 ){
+    memcpy(zLogBuf, "AHL\001\000\000\000\000", LOG_BLOCK_HDR);
+    nLogBuf = LOG_BLOCK_HDR;
+    for(i=0; i<LOG_INTERN_SLOTS; i++) aLogIntern[i].iLit = -1;
+    nLogIntern = 0;
+    nLogLit = 0;
+    tLogPrev = 0;
+    tLogFirst = tNow;
+    pidLog = getpid();
+  }
+
+  /* Leave room for the size, then write the content */
+  a = (unsigned char*)&zLogBuf[nLogBuf];
+  n = 2;
+  n += LogPutVarint(&a[n], LOG_ZIGZAG(p->tNow - tLogPrev));
+  tLogPrev = p->tNow;
+  for(i=0; i<5; i++) n += LogPutVarint(&a[n], LOG_ZIGZAG(p->aUs[i]));
+  n += LogPutVarint(&a[n], LOG_ZIGZAG((long long)p->nIn));
+  n += LogPutVarint(&a[n], LOG_ZIGZAG((long long)p->nOut));
+  n += LogPutVarint(&a[n], LOG_ZIGZAG((long long)p->nRequest));
+  n += LogPutVarint(&a[n], LOG_ZIGZAG((long long)p->nScriptName));
+  n += LogPutVarint(&a[n], LOG_ZIGZAG((long long)p->lineNum));
+  n += LogPutString(nLogBuf+n, p->zStatus, (int)strlen(p->zStatus));
+  for(i=0; i<LOGSTR_COUNT; i++){
+    n += LogPutString(nLogBuf+n, &p->z[p->aiStr[i]], aLen[i]);
+  }
+  if( p->nPhase ){
+    n += LogPutVarint(&a[n], (unsigned long long)p->nPhase);
+    for(i=0; i<p->nPhase; i++){
+      n += LogPutVarint(&a[n], LOG_ZIGZAG((long long)p->aPhase[i]));
     }
-    exit(0);
   }
+  a[0] = (unsigned char)((n-2) & 0xff);
+  a[1] = (unsigned char)((n-2)>>8);
+  nLogBuf += n;
 }
 
 /*
-** Tell the client that there is an error in the script.
+** Format log entry p and add it to the log.  Return 0 on success or
+** -1 if the log file cannot be opened.
 */
-static void CgiScriptWritable(void){
-  StartResponse("500 CGI Configuration Error");
-  nOut += printf(
-    "Content-type: text/plain; charset=utf-8\r\n"
-    "\r\n"
-    "The CGI program %s is writable by users other than its owner.\n",
-    zRealScript);
-  MakeLogEntry(0, 140);  /* LOG: CGI script is writable */
-  exit(0);       
+static int LogRecordWrite(LogRecord *p){
+  static time_t tDate = 0;       /* Time of zDate[] and zExpLogFile[] */
+  static struct tm sTm;          /* Broken-down tDate */
+  static size_t sz;
+  static char zDate[200];
+  static char zExpLogFile[500];
+  time_t tNow = (time_t)p->tNow;
+  const char *zFilename;
+
+  if( tNow!=tDate ){
+    /* The date and the log file name only change once per second */
+    tDate = tNow;
+    sTm = *localtime(&tNow);
+    strftime(zDate, sizeof(zDate), LOG_DATE_FORMAT, &sTm);
+    sz = strftime(zExpLogFile, sizeof(zExpLogFile), zLogFile, &sTm);
+  }
+  if( sz>0 && sz<sizeof(zExpLogFile)-2 ){
+    zFilename = zExpLogFile;
+  }else{
+    zFilename = zLogFile;
+  }
+  if( LogOpen(zFilename, tNow) ) return -1;
+  if( logBinary ){
+    LogRecordBinary(p);
+  }else{
+    LogRecordText(p, zDate);
+  }
+  LogFlushIfOld(tNow);
+  return 0;
 }
 
 /*
-** Tell the client that the server malfunctioned.
+** With --log-ring, long-lived workers do no log I/O of their own.  Each
+** worker copies its log entries into a ring of slots in memory shared
+** with a single log-writer process, which formats and writes them.
+**
+** The ring is a bounded multi-producer queue without locks.  Each slot
+** carries a sequence number.  A producer claims position iHead by
+** advancing iHead with compare-and-swap, fills the slot, then publishes
+** it by setting the slot's sequence number to iHead+1.  The writer
+** consumes the slot at iTail once its sequence number is iTail+1, and
+** releases it for reuse by setting the sequence to iTail+nSlot.  If the
+** ring is full, a worker writes its entry directly instead.
+**
+** A producer that dies between claiming a slot and publishing it, for
+** example from a signal, would leave the writer stuck on that slot.  So
+** if a claimed slot stays unpublished for LOG_STALE_MS, the writer
+** releases it without writing it.  The producer publishes with a
+** compare-and-swap, so that a late producer finds out and writes its
+** entry directly instead.
+**
+** When the ring is empty the writer sets isIdle and sleeps, on a futex
+** where there is one.  A producer that finds isIdle set after
+** publishing an entry clears it and wakes the writer.
 */
-static void Malfunction(int linenum, const char *zFormat, ...){
-  va_list ap;
-  va_start(ap, zFormat);
-  StartResponse("500 Server Malfunction");
-  nOut += printf(
-    "Content-type: text/plain; charset=utf-8\r\n"
-    "\r\n"
-    "Web server malfunctioned; error number %d\n\n", linenum);
-  if( zFormat ){
-    nOut += vprintf(zFormat, ap);
-    printf("\n");
-    nOut++;
+typedef struct LogSlot LogSlot;
+struct LogSlot {
+  unsigned long long iSeq; /* Sequence number.  See above */
+  LogRecord r;             /* The log entry */
+};
+typedef struct LogRing LogRing;
+struct LogRing {
+  unsigned long long iHead;  /* Next position for a producer to claim */
+  char aPad1[56];            /* Keep iHead and iTail on separate lines */
+  unsigned long long iTail;  /* Next position for the writer to consume */
+  unsigned int isIdle;       /* True while the writer waits for entries */
+  char aPad2[52];
+  LogSlot a[1];              /* nLogRing slots */
+};
+#ifndef LOG_STALE_MS
+# define LOG_STALE_MS 1000        /* Release a slot unpublished this long */
+#endif
+static int nLogRing = 0;         /* Slots in the log ring.  0 for no ring */
+static LogRing *pLogRing = 0;    /* The shared log ring */
+static int inLogWriter = 0;      /* True in the log-writer process */
+
+/*
+** Create the log ring.  nLogRing is rounded up to a power of two.  If
+** the shared memory cannot be had, carry on without a ring.
+*/
+static void LogRingInit(void){
+  size_t sz;
+  int i, n = 1;
+  void *pShared;
+  while( n<nLogRing ) n *= 2;
+  nLogRing = n;
+  sz = sizeof(LogRing) + (nLogRing-1)*sizeof(LogSlot);
+  pShared = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if( pShared==MAP_FAILED ){
+    nLogRing = 0;
+    return;
   }
-  va_end(ap);
-  MakeLogEntry(0, linenum);
-  exit(0);
+  pLogRing = pShared;
+  for(i=0; i<nLogRing; i++) pLogRing->a[i].iSeq = i;
 }
 
 /*
-** Do a server redirect to the document specified.  The document
-** name not contain scheme or network location or the query string.
-** It will be just the path.
+** Add log entry p to the ring.  Return 0 on success or -1 if the ring
+** is full.
 */
-static void Redirect(const char *zPath, int iStatus, int finish, int lineno){
-  switch( iStatus ){
-    case 301:
-      StartResponse("301 Permanent Redirect");
-      break;
-    case 308:
-      StartResponse("308 Permanent Redirect");
-      break;
-    default:
-      StartResponse("302 Temporary Redirect");
-      break;
+static int LogRingPush(const LogRecord *p){
+  unsigned long long iPos, iSeq;
+  LogSlot *pSlot;
+  long long dif;
+  iPos = __atomic_load_n(&pLogRing->iHead, __ATOMIC_RELAXED);
+  while( 1 ){
+    pSlot = &pLogRing->a[iPos & (nLogRing-1)];
+    iSeq = __atomic_load_n(&pSlot->iSeq, __ATOMIC_ACQUIRE);
+    dif = (long long)(iSeq - iPos);
+    if( dif==0 ){
+      if( __atomic_compare_exchange_n(&pLogRing->iHead, &iPos, iPos+1, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ){
+        break;
+      }
+    }else if( dif<0 ){
+      return -1;
+    }else{
+      iPos = __atomic_load_n(&pLogRing->iHead, __ATOMIC_RELAXED);
+    }
   }
-  if( zServerPort==0 || zServerPort[0]==0 || strcmp(zServerPort,"80")==0 ){
-    nOut += printf("Location: %s://%s%s%s\r\n",
-                   zHttp, zServerName, zPath, zQuerySuffix);
-  }else{
-    nOut += printf("Location: %s://%s:%s%s%s\r\n",
-                   zHttp, zServerName, zServerPort, zPath, zQuerySuffix);
+  memcpy(&pSlot->r, p, offsetof(LogRecord,z) + p->aiStr[LOGSTR_COUNT-1]
+                       + strlen(&p->z[p->aiStr[LOGSTR_COUNT-1]]) + 1);
+  iSeq = iPos;
+  if( !__atomic_compare_exchange_n(&pSlot->iSeq, &iSeq, iPos+1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ){
+    return -1;  /* The writer gave up on this slot */
   }
-  if( finish ){
-    nOut += printf("Content-length: 0\r\n");
-    nOut += printf("\r\n");
-    MakeLogEntry(0, lineno);
+  if( __atomic_load_n(&pLogRing->isIdle, __ATOMIC_SEQ_CST)
+   && __atomic_exchange_n(&pLogRing->isIdle, 0, __ATOMIC_SEQ_CST)
+  ){
+#if defined(__linux__) && defined(SYS_futex)
+    syscall(SYS_futex, &pLogRing->isIdle, FUTEX_WAKE, 1, 0, 0, 0);
+#endif
   }
-  fflush(stdout);
+  return 0;
 }
 
 /*
-** This function treats its input as a base-64 string and returns the
-** decoded value of that string.  Characters of input that are not
-** valid base-64 characters (such as spaces and newlines) are ignored.
+** Wait up to ms milliseconds for a producer to clear isIdle in the log
+** ring.  Without futexes, just sleep.
 */
-void Decode64(char *z64){
-  char *zData;
-  int n64;
-  int i, j;
-  int a, b, c, d;
-  static int isInit = 0;
-  static int trans[128];
-  static unsigned char zBase[] = 
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static void LogRingWait(int ms){
+#if defined(__linux__) && defined(SYS_futex)
+  struct timespec ts;
+  ts.tv_sec = ms/1000;
+  ts.tv_nsec = (ms%1000)*1000000L;
+  syscall(SYS_futex, &pLogRing->isIdle, FUTEX_WAIT, 1, &ts, 0, 0);
+#else
+  poll(0, 0, ms<100 ? ms : 100);
+#endif
+}
 
-  if( !isInit ){
-    for(i=0; i<128; i++){ trans[i] = 0; }
-    for(i=0; zBase[i]; i++){ trans[zBase[i] & 0x7f] = i; }
-    isInit = 1;
-  }
-  n64 = strlen(z64);
-  while( n64>0 && z64[n64-1]=='=' ) n64--;
-  zData = z64;
-  for(i=j=0; i+3<n64; i+=4){
-    a = trans[z64[i] & 0x7f];
-    b = trans[z64[i+1] & 0x7f];
-    c = trans[z64[i+2] & 0x7f];
-    d = trans[z64[i+3] & 0x7f];
-    zData[j++] = ((a<<2) & 0xfc) | ((b>>4) & 0x03);
-    zData[j++] = ((b<<4) & 0xf0) | ((c>>2) & 0x0f);
-    zData[j++] = ((c<<6) & 0xc0) | (d & 0x3f);
-  }
-  if( i+2<n64 ){
-    a = trans[z64[i] & 0x7f];
-    b = trans[z64[i+1] & 0x7f];
-    c = trans[z64[i+2] & 0x7f];
-    zData[j++] = ((a<<2) & 0xfc) | ((b>>4) & 0x03);
-    zData[j++] = ((b<<4) & 0xf0) | ((c>>2) & 0x0f);
-  }else if( i+1<n64 ){
-    a = trans[z64[i] & 0x7f];
-    b = trans[z64[i+1] & 0x7f];
-    zData[j++] = ((a<<2) & 0xfc) | ((b>>4) & 0x03);
+/*
+** The main loop of the log-writer process.  Drain the ring, writing
+** entries out, until the supervisor goes away.  Never returns.
+*/
+static void LogWriterLoop(void){
+  unsigned long long iPos, iSeq;
+  LogSlot *pSlot;
+  long long tStale = 0;    /* When the slot at iTail was seen unpublished */
+  int msWait = 1;          /* Next idle wait, without futexes */
+  while( 1 ){
+    iPos = pLogRing->iTail;
+    pSlot = &pLogRing->a[iPos & (nLogRing-1)];
+    if( __atomic_load_n(&pSlot->iSeq, __ATOMIC_ACQUIRE)==iPos+1 ){
+      LogRecordWrite(&pSlot->r);
+      ArenaReset();
+      __atomic_store_n(&pSlot->iSeq, iPos+nLogRing, __ATOMIC_RELEASE);
+      __atomic_store_n(&pLogRing->iTail, iPos+1, __ATOMIC_RELEASE);
+      tStale = 0;
+      msWait = 1;
+      continue;
+    }
+    LogFlush();
+    if( getppid()!=supervisor ) exit(0);
+    if( __atomic_load_n(&pLogRing->iHead, __ATOMIC_ACQUIRE)!=iPos ){
+      /* The slot is claimed but not yet published */
+      long long tNow = MonotonicUs()/1000;
+      if( tStale==0 ){
+        tStale = tNow;
+      }else if( tNow - tStale >= LOG_STALE_MS ){
+        iSeq = iPos;
+        if( __atomic_compare_exchange_n(&pSlot->iSeq, &iSeq, iPos+nLogRing,
+                                 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ){
+          __atomic_store_n(&pLogRing->iTail, iPos+1, __ATOMIC_RELEASE);
+        }
+        tStale = 0;
+        continue;
+      }
+      poll(0, 0, 1);
+      continue;
+    }
+
+    /* The ring is empty.  Sleep until a producer publishes an entry,
+    ** checking on the supervisor at least once a second. */
+    __atomic_store_n(&pLogRing->isIdle, 1, __ATOMIC_SEQ_CST);
+    if( __atomic_load_n(&pLogRing->iHead, __ATOMIC_SEQ_CST)==iPos ){
+      LogRingWait(msWait);
+    }
+    __atomic_store_n(&pLogRing->isIdle, 0, __ATOMIC_SEQ_CST);
+#if defined(__linux__) && defined(SYS_futex)
+    msWait = 1000;
+#else
+    if( msWait<100 ) msWait *= 2;
+#endif
   }
-  zData[j] = 0;
 }
 
 /*
-** Check to see if basic authorization credentials are provided for
-** the user according to the information in zAuthFile.  Return true
-** if authorized.  Return false if not authorized.
-**
-** File format:
-**
-**    *  Blank lines and lines that begin with '#' are ignored
-**    *  "http-redirect" forces a redirect to HTTPS if not there already
-**    *  "https-only" disallows operation in HTTP
-**    *  "user NAME LOGIN:PASSWORD" checks to see if LOGIN:PASSWORD 
-**       authorization credentials are provided, and if so sets the
-**       REMOTE_USER to NAME.
-**    *  "realm TEXT" sets the realm to TEXT.
-**    *  "anyone" bypasses authentication and allows anyone to see the
-**       files.  Useful in combination with "http-redirect"
+** Make an entry in the log file.  If the HTTP connection should be
+** closed, then terminate this process.  Otherwise return.
 */
-static int CheckBasicAuthorization(const char *zAuthFile){
-  FILE *in;
-  char *zRealm = "unknown realm";
-  char *zLoginPswd;
-  char *zName;
-  char zLine[2000];
-
-  in = fopen(zAuthFile, "rb");
-  if( in==0 ){
-    NotFound(150);  /* LOG: Cannot open -auth file */
-    return 0;
+static void MakeLogEntry(int exitCode, int lineNum){
+  if( !omitLog ){
+    PROBE4(log__write, lineNum, zReplyStatus, nIn, nOut);
+    StatsRequestDone();
   }
-  if( zAuthArg ) Decode64(zAuthArg);
-  while( fgets(zLine, sizeof(zLine), in) ){
-    char *zFieldName;
-    char *zVal;
+  if( zLogFile && !omitLog ){
+    struct timeval now;
+    struct rusage self, children;
+    siginfo_t si;
+    int waitStatus;
+    int n;
+    LogRecord rec;
 
-    zFieldName = GetFirstElement(zLine,&zVal);
-    if( zFieldName==0 || *zFieldName==0 ) continue;
-    if( zFieldName[0]=='#' ) continue;
-    RemoveNewline(zVal);
-    if( strcmp(zFieldName, "realm")==0 ){
-      zRealm = StrDup(zVal);
-    }else if( strcmp(zFieldName,"user")==0 ){
-      if( zAuthArg==0 ) continue;
-      zName = GetFirstElement(zVal, &zVal);
-      zLoginPswd = GetFirstElement(zVal, &zVal);
-      if( zLoginPswd==0 ) continue;
-      if( zAuthArg && strcmp(zAuthArg,zLoginPswd)==0 ){
-        zRemoteUser = StrDup(zName);
-        fclose(in);
-        return 1;
-      }
-    }else if( strcmp(zFieldName,"https-only")==0 ){
-      if( !useHttps ){
-        NotFound(160);  /* LOG:  http request on https-only page */
-        fclose(in);
-        return 0;
-      }
-    }else if( strcmp(zFieldName,"http-redirect")==0 ){
-      if( !useHttps ){
-        zHttp = "https";
-        Redirect(zScript, 301, 1, 170); /* LOG: -auth redirect */
-        fclose(in);
-        return 0;
-      }
-    }else if( strcmp(zFieldName,"anyone")==0 ){
-      fclose(in);
-      return 1;
-    }else{
-      NotFound(180);  /* LOG:  malformed entry in -auth file */
-      fclose(in);
-      return 0;
+    if( zRealScript==0 ) zRealScript = "";
+    if( zHttpHost==0 ) zHttpHost = "";
+    gettimeofday(&now, 0);
+    /* Reap a finished CGI, but leave the POST feeder to whoever set
+    ** pidFeeder, so that pidFeeder never names a reaped process. */
+    memset(&si, 0, sizeof(si));
+    if( waitid(P_ALL, 0, &si, WEXITED|WNOHANG|WNOWAIT)==0
+     && si.si_pid>0 && si.si_pid!=pidFeeder
+     && (n = waitpid(si.si_pid, &waitStatus, WNOHANG))>0
+    ){
+      PROBE2(cgi__exit, n, waitStatus);
+    }
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    rec.tNow = now.tv_sec;
+    rec.aUs[0] = tvms(&self.ru_utime) - tvms(&priorSelf.ru_utime);
+    rec.aUs[1] = tvms(&self.ru_stime) - tvms(&priorSelf.ru_stime);
+    rec.aUs[2] = tvms(&children.ru_utime) - tvms(&priorChild.ru_utime);
+    rec.aUs[3] = tvms(&children.ru_stime) - tvms(&priorChild.ru_stime);
+    rec.aUs[4] = tvms(&now) - tvms(&beginTime);
+    rec.nIn = nIn;
+    rec.nOut = nOut;
+    rec.nRequest = nRequest;
+    rec.nScriptName = (int)(strlen(zHttp)+strlen(zHttpHost)
+                            +strlen(zRealScript)+3);
+    rec.lineNum = lineNum;
+    rec.nPhase = 0;
+    if( logPhases ){
+      rec.nPhase = STATS_NPHASE-1;
+      memcpy(rec.aPhase, &aPhaseUs[1], sizeof(rec.aPhase));
+    }
+    memcpy(rec.zStatus, zReplyStatus, sizeof(rec.zStatus));
+    rec.zStatus[sizeof(rec.zStatus)-1] = 0;
+    n = LogRecordString(&rec, LOGSTR_ADDR, zRemoteAddr, 0);
+    n = LogRecordString(&rec, LOGSTR_SCHEME, zHttp, n);
+    n = LogRecordString(&rec, LOGSTR_HOST, zHttpHost, n);
+    n = LogRecordString(&rec, LOGSTR_SCRIPT, zScript, n);
+    n = LogRecordString(&rec, LOGSTR_REFERER, zReferer, n);
+    n = LogRecordString(&rec, LOGSTR_AGENT, zAgent, n);
+    n = LogRecordString(&rec, LOGSTR_USER, zRemoteUser, n);
+    n = LogRecordString(&rec, LOGSTR_METHOD, zMethod, n);
+    LogRecordString(&rec, LOGSTR_PROTOCOL, zProtocol, n);
+    if( (pLogRing && LogRingPush(&rec)==0) || LogRecordWrite(&rec)==0 ){
+#ifndef COMBINED_LOG_FORMAT
+      priorSelf = self;
+      priorChild = children;
+#endif
+      nIn = nOut = 0;
+      nInStats = nOutStats = 0;
     }
   }
-  fclose(in);
-  NotAuthorized(zRealm);
-  return 0;
+  if( closeConnection ){
+    althttpd_exit(exitCode);
+  }
+  statusSent = 0;
 }
 
 /*
-** Guess the mime-type of a document based on its name.
+** Allocate memory safely.  The memory comes from the per-request arena
+** and lasts until the next ArenaReset().
 */
-const char *GetMimeType(const char *zName, int nName){
-  const char *z;
-  int i;
-  int first, last;
-  int len;
-  char zSuffix[20];
-
-  /* A table of mimetypes based on file suffixes. 
-  ** Suffixes must be in sorted order so that we can do a binary
-  ** search to find the mime-type
-  */
-  static const struct {
-    const char *zSuffix;       /* The file suffix */
-    int size;                  /* Length of the suffix */
-    const char *zMimetype;     /* The corresponding mimetype */
-  } aMime[] = {
-    { "ai",         2, "application/postscript"            },
-    { "aif",        3, "audio/x-aiff"                      },
-    { "aifc",       4, "audio/x-aiff"                      },
-    { "aiff",       4, "audio/x-aiff"                      },
-    { "arj",        3, "application/x-arj-compressed"      },
-    { "asc",        3, "text/plain"                        },
-    { "asf",        3, "video/x-ms-asf"                    },
-    { "asx",        3, "video/x-ms-asx"                    },
-    { "au",         2, "audio/ulaw"                        },
-    { "avi",        3, "video/x-msvideo"                   },
-    { "bat",        3, "application/x-msdos-program"       },
-    { "bcpio",      5, "application/x-bcpio"               },
-    { "bin",        3, "application/octet-stream"          },
-    { "c",          1, "text/plain"                        },
-    { "cc",         2, "text/plain"                        },
-    { "ccad",       4, "application/clariscad"             },
-    { "cdf",        3, "application/x-netcdf"              },
-    { "class",      5, "application/octet-stream"          },
-    { "cod",        3, "application/vnd.rim.cod"           },
-    { "com",        3, "application/x-msdos-program"       },
-    { "cpio",       4, "application/x-cpio"                },
-    { "cpt",        3, "application/mac-compactpro"        },
-    { "csh",        3, "application/x-csh"                 },
-    { "css",        3, "text/css"                          },
-    { "dcr",        3, "application/x-director"            },
-    { "deb",        3, "application/x-debian-package"      },
-    { "dir",        3, "application/x-director"            },
-    { "dl",         2, "video/dl"                          },
-    { "dms",        3, "application/octet-stream"          },
-    { "doc",        3, "application/msword"                },
-    { "drw",        3, "application/drafting"              },
-    { "dvi",        3, "application/x-dvi"                 },
-    { "dwg",        3, "application/acad"                  },
-    { "dxf",        3, "application/dxf"                   },
-    { "dxr",        3, "application/x-director"            },
-    { "eps",        3, "application/postscript"            },
-    { "etx",        3, "text/x-setext"                     },
-    { "exe",        3, "application/octet-stream"          },
-    { "ez",         2, "application/andrew-inset"          },
-    { "f",          1, "text/plain"                        },
-    { "f90",        3, "text/plain"                        },
-    { "fli",        3, "video/fli"                         },
-    { "flv",        3, "video/flv"                         },
-    { "gif",        3, "image/gif"                         },
-    { "gl",         2, "video/gl"                          },
-    { "gtar",       4, "application/x-gtar"                },
-    { "gz",         2, "application/x-gzip"                },
-    { "hdf",        3, "application/x-hdf"                 },
-    { "hh",         2, "text/plain"                        },
-    { "hqx",        3, "application/mac-binhex40"          },
-    { "h",          1, "text/plain"                        },
-    { "htm",        3, "text/html; charset=utf-8"          },
-    { "html",       4, "text/html; charset=utf-8"          },
-    { "ice",        3, "x-conference/x-cooltalk"           },
-    { "ief",        3, "image/ief"                         },
-    { "iges",       4, "model/iges"                        },
-    { "igs",        3, "model/iges"                        },
-    { "ips",        3, "application/x-ipscript"            },
-    { "ipx",        3, "application/x-ipix"                },
-    { "jad",        3, "text/vnd.sun.j2me.app-descriptor"  },
-    { "jar",        3, "application/java-archive"          },
-    { "jpeg",       4, "image/jpeg"                        },
-    { "jpe",        3, "image/jpeg"                        },
-    { "jpg",        3, "image/jpeg"                        },
-    { "js",         2, "application/x-javascript"          },
-    { "kar",        3, "audio/midi"                        },
-    { "latex",      5, "application/x-latex"               },
-    { "lha",        3, "application/octet-stream"          },
-    { "lsp",        3, "application/x-lisp"                },
-    { "lzh",        3, "application/octet-stream"          },
-    { "m",          1, "text/plain"                        },
-    { "m3u",        3, "audio/x-mpegurl"                   },
-    { "man",        3, "application/x-troff-man"           },
-    { "md",         2, "text/plain"                        },
-    { "mdown",      5, "text/plain"                        },
-    { "me",         2, "application/x-troff-me"            },
-    { "mesh",       4, "model/mesh"                        },
-    { "mid",        3, "audio/midi"                        },
-    { "midi",       4, "audio/midi"                        },
-    { "mif",        3, "application/x-mif"                 },
-    { "mime",       4, "www/mime"                          },
-    { "movie",      5, "video/x-sgi-movie"                 },
-    { "mov",        3, "video/quicktime"                   },
-    { "mp2",        3, "audio/mpeg"                        },
-    { "mp2",        3, "video/mpeg"                        },
-    { "mp3",        3, "audio/mpeg"                        },
-    { "mpeg",       4, "video/mpeg"                        },
-    { "mpe",        3, "video/mpeg"                        },
-    { "mpga",       4, "audio/mpeg"                        },
-    { "mpg",        3, "video/mpeg"                        },
-    { "ms",         2, "application/x-troff-ms"            },
-    { "msh",        3, "model/mesh"                        },
-    { "nc",         2, "application/x-netcdf"              },
-    { "oda",        3, "application/oda"                   },
-    { "ogg",        3, "application/ogg"                   },
-    { "ogm",        3, "application/ogg"                   },
-    { "pbm",        3, "image/x-portable-bitmap"           },
-    { "pdb",        3, "chemical/x-pdb"                    },
-    { "pdf",        3, "application/pdf"                   },
-    { "pgm",        3, "image/x-portable-graymap"          },
-    { "pgn",        3, "application/x-chess-pgn"           },
-    { "pgp",        3, "application/pgp"                   },
-    { "pl",         2, "application/x-perl"                },
-    { "pm",         2, "application/x-perl"                },
-    { "png",        3, "image/png"                         },
-    { "pnm",        3, "image/x-portable-anymap"           },
-    { "pot",        3, "application/mspowerpoint"          },
-    { "ppm",        3, "image/x-portable-pixmap"           },
-    { "pps",        3, "application/mspowerpoint"          },
-    { "ppt",        3, "application/mspowerpoint"          },
-    { "ppz",        3, "application/mspowerpoint"          },
-    { "pre",        3, "application/x-freelance"           },
-    { "prt",        3, "application/pro_eng"               },
-    { "ps",         2, "application/postscript"            },
-    { "qt",         2, "video/quicktime"                   },
-    { "ra",         2, "audio/x-realaudio"                 },
-    { "ram",        3, "audio/x-pn-realaudio"              },
-    { "rar",        3, "application/x-rar-compressed"      },
-    { "ras",        3, "image/cmu-raster"                  },
-    { "ras",        3, "image/x-cmu-raster"                },
-    { "rgb",        3, "image/x-rgb"                       },
-    { "rm",         2, "audio/x-pn-realaudio"              },
-    { "roff",       4, "application/x-troff"               },
-    { "rpm",        3, "audio/x-pn-realaudio-plugin"       },
-    { "rtf",        3, "application/rtf"                   },
-    { "rtf",        3, "text/rtf"                          },
-    { "rtx",        3, "text/richtext"                     },
-    { "scm",        3, "application/x-lotusscreencam"      },
-    { "set",        3, "application/set"                   },
-    { "sgml",       4, "text/sgml"                         },
-    { "sgm",        3, "text/sgml"                         },
-    { "sh",         2, "application/x-sh"                  },
-    { "shar",       4, "application/x-shar"                },
-    { "silo",       4, "model/mesh"                        },
-    { "sit",        3, "application/x-stuffit"             },
-    { "skd",        3, "application/x-koan"                },
-    { "skm",        3, "application/x-koan"                },
-    { "skp",        3, "application/x-koan"                },
-    { "skt",        3, "application/x-koan"                },
-    { "smi",        3, "application/smil"                  },
-    { "smil",       4, "application/smil"                  },
-    { "snd",        3, "audio/basic"                       },
-    { "sol",        3, "application/solids"                },
-    { "spl",        3, "application/x-futuresplash"        },
-    { "src",        3, "application/x-wais-source"         },
-    { "step",       4, "application/STEP"                  },
-    { "stl",        3, "application/SLA"                   },
-    { "stp",        3, "application/STEP"                  },
-    { "sv4cpio",    7, "application/x-sv4cpio"             },
-    { "sv4crc",     6, "application/x-sv4crc"              },
-    { "svg",        3, "image/svg+xml"                     },
-    { "swf",        3, "application/x-shockwave-flash"     },
-    { "t",          1, "application/x-troff"               },
-    { "tar",        3, "application/x-tar"                 },
-    { "tcl",        3, "application/x-tcl"                 },
-    { "tex",        3, "application/x-tex"                 },
-    { "texi",       4, "application/x-texinfo"             },
-    { "texinfo",    7, "application/x-texinfo"             },
-    { "tgz",        3, "application/x-tar-gz"              },
-    { "tiff",       4, "image/tiff"                        },
-    { "tif",        3, "image/tiff"                        },
-    { "tr",         2, "application/x-troff"               },
-    { "tsi",        3, "audio/TSP-audio"                   },
-    { "tsp",        3, "application/dsptype"               },
-    { "tsv",        3, "text/tab-separated-values"         },
-    { "txt",        3, "text/plain"                        },
-    { "unv",        3, "application/i-deas"                },
-    { "ustar",      5, "application/x-ustar"               },
-    { "vcd",        3, "application/x-cdlink"              },
-    { "vda",        3, "application/vda"                   },
-    { "viv",        3, "video/vnd.vivo"                    },
-    { "vivo",       4, "video/vnd.vivo"                    },
-    { "vrml",       4, "model/vrml"                        },
-    { "vsix",       4, "application/vsix"                  },
-    { "wav",        3, "audio/x-wav"                       },
-    { "wax",        3, "audio/x-ms-wax"                    },
-    { "wiki",       4, "application/x-fossil-wiki"         },
-    { "wma",        3, "audio/x-ms-wma"                    },
-    { "wmv",        3, "video/x-ms-wmv"                    },
-    { "wmx",        3, "video/x-ms-wmx"                    },
-    { "wrl",        3, "model/vrml"                        },
-    { "wvx",        3, "video/x-ms-wvx"                    },
-    { "xbm",        3, "image/x-xbitmap"                   },
-    { "xlc",        3, "application/vnd.ms-excel"          },
-    { "xll",        3, "application/vnd.ms-excel"          },
-    { "xlm",        3, "application/vnd.ms-excel"          },
-    { "xls",        3, "application/vnd.ms-excel"          },
-    { "xlw",        3, "application/vnd.ms-excel"          },
-    { "xml",        3, "text/xml"                          },
-    { "xpm",        3, "image/x-xpixmap"                   },
-    { "xwd",        3, "image/x-xwindowdump"               },
-    { "xyz",        3, "chemical/x-pdb"                    },
-    { "zip",        3, "application/zip"                   },
-  };
+static char *SafeMalloc( size_t size ){
+  char *p;
 
-  for(i=nName-1; i>0 && zName[i]!='.'; i--){}
-  z = &zName[i+1];
-  len = nName - i;
-  if( len<(int)sizeof(zSuffix)-1 ){
-    strcpy(zSuffix, z);
-    for(i=0; zSuffix[i]; i++) zSuffix[i] = tolower(zSuffix[i]);
-    first = 0;
-    last = sizeof(aMime)/sizeof(aMime[0]);
-    while( first<=last ){
-      int c;
-      i = (first+last)/2;
-      c = strcmp(zSuffix, aMime[i].zSuffix);
-      if( c==0 ) return aMime[i].zMimetype;
-      if( c<0 ){
-        last = i-1;
-      }else{
-        first = i+1;
-      }
-    }
+  p = ArenaAlloc(size);
+  if( p==0 ){
+    strcpy(zReplyStatus, "998");
+    MakeLogEntry(1,100);  /* LOG: Malloc() failed */
+    exit(1);
   }
-  return "application/octet-stream";
+  return p;
 }
 
 /*
-** The following table contains 1 for all characters that are permitted in
-** the part of the URL before the query parameters and fragment.
-**
-** Allowed characters:  0-9a-zA-Z,-./:_~
-**
-** Disallowed characters include:  !"#$%&'()*+;<=>?[\]^{|}
+** Set the value of environment variable zVar to zValue.
 */
-static const char allowedInName[] = {
-      /*  x0  x1  x2  x3  x4  x5  x6  x7  x8  x9  xa  xb  xc  xd  xe  xf */
-/* 0x */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-/* 1x */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-/* 2x */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,
-/* 3x */   1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  0,  0,  0,  0,  0,
-/* 4x */   0,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
-/* 5x */   1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  0,  0,  0,  0,  1,
-/* 6x */   0,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
-/* 7x */   1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  0,  0,  0,  1,  0,
-/* 8x */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-/* 9x */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-/* Ax */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-/* Bx */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-/* Cx */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-/* Dx */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-/* Ex */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-/* Fx */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-};
+static void SetEnv(const char *zVar, const char *zValue){
+  char *z;
+  size_t len;
+  if( zValue==0 ) zValue="";
+  /* Disable an attempted bashdoor attack */
+  if( strncmp(zValue,"() {",4)==0 ) zValue = "";
+  len = strlen(zVar) + strlen(zValue) + 2;
+  z = SafeMalloc(len);
+  sprintf(z,"%s=%s",zVar,zValue);
+  putenv(z);
+}
 
 /*
-** Remove all disallowed characters in the input string z[].  Convert any
-** disallowed characters into "_".
-**
-** Not that the three character sequence "%XX" where X is any byte is
-** converted into a single "_" character.
-**
-** Return the number of characters converted.  An "%XX" -> "_" conversion
-** counts as a single character.
+** Remove the first space-delimited token from a string and return
+** a pointer to it.  Add a NULL to the string to terminate the token.
+** Make *zLeftOver point to the start of the next token.
 */
-static int sanitizeString(char *z){
-  int nChange = 0;
-  while( *z ){
-    if( !allowedInName[*(unsigned char*)z] ){
-      if( *z=='%' && z[1]!=0 && z[2]!=0 ){
-        int i;
-        for(i=3; (z[i-2] = z[i])!=0; i++){}
-      }
-      *z = '_';
-      nChange++;
-    }
-    z++;
+static char *GetFirstElement(char *zInput, char **zLeftOver){
+  char *zResult = 0;
+  if( zInput==0 ){
+    if( zLeftOver ) *zLeftOver = 0;
+    return 0;
   }
-  return nChange;
+  while( isspace(*(unsigned char*)zInput) ){ zInput++; }
+  zResult = zInput;
+  while( *zInput && !isspace(*(unsigned char*)zInput) ){ zInput++; }
+  if( *zInput ){
+    *zInput = 0;
+    zInput++;
+    while( isspace(*(unsigned char*)zInput) ){ zInput++; }
+  }
+  if( zLeftOver ){ *zLeftOver = zInput; }
+  return zResult;
 }
 
 /*
-** Count the number of "/" characters in a string.
+** Make a copy of a string into memory obtained from SafeMalloc().
 */
-static int countSlashes(const char *z){
-  int n = 0;
-  while( *z ) if( *(z++)=='/' ) n++;
-  return n;
+static char *StrDup(const char *zSrc){
+  char *zDest;
+  size_t size;
+
+  if( zSrc==0 ) return 0;
+  size = strlen(zSrc) + 1;
+  zDest = SafeMalloc( size );
+  strcpy(zDest,zSrc);
+  return zDest;
+}
+static char *StrAppend(char *zPrior, const char *zSep, const char *zSrc){
+  char *zDest;
+  size_t size;
+  size_t n0, n1, n2;
+
+  if( zSrc==0 ) return 0;
+  if( zPrior==0 ) return StrDup(zSrc);
+  n0 = strlen(zPrior);
+  n1 = strlen(zSep);
+  n2 = strlen(zSrc);
+  size = n0+n1+n2+1;
+  zDest = SafeMalloc( size );
+  memcpy(zDest, zPrior, n0);
+  memcpy(&zDest[n0],zSep,n1);
+  memcpy(&zDest[n0+n1],zSrc,n2+1);
+  return zDest;
 }
 
 /*
-** Transfer nXfer bytes from in to out, after first discarding
-** nSkip bytes from in.  Increment the nOut global variable
-** according to the number of bytes transferred.
+** Compare two ETag values. Return 0 if they match and non-zero if they differ.
+**
+** The one on the left might be a NULL pointer and it might be quoted.
 */
-static void xferBytes(FILE *in, FILE *out, int nXfer, int nSkip){
-  size_t n;
-  size_t got;
-  char zBuf[16384];
-  while( nSkip>0 ){
-    n = nSkip;
-    if( n>sizeof(zBuf) ) n = sizeof(zBuf);
-    got = fread(zBuf, 1, n, in);
-    if( got==0 ) break;
-    nSkip -= got;
-  }
-  while( nXfer>0 ){
-    n = nXfer;
-    if( n>sizeof(zBuf) ) n = sizeof(zBuf);
-    got = fread(zBuf, 1, n, in);
-    if( got==0 ) break;
-    fwrite(zBuf, got, 1, out);
-    nOut += got;
-    nXfer -= got;
+static int CompareEtags(const char *zA, const char *zB){
+  if( zA==0 ) return 1;
+  if( zA[0]=='"' ){
+    int lenB = (int)strlen(zB);
+    if( strncmp(zA+1, zB, lenB)==0 && zA[lenB+1]=='"' ) return 0;
   }
+  return strcmp(zA, zB);
 }
 
 /*
-** Send the text of the file named by zFile as the reply.  Use the
-** suffix on the end of the zFile name to determine the mimetype.
-**
-** Return 1 to omit making a log entry for the reply.
+** Break a line at the first \n or \r character seen.
 */
-static int SendFile(
-  const char *zFile,      /* Name of the file to send */
-  int lenFile,            /* Length of the zFile name in bytes */
-  struct stat *pStat      /* Result of a stat() against zFile */
-){
-  const char *zContentType;
-  time_t t;
-  FILE *in;
-  char zETag[100];
+static void RemoveNewline(char *z){
+  if( z==0 ) return;
+  while( *z && *z!='\n' && *z!='\r' ){ z++; }
+  *z = 0;
+}
 
-  zContentType = GetMimeType(zFile, lenFile);
-  if( zTmpNam ) unlink(zTmpNam);
-  sprintf(zETag, "m%xs%x", (int)pStat->st_mtime, (int)pStat->st_size);
-  if( CompareEtags(zIfNoneMatch,zETag)==0
-   || (zIfModifiedSince!=0
-        && (t = ParseRfc822Date(zIfModifiedSince))>0
-        && t>=pStat->st_mtime)
-  ){
-    StartResponse("304 Not Modified");
-    nOut += DateTag("Last-Modified", pStat->st_mtime);
-    nOut += printf("Cache-Control: max-age=%d\r\n", mxAge);
-    nOut += printf("ETag: \"%s\"\r\n", zETag);
-    nOut += printf("\r\n");
-    fflush(stdout);
-    MakeLogEntry(0, 470);  /* LOG: ETag Cache Hit */
-    return 1;
-  }
-  in = fopen(zFile,"rb");
-  if( in==0 ) NotFound(480); /* LOG: fopen() failed for static content */
-  if( rangeEnd>0 && rangeStart<pStat->st_size ){
-    StartResponse("206 Partial Content");
-    if( rangeEnd>=pStat->st_size ){
-      rangeEnd = pStat->st_size-1;
+/* Render seconds since 1970 as an RFC822 date string.  Return
+** a pointer to that string in a static buffer.
+*/
+static char *Rfc822Date(time_t t){
+  struct tm *tm;
+  static char zDate[100];
+  tm = gmtime(&t);
+  strftime(zDate, sizeof(zDate), "%a, %d %b %Y %H:%M:%S %Z", tm);
+  return zDate;
+}
+
+/*
+** Print a date tag in the header.  The name of the tag is zTag.
+** The date is determined from the unix timestamp given.
+*/
+static int DateTag(const char *zTag, time_t t){
+  return printf("%s: %s\r\n", zTag, Rfc822Date(t));
+}
+
+/*
+** Parse an RFC822-formatted timestamp as we'd expect from HTTP and return
+** a Unix epoch time. <= zero is returned on failure.
+*/
+time_t ParseRfc822Date(const char *zDate){
+  int mday, mon, year, yday, hour, min, sec;
+  char zIgnore[4];
+  char zMonth[4];
+  static const char *const azMonths[] =
+    {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  if( 7==sscanf(zDate, "%3[A-Za-z], %d %3[A-Za-z] %d %d:%d:%d", zIgnore,
+                       &mday, zMonth, &year, &hour, &min, &sec)){
+    if( year > 1900 ) year -= 1900;
+    for(mon=0; mon<12; mon++){
+      if( !strncmp( azMonths[mon], zMonth, 3 )){
+        int nDay;
+        int isLeapYr;
+        static int priorDays[] =
+         {  0, 31, 59, 90,120,151,181,212,243,273,304,334 };
+        isLeapYr = year%4==0 && (year%100!=0 || (year+300)%400==0);
+        yday = priorDays[mon] + mday - 1;
+        if( isLeapYr && mon>1 ) yday++;
+        nDay = (year-70)*365 + (year-69)/4 - (year-1)/100 + (year+299)/400
+                 + yday;
+        return ((time_t)(nDay*24 + hour)*60 + min)*60 + sec;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+** Test procedure for ParseRfc822Date
+*/
+void TestParseRfc822Date(void){
+  time_t t1, t2;
+  for(t1=0; t1<0x7fffffff; t1 += 127){
+    t2 = ParseRfc822Date(Rfc822Date(t1));
+    assert( t1==t2 );
+  }
+}
+
+/*
+** Print the first line of a response followed by the server type.
+*/
+static void StartResponse(const char *zResultCode){
+  time_t now;
+  time(&now);
+  if( statusSent ) return;
+  PROBE2(response__start, zResultCode, nOut);
+  nOut += printf("%s %s\r\n", zProtocol, zResultCode);
+  strncpy(zReplyStatus, zResultCode, 3);
+  zReplyStatus[3] = 0;
+  if( zReplyStatus[0]>='4' ){
+    closeConnection = 1;
+  }
+  if( closeConnection ){
+    nOut += printf("Connection: close\r\n");
+  }else{
+    nOut += printf("Connection: keep-alive\r\n");
+  }
+  nOut += DateTag("Date", now);
+  statusSent = 1;
+}
+
+/*
+** Tell the client that there is no such document
+*/
+static void NotFound(int lineno){
+  StartResponse("404 Not Found");
+  nOut += printf(
+    "Content-type: text/html; charset=utf-8\r\n"
+    "\r\n"
+    "<head><title lineno=\"%d\">Not Found</title></head>\n"
+    "<body><h1>Document Not Found</h1>\n"
+    "The document %s is not available on this server\n"
+    "</body>\n", lineno, zScript);
+  MakeLogEntry(0, lineno);
+  althttpd_exit(0);
+}
+
+/*
+** Tell the client that they are not welcomed here.
+*/
+static void Forbidden(int lineno){
+  StartResponse("403 Forbidden");
+  nOut += printf(
+    "Content-type: text/plain; charset=utf-8\r\n"
+    "\r\n"
+    "Access denied\n"
+  );
+  closeConnection = 1;
+  MakeLogEntry(0, lineno);
+  althttpd_exit(0);
+}
+
+/*
+** Tell the client that authorization is required to access the
+** document.
+*/
+static void NotAuthorized(const char *zRealm){
+  StartResponse("401 Authorization Required");
+  nOut += printf(
+    "WWW-Authenticate: Basic realm=\"%s\"\r\n"
+    "Content-type: text/html; charset=utf-8\r\n"
+    "\r\n"
+    "<head><title>Not Authorized</title></head>\n"
+    "<body><h1>401 Not Authorized</h1>\n"
+    "A login and password are required for this document\n"
+    "</body>\n", zRealm);
+  MakeLogEntry(0, 110);  /* LOG: Not authorized */
+}
+
+/*
+** Tell the client that there is an error in the script.
+*/
+static void CgiError(void){
+  StartResponse("500 Error");
+  nOut += printf(
+    "Content-type: text/html; charset=utf-8\r\n"
+    "\r\n"
+    "<head><title>CGI Program Error</title></head>\n"
+    "<body><h1>CGI Program Error</h1>\n"
+    "The CGI program %s generated an error\n"
+    "</body>\n", zScript);
+  MakeLogEntry(0, 120);  /* LOG: CGI Error */
+  althttpd_exit(0);
+}
+
+/*
+** This is called if we timeout or catch some other kind of signal.
+** Log an error code which is 900+iSig and then quit.
+*/
+static void Timeout(int iSig){
+  if( !debugFlag ){
+    if( zScript && zScript[0] ){
+      char zBuf[10];
+      zBuf[0] = '9';
+      zBuf[1] = '0' + (iSig/10)%10;
+      zBuf[2] = '0' + iSig%10;
+      zBuf[3] = 0;
+      strcpy(zReplyStatus, zBuf);
+      /* In a worker, MakeLogEntry() must not call althttpd_exit(), which
+      ** would siglongjmp() out of this handler and carry on serving */
+      if( inWorker ) closeConnection = 0;
+      MakeLogEntry(0, 130);  /* LOG: Timeout */
+    }
+    if( inWorker ){
+      /* The signal may have arrived in the middle of malloc(), stdio or
+      ** the log code.  A long-lived worker must not go on serving with
+      ** that state, so end the process and let the supervisor start a
+      ** fresh worker. */
+      if( pidFeeder>0 ) kill(pidFeeder, SIGKILL);
+      LogFlush();
+      _exit(0);
+    }
+    if( iSig==SIGALRM || iSig==SIGPIPE ) althttpd_exit(0);
+    exit(0);
+  }
+}
+
+/*
+** Tell the client that there is an error in the script.
+*/
+static void CgiScriptWritable(void){
+  StartResponse("500 CGI Configuration Error");
+  nOut += printf(
+    "Content-type: text/plain; charset=utf-8\r\n"
+    "\r\n"
+    "The CGI program %s is writable by users other than its owner.\n",
+    zRealScript);
+  MakeLogEntry(0, 140);  /* LOG: CGI script is writable */
+  althttpd_exit(0);
+}
+
+/*
+** Tell the client that the server malfunctioned.
+*/
+static void Malfunction(int linenum, const char *zFormat, ...){
+  va_list ap;
+  va_start(ap, zFormat);
+  StartResponse("500 Server Malfunction");
+  nOut += printf(
+    "Content-type: text/plain; charset=utf-8\r\n"
+    "\r\n"
+    "Web server malfunctioned; error number %d\n\n", linenum);
+  if( zFormat ){
+    nOut += vprintf(zFormat, ap);
+    printf("\n");
+    nOut++;
+  }
+  va_end(ap);
+  MakeLogEntry(0, linenum);
+  althttpd_exit(0);
+}
+
+/*
+** Do a server redirect to the document specified.  The document
+** name not contain scheme or network location or the query string.
+** It will be just the path.
+*/
+static void Redirect(const char *zPath, int iStatus, int finish, int lineno){
+  switch( iStatus ){
+    case 301:
+      StartResponse("301 Permanent Redirect");
+      break;
+    case 308:
+      StartResponse("308 Permanent Redirect");
+      break;
+    default:
+      StartResponse("302 Temporary Redirect");
+      break;
+  }
+  if( zServerPort==0 || zServerPort[0]==0 || strcmp(zServerPort,"80")==0 ){
+    nOut += printf("Location: %s://%s%s%s\r\n",
+                   zHttp, zServerName, zPath, zQuerySuffix);
+  }else{
+    nOut += printf("Location: %s://%s:%s%s%s\r\n",
+                   zHttp, zServerName, zServerPort, zPath, zQuerySuffix);
+  }
+  if( finish ){
+    nOut += printf("Content-length: 0\r\n");
+    nOut += printf("\r\n");
+    MakeLogEntry(0, lineno);
+  }
+  fflush(stdout);
+}
+
+/*
+** This function treats its input as a base-64 string and returns the
+** decoded value of that string.  Characters of input that are not
+** valid base-64 characters (such as spaces and newlines) are ignored.
+*/
+void Decode64(char *z64){
+  char *zData;
+  int n64;
+  int i, j;
+  int a, b, c, d;
+  static int isInit = 0;
+  static int trans[128];
+  static unsigned char zBase[] = 
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  if( !isInit ){
+    for(i=0; i<128; i++){ trans[i] = 0; }
+    for(i=0; zBase[i]; i++){ trans[zBase[i] & 0x7f] = i; }
+    isInit = 1;
+  }
+  n64 = strlen(z64);
+  while( n64>0 && z64[n64-1]=='=' ) n64--;
+  zData = z64;
+  for(i=j=0; i+3<n64; i+=4){
+    a = trans[z64[i] & 0x7f];
+    b = trans[z64[i+1] & 0x7f];
+    c = trans[z64[i+2] & 0x7f];
+    d = trans[z64[i+3] & 0x7f];
+    zData[j++] = ((a<<2) & 0xfc) | ((b>>4) & 0x03);
+    zData[j++] = ((b<<4) & 0xf0) | ((c>>2) & 0x0f);
+    zData[j++] = ((c<<6) & 0xc0) | (d & 0x3f);
+  }
+  if( i+2<n64 ){
+    a = trans[z64[i] & 0x7f];
+    b = trans[z64[i+1] & 0x7f];
+    c = trans[z64[i+2] & 0x7f];
+    zData[j++] = ((a<<2) & 0xfc) | ((b>>4) & 0x03);
+    zData[j++] = ((b<<4) & 0xf0) | ((c>>2) & 0x0f);
+  }else if( i+1<n64 ){
+    a = trans[z64[i] & 0x7f];
+    b = trans[z64[i+1] & 0x7f];
+    zData[j++] = ((a<<2) & 0xfc) | ((b>>4) & 0x03);
+  }
+  zData[j] = 0;
+}
+
+/*
+** Check to see if basic authorization credentials are provided for
+** the user according to the information in zAuthFile.  Return true
+** if authorized.  Return false if not authorized.
+**
+** File format:
+**
+**    *  Blank lines and lines that begin with '#' are ignored
+**    *  "http-redirect" forces a redirect to HTTPS if not there already
+**    *  "https-only" disallows operation in HTTP
+**    *  "user NAME LOGIN:PASSWORD" checks to see if LOGIN:PASSWORD 
+**       authorization credentials are provided, and if so sets the
+**       REMOTE_USER to NAME.
+**    *  "realm TEXT" sets the realm to TEXT.
+**    *  "anyone" bypasses authentication and allows anyone to see the
+**       files.  Useful in combination with "http-redirect"
+*/
+static int CheckBasicAuthorization(const char *zAuthFile){
+  FILE *in;
+  char *zRealm = "unknown realm";
+  char *zLoginPswd;
+  char *zName;
+  char zLine[2000];
+
+  in = fopen(zAuthFile, "rb");
+  if( in==0 ){
+    NotFound(150);  /* LOG: Cannot open -auth file */
+    return 0;
+  }
+  if( zAuthArg ) Decode64(zAuthArg);
+  while( fgets(zLine, sizeof(zLine), in) ){
+    char *zFieldName;
+    char *zVal;
+
+    zFieldName = GetFirstElement(zLine,&zVal);
+    if( zFieldName==0 || *zFieldName==0 ) continue;
+    if( zFieldName[0]=='#' ) continue;
+    RemoveNewline(zVal);
+    if( strcmp(zFieldName, "realm")==0 ){
+      zRealm = StrDup(zVal);
+    }else if( strcmp(zFieldName,"user")==0 ){
+      if( zAuthArg==0 ) continue;
+      zName = GetFirstElement(zVal, &zVal);
+      zLoginPswd = GetFirstElement(zVal, &zVal);
+      if( zLoginPswd==0 ) continue;
+      if( zAuthArg && strcmp(zAuthArg,zLoginPswd)==0 ){
+        zRemoteUser = StrDup(zName);
+        fclose(in);
+        return 1;
+      }
+    }else if( strcmp(zFieldName,"https-only")==0 ){
+      if( !useHttps ){
+        fclose(in);
+        NotFound(160);  /* LOG:  http request on https-only page */
+        return 0;
+      }
+    }else if( strcmp(zFieldName,"http-redirect")==0 ){
+      if( !useHttps ){
+        zHttp = "https";
+        fclose(in);
+        Redirect(zScript, 301, 1, 170); /* LOG: -auth redirect */
+        return 0;
+      }
+    }else if( strcmp(zFieldName,"anyone")==0 ){
+      fclose(in);
+      return 1;
+    }else{
+      fclose(in);
+      NotFound(180);  /* LOG:  malformed entry in -auth file */
+      return 0;
+    }
+  }
+  fclose(in);
+  NotAuthorized(zRealm);
+  return 0;
+}
+
+/*
+** A table of mimetypes based on file suffixes.  Suffixes must be in
+** strictly increasing strcmp() order so that GetMimeType() can do a
+** binary search to find the mime-type.
+*/
+static const struct MimeTypeDef {
+  const char *zSuffix;       /* The file suffix */
+  int size;                  /* Length of the suffix */
+  const char *zMimetype;     /* The corresponding mimetype */
+} aMime[] = {
+  { "ai",         2, "application/postscript"            },
+  { "aif",        3, "audio/x-aiff"                      },
+  { "aifc",       4, "audio/x-aiff"                      },
+  { "aiff",       4, "audio/x-aiff"                      },
+  { "arj",        3, "application/x-arj-compressed"      },
+  { "asc",        3, "text/plain"                        },
+  { "asf",        3, "video/x-ms-asf"                    },
+  { "asx",        3, "video/x-ms-asx"                    },
+  { "au",         2, "audio/ulaw"                        },
+  { "avi",        3, "video/x-msvideo"                   },
+  { "bat",        3, "application/x-msdos-program"       },
+  { "bcpio",      5, "application/x-bcpio"               },
+  { "bin",        3, "application/octet-stream"          },
+  { "c",          1, "text/plain"                        },
+  { "cc",         2, "text/plain"                        },
+  { "ccad",       4, "application/clariscad"             },
+  { "cdf",        3, "application/x-netcdf"              },
+  { "class",      5, "application/octet-stream"          },
+  { "cod",        3, "application/vnd.rim.cod"           },
+  { "com",        3, "application/x-msdos-program"       },
+  { "cpio",       4, "application/x-cpio"                },
+  { "cpt",        3, "application/mac-compactpro"        },
+  { "csh",        3, "application/x-csh"                 },
+  { "css",        3, "text/css"                          },
+  { "dcr",        3, "application/x-director"            },
+  { "deb",        3, "application/x-debian-package"      },
+  { "dir",        3, "application/x-director"            },
+  { "dl",         2, "video/dl"                          },
+  { "dms",        3, "application/octet-stream"          },
+  { "doc",        3, "application/msword"                },
+  { "drw",        3, "application/drafting"              },
+  { "dvi",        3, "application/x-dvi"                 },
+  { "dwg",        3, "application/acad"                  },
+  { "dxf",        3, "application/dxf"                   },
+  { "dxr",        3, "application/x-director"            },
+  { "eps",        3, "application/postscript"            },
+  { "etx",        3, "text/x-setext"                     },
+  { "exe",        3, "application/octet-stream"          },
+  { "ez",         2, "application/andrew-inset"          },
+  { "f",          1, "text/plain"                        },
+  { "f90",        3, "text/plain"                        },
+  { "fli",        3, "video/fli"                         },
+  { "flv",        3, "video/flv"                         },
+  { "gif",        3, "image/gif"                         },
+  { "gl",         2, "video/gl"                          },
+  { "gtar",       4, "application/x-gtar"                },
+  { "gz",         2, "application/x-gzip"                },
+  { "h",          1, "text/plain"                        },
+  { "hdf",        3, "application/x-hdf"                 },
+  { "hh",         2, "text/plain"                        },
+  { "hqx",        3, "application/mac-binhex40"          },
+  { "htm",        3, "text/html; charset=utf-8"          },
+  { "html",       4, "text/html; charset=utf-8"          },
+  { "ice",        3, "x-conference/x-cooltalk"           },
+  { "ief",        3, "image/ief"                         },
+  { "iges",       4, "model/iges"                        },
+  { "igs",        3, "model/iges"                        },
+  { "ips",        3, "application/x-ipscript"            },
+  { "ipx",        3, "application/x-ipix"                },
+  { "jad",        3, "text/vnd.sun.j2me.app-descriptor"  },
+  { "jar",        3, "application/java-archive"          },
+  { "jpe",        3, "image/jpeg"                        },
+  { "jpeg",       4, "image/jpeg"                        },
+  { "jpg",        3, "image/jpeg"                        },
+  { "js",         2, "application/x-javascript"          },
+  { "kar",        3, "audio/midi"                        },
+  { "latex",      5, "application/x-latex"               },
+  { "lha",        3, "application/octet-stream"          },
+  { "lsp",        3, "application/x-lisp"                },
+  { "lzh",        3, "application/octet-stream"          },
+  { "m",          1, "text/plain"                        },
+  { "m3u",        3, "audio/x-mpegurl"                   },
+  { "man",        3, "application/x-troff-man"           },
+  { "md",         2, "text/plain"                        },
+  { "mdown",      5, "text/plain"                        },
+  { "me",         2, "application/x-troff-me"            },
+  { "mesh",       4, "model/mesh"                        },
+  { "mid",        3, "audio/midi"                        },
+  { "midi",       4, "audio/midi"                        },
+  { "mif",        3, "application/x-mif"                 },
+  { "mime",       4, "www/mime"                          },
+  { "mov",        3, "video/quicktime"                   },
+  { "movie",      5, "video/x-sgi-movie"                 },
+  { "mp2",        3, "audio/mpeg"                        },
+  { "mp3",        3, "audio/mpeg"                        },
+  { "mpe",        3, "video/mpeg"                        },
+  { "mpeg",       4, "video/mpeg"                        },
+  { "mpg",        3, "video/mpeg"                        },
+  { "mpga",       4, "audio/mpeg"                        },
+  { "ms",         2, "application/x-troff-ms"            },
+  { "msh",        3, "model/mesh"                        },
+  { "nc",         2, "application/x-netcdf"              },
+  { "oda",        3, "application/oda"                   },
+  { "ogg",        3, "application/ogg"                   },
+  { "ogm",        3, "application/ogg"                   },
+  { "pbm",        3, "image/x-portable-bitmap"           },
+  { "pdb",        3, "chemical/x-pdb"                    },
+  { "pdf",        3, "application/pdf"                   },
+  { "pgm",        3, "image/x-portable-graymap"          },
+  { "pgn",        3, "application/x-chess-pgn"           },
+  { "pgp",        3, "application/pgp"                   },
+  { "pl",         2, "application/x-perl"                },
+  { "pm",         2, "application/x-perl"                },
+  { "png",        3, "image/png"                         },
+  { "pnm",        3, "image/x-portable-anymap"           },
+  { "pot",        3, "application/mspowerpoint"          },
+  { "ppm",        3, "image/x-portable-pixmap"           },
+  { "pps",        3, "application/mspowerpoint"          },
+  { "ppt",        3, "application/mspowerpoint"          },
+  { "ppz",        3, "application/mspowerpoint"          },
+  { "pre",        3, "application/x-freelance"           },
+  { "prt",        3, "application/pro_eng"               },
+  { "ps",         2, "application/postscript"            },
+  { "qt",         2, "video/quicktime"                   },
+  { "ra",         2, "audio/x-realaudio"                 },
+  { "ram",        3, "audio/x-pn-realaudio"              },
+  { "rar",        3, "application/x-rar-compressed"      },
+  { "ras",        3, "image/cmu-raster"                  },
+  { "rgb",        3, "image/x-rgb"                       },
+  { "rm",         2, "audio/x-pn-realaudio"              },
+  { "roff",       4, "application/x-troff"               },
+  { "rpm",        3, "audio/x-pn-realaudio-plugin"       },
+  { "rtf",        3, "application/rtf"                   },
+  { "rtx",        3, "text/richtext"                     },
+  { "scm",        3, "application/x-lotusscreencam"      },
+  { "set",        3, "application/set"                   },
+  { "sgm",        3, "text/sgml"                         },
+  { "sgml",       4, "text/sgml"                         },
+  { "sh",         2, "application/x-sh"                  },
+  { "shar",       4, "application/x-shar"                },
+  { "silo",       4, "model/mesh"                        },
+  { "sit",        3, "application/x-stuffit"             },
+  { "skd",        3, "application/x-koan"                },
+  { "skm",        3, "application/x-koan"                },
+  { "skp",        3, "application/x-koan"                },
+  { "skt",        3, "application/x-koan"                },
+  { "smi",        3, "application/smil"                  },
+  { "smil",       4, "application/smil"                  },
+  { "snd",        3, "audio/basic"                       },
+  { "sol",        3, "application/solids"                },
+  { "spl",        3, "application/x-futuresplash"        },
+  { "src",        3, "application/x-wais-source"         },
+  { "step",       4, "application/STEP"                  },
+  { "stl",        3, "application/SLA"                   },
+  { "stp",        3, "application/STEP"                  },
+  { "sv4cpio",    7, "application/x-sv4cpio"             },
+  { "sv4crc",     6, "application/x-sv4crc"              },
+  { "svg",        3, "image/svg+xml"                     },
+  { "swf",        3, "application/x-shockwave-flash"     },
+  { "t",          1, "application/x-troff"               },
+  { "tar",        3, "application/x-tar"                 },
+  { "tcl",        3, "application/x-tcl"                 },
+  { "tex",        3, "application/x-tex"                 },
+  { "texi",       4, "application/x-texinfo"             },
+  { "texinfo",    7, "application/x-texinfo"             },
+  { "tgz",        3, "application/x-tar-gz"              },
+  { "tif",        3, "image/tiff"                        },
+  { "tiff",       4, "image/tiff"                        },
+  { "tr",         2, "application/x-troff"               },
+  { "tsi",        3, "audio/TSP-audio"                   },
+  { "tsp",        3, "application/dsptype"               },
+  { "tsv",        3, "text/tab-separated-values"         },
+  { "txt",        3, "text/plain"                        },
+  { "unv",        3, "application/i-deas"                },
+  { "ustar",      5, "application/x-ustar"               },
+  { "vcd",        3, "application/x-cdlink"              },
+  { "vda",        3, "application/vda"                   },
+  { "viv",        3, "video/vnd.vivo"                    },
+  { "vivo",       4, "video/vnd.vivo"                    },
+  { "vrml",       4, "model/vrml"                        },
+  { "vsix",       4, "application/vsix"                  },
+  { "wav",        3, "audio/x-wav"                       },
+  { "wax",        3, "audio/x-ms-wax"                    },
+  { "wiki",       4, "application/x-fossil-wiki"         },
+  { "wma",        3, "audio/x-ms-wma"                    },
+  { "wmv",        3, "video/x-ms-wmv"                    },
+  { "wmx",        3, "video/x-ms-wmx"                    },
+  { "wrl",        3, "model/vrml"                        },
+  { "wvx",        3, "video/x-ms-wvx"                    },
+  { "xbm",        3, "image/x-xbitmap"                   },
+  { "xlc",        3, "application/vnd.ms-excel"          },
+  { "xll",        3, "application/vnd.ms-excel"          },
+  { "xlm",        3, "application/vnd.ms-excel"          },
+  { "xls",        3, "application/vnd.ms-excel"          },
+  { "xlw",        3, "application/vnd.ms-excel"          },
+  { "xml",        3, "text/xml"                          },
+  { "xpm",        3, "image/x-xpixmap"                   },
+  { "xwd",        3, "image/x-xwindowdump"               },
+  { "xyz",        3, "chemical/x-pdb"                    },
+  { "zip",        3, "application/zip"                   },
+};
+
+/*
+** Guess the mime-type of a document based on its name.
+*/
+const char *GetMimeType(const char *zName, int nName){
+  const char *z;
+  int i;
+  int first, last;
+  int len;
+  char zSuffix[20];
+
+  for(i=nName-1; i>0 && zName[i]!='.'; i--){}
+  z = &zName[i+1];
+  len = nName - i;
+  if( len<(int)sizeof(zSuffix)-1 ){
+    strcpy(zSuffix, z);
+    for(i=0; zSuffix[i]; i++) zSuffix[i] = tolower(zSuffix[i]);
+    first = 0;
+    last = sizeof(aMime)/sizeof(aMime[0]) - 1;
+    while( first<=last ){
+      int c;
+      i = (first+last)/2;
+      c = strcmp(zSuffix, aMime[i].zSuffix);
+      if( c==0 ) return aMime[i].zMimetype;
+      if( c<0 ){
+        last = i-1;
+      }else{
+        first = i+1;
+      }
+    }
+  }
+  return "application/octet-stream";
+}
+
+/*
+** The following table contains 1 for all characters that are permitted in
+** the part of the URL before the query parameters and fragment.
+**
+** Allowed characters:  0-9a-zA-Z,-./:_~
+**
+** Disallowed characters include:  !"#$%&'()*+;<=>?[\]^{|}
+*/
+static const char allowedInName[] = {
+      /*  x0  x1  x2  x3  x4  x5  x6  x7  x8  x9  xa  xb  xc  xd  xe  xf */
+/* 0x */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+/* 1x */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+/* 2x */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  1,  1,  1,
+/* 3x */   1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  0,  0,  0,  0,  0,
+/* 4x */   0,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+/* 5x */   1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  0,  0,  0,  0,  1,
+/* 6x */   0,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+/* 7x */   1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  0,  0,  0,  1,  0,
+/* 8x */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+/* 9x */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+/* Ax */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+/* Bx */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+/* Cx */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+/* Dx */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+/* Ex */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+/* Fx */   0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+};
+
+/*
+** Remove all disallowed characters in the input string z[].  Convert any
+** disallowed characters into "_".
+**
+** Not that the three character sequence "%XX" where X is any byte is
+** converted into a single "_" character.
+**
+** Return the number of characters converted.  An "%XX" -> "_" conversion
+** counts as a single character.
+*/
+static int sanitizeString(char *z){
+  int nChange = 0;
+  while( *z ){
+    if( !allowedInName[*(unsigned char*)z] ){
+      if( *z=='%' && z[1]!=0 && z[2]!=0 ){
+        int i;
+        for(i=3; (z[i-2] = z[i])!=0; i++){}
+      }
+      *z = '_';
+      nChange++;
+    }
+    z++;
+  }
+  return nChange;
+}
+
+/*
+** Count the number of "/" characters in a string.
+*/
+static int countSlashes(const char *z){
+  int n = 0;
+  while( *z ) if( *(z++)=='/' ) n++;
+  return n;
+}
+
+/*
+** Transfer nXfer bytes from in to out, after first discarding
+** nSkip bytes from in.  Increment the nOut global variable
+** according to the number of bytes transferred.
+*/
+static void xferBytes(FILE *in, FILE *out, int nXfer, int nSkip){
+  size_t n;
+  size_t got;
+  char zBuf[16384];
+  while( nSkip>0 ){
+    n = nSkip;
+    if( n>sizeof(zBuf) ) n = sizeof(zBuf);
+    got = fread(zBuf, 1, n, in);
+    if( got==0 ) break;
+    nSkip -= got;
+  }
+  while( nXfer>0 ){
+    n = nXfer;
+    if( n>sizeof(zBuf) ) n = sizeof(zBuf);
+    got = fread(zBuf, 1, n, in);
+    if( got==0 ) break;
+    fwrite(zBuf, got, 1, out);
+    nOut += got;
+    nXfer -= got;
+  }
+}
+
+/*
+** Static content may have precompressed copies beside it: "X.br" and
+** "X.gz" for file "X".  A copy that is no older than X is sent in place
+** of X, with a Content-Encoding header, to clients that accept its
+** encoding.  Entries are in order of preference.
+*/
+#define ACCEPT_BR    0x01     /* Client accepts "br" */
+#define ACCEPT_GZIP  0x02     /* Client accepts "gzip" */
+static const struct {
+  const char *zSuffix;        /* Suffix of the precompressed file */
+  const char *zEncoding;      /* Value for the Content-Encoding header */
+  int mAccept;                /* The ACCEPT_* bit for this encoding */
+} aSidecar[] = {
+  { ".br",  "br",   ACCEPT_BR   },
+  { ".gz",  "gzip", ACCEPT_GZIP },
+};
+
+/*
+** Return a mask of ACCEPT_* bits for the content codings named in the
+** Accept-Encoding header of the current request.  A coding with a
+** quality value of zero is not acceptable.  Range requests are always
+** served from the uncompressed file.
+*/
+static int AcceptedEncodings(void){
+  const char *z = zAcceptEncoding;
+  int mAccept = 0;
+  if( z==0 || rangeEnd>0 ) return 0;
+  while( *z ){
+    const char *zName;
+    int nName, m = 0;
+    while( *z==' ' || *z=='\t' || *z==',' ){ z++; }
+    zName = z;
+    while( *z && *z!=',' && *z!=';' && *z!=' ' && *z!='\t' ){ z++; }
+    nName = (int)(z - zName);
+    if( nName==2 && strncasecmp(zName, "br", 2)==0 ) m = ACCEPT_BR;
+    if( nName==4 && strncasecmp(zName, "gzip", 4)==0 ) m = ACCEPT_GZIP;
+    if( nName==6 && strncasecmp(zName, "x-gzip", 6)==0 ) m = ACCEPT_GZIP;
+    while( *z==' ' || *z=='\t' ){ z++; }
+    if( *z==';' ){
+      const char *zQ;
+      while( *z==';' || *z==' ' || *z=='\t' ){ z++; }
+      zQ = z;
+      while( *z && *z!=',' ){ z++; }
+      if( (zQ[0]=='q' || zQ[0]=='Q') && zQ[1]=='=' && atof(&zQ[2])<=0.0 ){
+        m = 0;
+      }
+    }
+    mAccept |= m;
+  }
+  return mAccept;
+}
+
+/*
+** Look for precompressed copies of static file zFile, described by
+** *pStat.  Return the index in aSidecar[] of the copy to send to a
+** client that accepts the encodings in mAccept, and write its status
+** into *pSide, or return -1 to send zFile itself.  Set *pVary if the
+** reply depends on the Accept-Encoding header, that is if any usable
+** copy exists whether or not this client accepts it.
+*/
+static int FindSidecar(
+  const char *zFile,          /* The static content file */
+  int lenFile,                /* Length of zFile in bytes */
+  const struct stat *pStat,   /* Status of zFile */
+  int mAccept,                /* Acceptable encodings.  ACCEPT_* bits */
+  struct stat *pSide,         /* OUT: Status of the chosen copy */
+  int *pVary                  /* OUT: True if any copy exists */
+){
+  char zName[1000];
+  struct stat s;
+  unsigned int i;
+  int iBest = -1;
+  *pVary = 0;
+  if( lenFile+5>(int)sizeof(zName) ) return -1;
+  memcpy(zName, zFile, lenFile);
+  for(i=0; i<sizeof(aSidecar)/sizeof(aSidecar[0]); i++){
+    strcpy(&zName[lenFile], aSidecar[i].zSuffix);
+    if( stat(zName, &s)!=0 || !S_ISREG(s.st_mode) ) continue;
+    if( s.st_mtime<pStat->st_mtime ) continue;
+    *pVary = 1;
+    if( iBest<0 && (mAccept & aSidecar[i].mAccept)!=0 ){
+      iBest = i;
+      *pSide = s;
+    }
+  }
+  return iBest;
+}
+
+/*
+** Turn TCP_CORK on or off for the connection on standard output.  While
+** the cork is in, the kernel sends only full segments.  This does
+** nothing if standard output is not a TCP socket.
+*/
+static void TcpCork(int onoff){
+#if defined(TCP_CORK)
+  setsockopt(1, IPPROTO_TCP, TCP_CORK, &onoff, sizeof(onoff));
+#elif defined(TCP_NOPUSH)
+  setsockopt(1, IPPROTO_TCP, TCP_NOPUSH, &onoff, sizeof(onoff));
+#endif
+}
+
+/*
+** Write the ETag for a file with status *pStat into zETag[], which must
+** be at least 40 bytes in size.  iSide is the index in aSidecar[] of the
+** precompressed copy being described, or -1 for the file itself, so
+** that each representation has a distinct ETag.
+*/
+static void FileETag(char *zETag, const struct stat *pStat, int iSide){
+  sprintf(zETag, "m%xs%x%s%s", (int)pStat->st_mtime, (int)pStat->st_size,
+          iSide<0 ? "" : "-", iSide<0 ? "" : aSidecar[iSide].zEncoding);
+}
+
+/*
+** Send the content of static file zFile as the reply, using MIME type
+** zContentType and ETag zETag.  If fd is non-negative it is an open
+** descriptor on zFile which the caller retains.  Otherwise the file is
+** opened here, but only if the reply needs its content.  If iSide is
+** not negative, zFile is the precompressed copy aSidecar[iSide].
+**
+** Return 1 to omit making a log entry for the reply.
+*/
+static int SendFileContent(
+  int fd,                  /* Open descriptor on zFile, or -1 */
+  const char *zFile,       /* Name of the file to send */
+  const char *zContentType,  /* MIME type of the content */
+  const char *zETag,       /* ETag for the content */
+  struct stat *pStat,      /* Result of a stat() against zFile */
+  int iSide,               /* Index in aSidecar[] of zFile, or -1 */
+  int bVary                /* True to send "Vary: Accept-Encoding" */
+){
+  time_t t;
+
+  if( CompareEtags(zIfNoneMatch,zETag)==0
+   || (zIfModifiedSince!=0
+        && (t = ParseRfc822Date(zIfModifiedSince))>0
+        && t>=pStat->st_mtime)
+  ){
+    StartResponse("304 Not Modified");
+    nOut += DateTag("Last-Modified", pStat->st_mtime);
+    nOut += printf("Cache-Control: max-age=%d\r\n", mxAge);
+    nOut += printf("ETag: \"%s\"\r\n", zETag);
+    if( bVary ) nOut += printf("Vary: Accept-Encoding\r\n");
+    nOut += printf("\r\n");
+    fflush(stdout);
+    PhaseMark(STATS_PHASE_SEND);
+    MakeLogEntry(0, 470);  /* LOG: ETag Cache Hit */
+    return 1;
+  }
+  if( fd<0 ){
+    fd = fdContent = open(zFile, O_RDONLY|O_CLOEXEC);
+    if( fd<0 ) NotFound(480); /* LOG: fopen() failed for static content */
+  }
+  if( rangeEnd>0 && rangeStart<pStat->st_size ){
+    StartResponse("206 Partial Content");
+    if( rangeEnd>=pStat->st_size ){
+      rangeEnd = pStat->st_size-1;
+    }
+    nOut += printf("Content-Range: bytes %d-%d/%d\r\n",
+                    rangeStart, rangeEnd, (int)pStat->st_size);
+    pStat->st_size = rangeEnd + 1 - rangeStart;
+  }else{
+    StartResponse("200 OK");
+    rangeStart = 0;
+  }
+  nOut += DateTag("Last-Modified", pStat->st_mtime);
+  nOut += printf("Cache-Control: max-age=%d\r\n", mxAge);
+  nOut += printf("ETag: \"%s\"\r\n", zETag);
+  nOut += printf("Content-type: %s; charset=utf-8\r\n",zContentType);
+  if( iSide>=0 ){
+    nOut += printf("Content-Encoding: %s\r\n", aSidecar[iSide].zEncoding);
+  }
+  if( bVary ) nOut += printf("Vary: Accept-Encoding\r\n");
+  nOut += printf("Content-length: %d\r\n\r\n",(int)pStat->st_size);
+  if( strcmp(zMethod,"HEAD")==0 ){
+    if( fdContent>=0 ){
+      close(fdContent);
+      fdContent = -1;
+    }
+    fflush(stdout);
+    PhaseMark(STATS_PHASE_SEND);
+    MakeLogEntry(0, 2); /* LOG: Normal HEAD reply */
+    fflush(stdout);
+    return 1;
+  }
+  if( useTimeout ) alarm(30 + pStat->st_size/1000);
+#ifdef linux
+  {
+    off_t offset = rangeStart;
+    ssize_t nSent;
+    /* Hold the header back until sendfile() supplies the content, so that
+    ** a small reply goes out as a single segment. */
+    TcpCork(1);
+    fflush(stdout);
+    nSent = sendfile(fileno(stdout), fd, &offset, pStat->st_size);
+    TcpCork(0);
+    PROBE2(sendfile__done, (long long)nSent, (long long)pStat->st_size);
+    if( nSent>0 ) nOut += nSent;
+    /* If the file shrank after the headers were sent, the client will
+    ** never see the promised number of bytes.  End the connection. */
+    if( nSent<pStat->st_size ) closeConnection = 1;
+  }
+#else
+  {
+    FILE *in;
+    lseek(fd, 0, SEEK_SET);
+    in = fdopen(dup(fd), "rb");
+    if( in ){
+      xferBytes(in, stdout, (int)pStat->st_size, rangeStart);
+      fclose(in);
+    }
+  }
+#endif
+  if( fdContent>=0 ){
+    close(fdContent);
+    fdContent = -1;
+  }
+  PhaseMark(STATS_PHASE_SEND);
+  return 0;
+}
+
+/*
+** Send the text of the file named by zFile as the reply.  Use the
+** suffix on the end of the zFile name to determine the mimetype.
+**
+** Return 1 to omit making a log entry for the reply.
+*/
+static int SendFile(
+  const char *zFile,      /* Name of the file to send */
+  int lenFile,            /* Length of the zFile name in bytes */
+  struct stat *pStat      /* Result of a stat() against zFile */
+){
+  const char *zContentType = GetMimeType(zFile, lenFile);
+  char zETag[40];
+  struct stat sSide;
+  int bVary;
+  int iSide;
+
+  iSide = FindSidecar(zFile, lenFile, pStat, AcceptedEncodings(),
+                      &sSide, &bVary);
+  PhaseMark(STATS_PHASE_PATH);
+  if( iSide>=0 ){
+    char *zSide = StrAppend(StrDup(zFile), "", aSidecar[iSide].zSuffix);
+    FileETag(zETag, &sSide, iSide);
+    return SendFileContent(-1, zSide, zContentType, zETag, &sSide,
+                           iSide, bVary);
+  }
+  FileETag(zETag, pStat, -1);
+  return SendFileContent(-1, zFile, zContentType, zETag, pStat, -1, bVary);
+}
+
+/*
+** A long-lived process keeps a cache of the static files it has served
+** recently.  Each entry maps a request, identified by the *.website
+** directory named by its Host: header, by its URI and by the encodings
+** it accepts, onto the file that ProcessOneRequest() resolved it to.
+** The entry holds an open descriptor on that file, or on the
+** precompressed copy of it that is sent instead, together with its
+** stat() information, MIME type and ETag, so that a hit can be answered
+** without any lookups in the filesystem.
+**
+** An entry is trusted for fileCacheTtl seconds after it was created or
+** last checked.  After that, the next hit checks it again with stat()
+** on the file and its precompressed copies.  The entry is discarded if
+** any of them has been replaced or modified, or if the choice of copy
+** would now be different.  It is also discarded if an -auth file has
+** appeared beside the file, or if the *.website directory named by the
+** Host: header has appeared when the request had been served from
+** default.website.
+**
+** The least recently used entry is discarded to make room once the
+** cache holds nFileCache entries.  Files protected by an -auth file are
+** never cached.
+*/
+typedef struct FileCacheEntry FileCacheEntry;
+struct FileCacheEntry {
+  char *zKey;               /* *.website directory and URI */
+  char *zFile;              /* Name of the content file */
+  char *zRealScript;        /* Part of zFile that corresponds to the URI */
+  char *zAuth;              /* Name of the -auth file that must not exist */
+  char *zSite;              /* Directory that must not exist, or NULL */
+  const char *zMime;        /* MIME type of the content */
+  char zETag[40];           /* ETag of the content */
+  int fd;                   /* Open descriptor on the content to send */
+  int mAccept;              /* Encodings accepted.  ACCEPT_* bits */
+  int iSide;                /* aSidecar[] entry being sent, or -1 */
+  int bVary;                /* True if precompressed copies exist */
+  unsigned int h;           /* Hash of zKey */
+  time_t tCheck;            /* When sStat was last known to be current */
+  struct stat sStat;        /* Status of zFile */
+  struct stat sSend;        /* Status of the content to send */
+  FileCacheEntry *pNext;    /* Next less recently used entry */
+  FileCacheEntry *pPrev;    /* Next more recently used entry */
+  FileCacheEntry *pHash;    /* Next entry in the same hash bucket */
+};
+static FileCacheEntry *pCacheFirst = 0;  /* Most recently used entry */
+static FileCacheEntry *pCacheLast = 0;   /* Least recently used entry */
+static FileCacheEntry **apCacheHash = 0; /* Hash table of entries */
+static unsigned int nCacheHash = 0;      /* Number of hash buckets */
+static int nCacheEntry = 0;              /* Number of entries */
+
+/*
+** Compute a hash of string z.
+*/
+static unsigned int FileCacheHash(const char *z){
+  unsigned int h = 0;
+  while( *z ){ h = (h<<3) ^ (h>>28) ^ (unsigned char)*(z++); }
+  return h;
+}
+
+/*
+** Remove entry p from the cache, close its descriptor and free it.
+*/
+static void FileCacheRemove(FileCacheEntry *p){
+  FileCacheEntry **pp = &apCacheHash[p->h % nCacheHash];
+  while( *pp!=p ) pp = &(*pp)->pHash;
+  *pp = p->pHash;
+  if( p->pPrev ){
+    p->pPrev->pNext = p->pNext;
+  }else{
+    pCacheFirst = p->pNext;
+  }
+  if( p->pNext ){
+    p->pNext->pPrev = p->pPrev;
+  }else{
+    pCacheLast = p->pPrev;
+  }
+  nCacheEntry--;
+  close(p->fd);
+  free(p);
+}
+
+/*
+** Return true if *pA and *pB describe the same unmodified regular file.
+*/
+static int SameFile(const struct stat *pA, const struct stat *pB){
+  return S_ISREG(pA->st_mode)
+      && pA->st_ino==pB->st_ino
+      && pA->st_dev==pB->st_dev
+      && pA->st_size==pB->st_size
+      && pA->st_mtime==pB->st_mtime
+      && pA->st_ctime==pB->st_ctime;
+}
+
+/*
+** Return true if entry p can still be used at time now.
+*/
+static int FileCacheValid(FileCacheEntry *p, time_t now){
+  struct stat s;
+  int bVary;
+  if( now - p->tCheck < fileCacheTtl ) return 1;
+  if( stat(p->zFile, &s)!=0 || !SameFile(&s, &p->sStat) ) return 0;
+  if( FindSidecar(p->zFile, (int)strlen(p->zFile), &p->sStat, p->mAccept,
+                  &s, &bVary)!=p->iSide
+   || bVary!=p->bVary
+   || (p->iSide>=0 && !SameFile(&s, &p->sSend))
+  ){
+    return 0;
+  }
+  if( access(p->zAuth, R_OK)==0 ) return 0;
+  if( p->zSite && stat(p->zSite, &s)==0 ) return 0;
+  p->tCheck = now;
+  return 1;
+}
+
+/*
+** Return the cache entry for key zKey, or NULL if there is none that is
+** still valid.
+*/
+static FileCacheEntry *FileCacheFind(const char *zKey){
+  FileCacheEntry *p;
+  unsigned int h;
+  if( nCacheEntry==0 ) return 0;
+  h = FileCacheHash(zKey);
+  for(p=apCacheHash[h % nCacheHash]; p; p=p->pHash){
+    if( p->h==h && strcmp(p->zKey, zKey)==0 ) break;
+  }
+  if( p==0 ) return 0;
+  if( !FileCacheValid(p, time(0)) ){
+    FileCacheRemove(p);
+    return 0;
+  }
+  if( p!=pCacheFirst ){
+    p->pPrev->pNext = p->pNext;
+    if( p->pNext ){
+      p->pNext->pPrev = p->pPrev;
+    }else{
+      pCacheLast = p->pPrev;
+    }
+    p->pPrev = 0;
+    p->pNext = pCacheFirst;
+    pCacheFirst->pPrev = p;
+    pCacheFirst = p;
+  }
+  return p;
+}
+
+/*
+** Open file zFile, or the precompressed copy of it that suits encodings
+** mAccept, and add it to the cache under key zKey.  Return the new
+** entry, or NULL if the file could not be opened or there is not enough
+** memory.  *pStat describes zFile on input.  On output it describes the
+** content to send.
+*/
+static FileCacheEntry *FileCacheAdd(
+  const char *zKey,         /* Directory, URI and encodings of the request */
+  const char *zSite,        /* Directory that must not exist, or NULL */
+  const char *zFile,        /* The file to be served */
+  int lenFile,              /* Length of zFile in bytes */
+  const char *zRealScript,  /* Part of zFile that corresponds to the URI */
+  const char *zAuth,        /* The -auth file that must not exist */
+  int mAccept,              /* Encodings accepted.  ACCEPT_* bits */
+  struct stat *pStat        /* IN/OUT: Status of the file */
+){
+  FileCacheEntry *p;
+  size_t nKey = strlen(zKey)+1;
+  size_t nSite = zSite ? strlen(zSite)+1 : 0;
+  size_t nReal = strlen(zRealScript)+1;
+  size_t nAuth = strlen(zAuth)+1;
+  struct stat sSide;
+  int iSide, bVary;
+  int fd;
+
+  if( apCacheHash==0 ){
+    nCacheHash = nFileCache*2 + 1;
+    apCacheHash = calloc(nCacheHash, sizeof(apCacheHash[0]));
+    if( apCacheHash==0 ) return 0;
+  }
+  iSide = FindSidecar(zFile, lenFile, pStat, mAccept, &sSide, &bVary);
+  if( iSide>=0 ){
+    char *zSide = StrAppend(StrDup(zFile), "", aSidecar[iSide].zSuffix);
+    fd = open(zSide, O_RDONLY|O_CLOEXEC);
+  }else{
+    fd = open(zFile, O_RDONLY|O_CLOEXEC);
+  }
+  if( fd<0 ) return 0;
+  p = malloc( sizeof(*p) + nKey + nSite + lenFile + 1 + nReal + nAuth );
+  if( p==0 || fstat(fd, &p->sSend)!=0 || !S_ISREG(p->sSend.st_mode) ){
+    close(fd);
+    free(p);
+    return 0;
+  }
+  p->sStat = iSide>=0 ? *pStat : p->sSend;
+  while( nCacheEntry>=nFileCache ) FileCacheRemove(pCacheLast);
+  p->zKey = (char*)&p[1];
+  memcpy(p->zKey, zKey, nKey);
+  p->zSite = zSite ? p->zKey + nKey : 0;
+  if( zSite ) memcpy(p->zSite, zSite, nSite);
+  p->zFile = p->zKey + nKey + nSite;
+  memcpy(p->zFile, zFile, lenFile+1);
+  p->zRealScript = p->zFile + lenFile + 1;
+  memcpy(p->zRealScript, zRealScript, nReal);
+  p->zAuth = p->zRealScript + nReal;
+  memcpy(p->zAuth, zAuth, nAuth);
+  p->zMime = GetMimeType(p->zFile, lenFile);
+  FileETag(p->zETag, &p->sSend, iSide);
+  p->fd = fd;
+  p->mAccept = mAccept;
+  p->iSide = iSide;
+  p->bVary = bVary;
+  p->h = FileCacheHash(zKey);
+  p->tCheck = time(0);
+  p->pHash = apCacheHash[p->h % nCacheHash];
+  apCacheHash[p->h % nCacheHash] = p;
+  p->pPrev = 0;
+  p->pNext = pCacheFirst;
+  if( pCacheFirst ){
+    pCacheFirst->pPrev = p;
+  }else{
+    pCacheLast = p;
+  }
+  pCacheFirst = p;
+  nCacheEntry++;
+  *pStat = p->sSend;
+  return p;
+}
+
+/*
+** Copy the rest of the reply from a CGI or SCGI script on channel "in"
+** to the client using chunked transfer encoding.  Each chunk holds
+** whatever the script has produced so far, up to 16KB, so the client
+** sees output as soon as the script writes it.
+*/
+static void CgiStreamChunked(FILE *in){
+  char zBuf[16384];
+  int fd = fileno(in);
+  size_t n;
+
+  /* With the descriptor non-blocking, fread() returns whatever is already
+  ** buffered or readable instead of waiting for a full buffer. */
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  while( 1 ){
+    n = fread(zBuf, 1, sizeof(zBuf), in);
+    if( n>0 ){
+      nOut += printf("%x\r\n", (int)n);
+      nOut += fwrite(zBuf, 1, n, stdout);
+      nOut += printf("\r\n");
+      if( n==sizeof(zBuf) ) continue;
+    }
+    if( feof(in) ) break;
+    if( ferror(in) ){
+      if( errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR ) break;
+      clearerr(in);
+    }
+    if( n==0 ){
+      struct pollfd x;
+      fflush(stdout);
+      x.fd = fd;
+      x.events = POLLIN;
+      x.revents = 0;
+      poll(&x, 1, -1);
+    }
+  }
+  nOut += printf("0\r\n\r\n");
+}
+
+/*
+** A CGI or SCGI script has run and is sending its reply back across
+** the channel "in".  Process this reply into an appropriate HTTP reply.
+** Close the "in" channel when done.
+**
+** If the script does not say how long its content is, the content is
+** streamed to HTTP/1.1 clients using chunked transfer encoding.  For
+** HTTP/1.0 clients it is collected in memory so that a Content-length
+** can be sent ahead of it.
+*/
+static void CgiHandleReply(FILE *in){
+  int seenContentLength = 0;   /* True if Content-length: header seen */
+  int contentLength = 0;       /* The content length */
+  size_t nRes = 0;             /* Bytes of payload */
+  size_t nMalloc = 0;          /* Bytes of space allocated to aRes */
+  char *aRes = 0;              /* Payload */
+  size_t got;                  /* Bytes of payload just read */
+  char *z;                     /* Pointer to something inside of zLine */
+  int iStatus = 0;             /* Reply status code */
+  char zLine[1000];            /* One line of reply from the CGI script */
+
+  if( useTimeout ){
+    /* Disable the timeout, so that we can implement Hanging-GET or
+    ** long-poll style CGIs.  The RLIMIT_CPU will serve as a safety
+    ** to help prevent a run-away CGI */
+    alarm(0);
+  }
+  while( fgets(zLine,sizeof(zLine),in) && !isspace((unsigned char)zLine[0]) ){
+    if( strncasecmp(zLine,"Location:",9)==0 ){
+      StartResponse("302 Redirect");
+      RemoveNewline(zLine);
+      z = &zLine[10];
+      while( isspace(*(unsigned char*)z) ){ z++; }
+      nOut += printf("Location: %s\r\n",z);
+      rangeEnd = 0;
+    }else if( strncasecmp(zLine,"Status:",7)==0 ){
+      int i;
+      for(i=7; isspace((unsigned char)zLine[i]); i++){}
+      PROBE2(response__start, &zLine[i], nOut);
+      nOut += printf("%s %s", zProtocol, &zLine[i]);
+      strncpy(zReplyStatus, &zLine[i], 3);
+      zReplyStatus[3] = 0;
+      iStatus = atoi(zReplyStatus);
+      if( iStatus!=200 ) rangeEnd = 0;
+      statusSent = 1;
+    }else if( strncasecmp(zLine, "Content-length:", 15)==0 ){
+      seenContentLength = 1;
+      contentLength = atoi(zLine+15);
+    }else{
+      size_t nLine = strlen(zLine);
+      if( nRes+nLine >= nMalloc ){
+        nMalloc += nMalloc + nLine*2;
+        aRes = realloc(aRes, nMalloc+1);
+        if( aRes==0 ){
+          Malfunction(600, "Out of memory: %d bytes", nMalloc);
+        }
+      }
+      memcpy(aRes+nRes, zLine, nLine);
+      nRes += nLine;
+    }
+  }
+  PhaseMark(STATS_PHASE_BACKEND);
+
+  /* Copy everything else thru without change or analysis.
+  */
+  if( rangeEnd>0 && seenContentLength && rangeStart<contentLength ){
+    StartResponse("206 Partial Content");
+    if( rangeEnd>=contentLength ){
+      rangeEnd = contentLength-1;
+    }
+    nOut += printf("Content-Range: bytes %d-%d/%d\r\n",
+                    rangeStart, rangeEnd, contentLength);
+    contentLength = rangeEnd + 1 - rangeStart;
+  }else{
+    StartResponse("200 OK");
+  }
+  if( nRes>0 ){
+    aRes[nRes] = 0;
+    printf("%s", aRes);
+    nOut += nRes;
+    nRes = 0;
+  }
+  if( iStatus==304 ){
+    nOut += printf("\r\n\r\n");
+  }else if( seenContentLength ){
+    nOut += printf("Content-length: %d\r\n\r\n", contentLength);
+    xferBytes(in, stdout, contentLength, rangeStart);
+  }else if( strcmp(zProtocol,"HTTP/1.1")==0
+         && strcmp(zMethod,"HEAD")!=0
+         && iStatus!=204
+  ){
+    nOut += printf("Transfer-Encoding: chunked\r\n\r\n");
+    CgiStreamChunked(in);
+  }else{
+    do{
+      if( nRes+16384>nMalloc ){
+        nMalloc = nMalloc*2 + 16384;
+        aRes = realloc(aRes, nMalloc+1);
+        if( aRes==0 ){
+           Malfunction(610, "Out of memory: %d bytes", nMalloc);
+        }
+      }
+      got = fread(aRes+nRes, 1, nMalloc-nRes, in);
+      nRes += got;
+    }while( got>0 );
+    nOut += printf("Content-length: %d\r\n\r\n", (int)nRes);
+    if( nRes ) nOut += fwrite(aRes, 1, nRes, stdout);
+  }
+  PhaseMark(STATS_PHASE_SEND);
+  free(aRes);
+  fclose(in);
+}
+
+/*
+** The request header is read into a single buffer and parsed in place.
+** The request line and each header field are recorded as offsets and
+** lengths into the buffer, so nothing is copied.  The parse can stop at
+** any point where the input runs out and resume when more arrives, which
+** lets a worker collect a header from a parked connection bit by bit.
+**
+** Bytes that arrive after the end of the header, such as POST content or
+** the next pipelined request, stay in the buffer for the next reader.
+** Request content is not read until a handler needs it, so the nBody
+** bytes of content that follow a header must be consumed or skipped
+** before the next header can be parsed.
+*/
+typedef struct HttpField HttpField;
+struct HttpField {
+  int iName, nName;        /* Field name, without the ":" */
+  int iVal, nVal;          /* Field value, trimmed of leading/trailing space */
+};
+typedef struct HttpInput HttpInput;
+struct HttpInput {
+  int n;                   /* Bytes of data in a[] */
+  int iRd;                 /* Bytes at the front of a[] already consumed */
+  int iScan;               /* Resume the search for end-of-line here */
+  int iLine;               /* Start of the current line */
+  int nHead;               /* Size of the complete header.  0 if incomplete */
+  int inHeader;            /* True while a header is being collected */
+  int iReq, nReq;          /* The request line.  nReq<0 if not yet seen */
+  int iHdr;                /* Start of the line after the request line */
+  int nField;              /* Number of entries in aField[] */
+  int nBody;               /* Request content not yet read from the client */
+  HttpField aField[MAX_HEADER_FIELD];
+  char a[MAX_HEADER_SIZE];
+};
+static HttpInput sStdIn;          /* Input buffer for standard input */
+static HttpInput *pIn = &sStdIn;  /* Input for the current connection */
+
+/*
+** Prepare p to receive the next request header.  Any unconsumed input
+** is moved to the front of the buffer.
+*/
+static void HttpInputBegin(HttpInput *p){
+  if( p->iRd>0 ){
+    if( p->iRd<p->n ) memmove(p->a, &p->a[p->iRd], p->n - p->iRd);
+    p->n -= p->iRd;
+    p->iRd = 0;
+  }
+  p->iScan = p->iLine = 0;
+  p->nHead = 0;
+  p->inHeader = 1;
+  p->nReq = -1;
+  p->nField = 0;
+}
+
+/*
+** Scan whatever input has not yet been scanned.  Return 1 if the header
+** is complete, 0 if more input is needed, or -1 if the header is too large
+** to fit in the buffer or has more than MAX_HEADER_FIELD fields.
+**
+** A field beyond the limit is an error rather than being ignored, as an
+** ignored Content-Length would leave the request content to be parsed as
+** the next request.  The scan stops in front of that field, so that
+** calling this routine again gives the same answer.
+*/
+static int HttpInputParse(HttpInput *p){
+  char *a = p->a;
+  if( p->nHead>0 ) return 1;
+  while( p->iScan<p->n ){
+    char *zEol = memchr(&a[p->iScan], '\n', p->n - p->iScan);
+    int iEnd;
+    if( zEol==0 ){
+      p->iScan = p->n;
+      break;
+    }
+    iEnd = (int)(zEol - a);
+    p->iScan = iEnd+1;
+    if( iEnd>p->iLine && a[iEnd-1]=='\r' ) iEnd--;
+    if( iEnd==p->iLine ){
+      if( p->nReq>=0 ){
+        p->nHead = p->iScan;
+        p->iRd = p->nHead;
+        return 1;
+      }
+      /* Ignore blank lines in front of the request line */
+    }else if( p->nReq<0 ){
+      p->iReq = p->iLine;
+      p->nReq = iEnd - p->iLine;
+      p->iHdr = p->iScan;
+    }else{
+      char *zColon = memchr(&a[p->iLine], ':', iEnd - p->iLine);
+      if( zColon ){
+        HttpField *pF;
+        int i = (int)(zColon - a) + 1;
+        if( p->nField>=MAX_HEADER_FIELD ){
+          p->iScan = p->iLine;
+          return -1;
+        }
+        pF = &p->aField[p->nField++];
+        pF->iName = p->iLine;
+        pF->nName = i - 1 - p->iLine;
+        while( i<iEnd && (a[i]==' ' || a[i]=='\t') ){ i++; }
+        while( iEnd>i && (a[iEnd-1]==' ' || a[iEnd-1]=='\t') ){ iEnd--; }
+        pF->iVal = i;
+        pF->nVal = iEnd - i;
+      }
+    }
+    p->iLine = p->iScan;
+  }
+  return p->n>=(int)sizeof(p->a) ? -1 : 0;
+}
+
+/*
+** Read more input from file descriptor fd into p.  If dontWait is true,
+** fd must be a socket, and only input that has already arrived is read.
+** Return the number of bytes read, 0 at end-of-file, or -1 on an error.
+*/
+static int HttpInputFill(HttpInput *p, int fd, int dontWait){
+  int got;
+  if( p->n>=(int)sizeof(p->a) ) return 0;
+  do{
+    if( dontWait ){
+      got = (int)recv(fd, &p->a[p->n], sizeof(p->a) - p->n, MSG_DONTWAIT);
+    }else{
+      got = (int)read(fd, &p->a[p->n], sizeof(p->a) - p->n);
+    }
+  }while( got<0 && errno==EINTR );
+  if( got>0 ) p->n += got;
+  return got;
+}
+
+/*
+** Read up to n bytes of request content from the client into zBuf,
+** starting with any that were already read along with the header.
+** Return the number of bytes actually read.
+*/
+static size_t ClientRead(char *zBuf, size_t n){
+  size_t got = 0;
+  if( pIn->iRd<pIn->n ){
+    got = pIn->n - pIn->iRd;
+    if( got>n ) got = n;
+    memcpy(zBuf, &pIn->a[pIn->iRd], got);
+    pIn->iRd += got;
+  }
+  while( got<n ){
+    ssize_t x = read(0, &zBuf[got], n-got);
+    if( x<0 && errno==EINTR ) continue;
+    if( x<=0 ) break;
+    got += x;
+  }
+  return got;
+}
+
+/*
+** Discard the request content in p that no handler read, so that the
+** next request header can be parsed.  If dontWait is true, fd must be a
+** socket, and only input that has already arrived is read.  Return 1 once
+** all of the content is gone, 0 if more has yet to arrive, or -1 at
+** end-of-file or on an error.
+*/
+static int HttpInputSkip(HttpInput *p, int fd, int dontWait){
+  char zBuf[16384];
+  int got = p->n - p->iRd;
+  if( got>p->nBody ) got = p->nBody;
+  p->iRd += got;
+  p->nBody -= got;
+  nIn += got;
+  while( p->nBody>0 ){
+    int want = p->nBody<(int)sizeof(zBuf) ? p->nBody : (int)sizeof(zBuf);
+    if( dontWait ){
+      got = (int)recv(fd, zBuf, want, MSG_DONTWAIT);
+    }else{
+      got = (int)read(fd, zBuf, want);
+    }
+    if( got<0 && errno==EINTR ) continue;
+    if( got<0 && dontWait && (errno==EAGAIN || errno==EWOULDBLOCK) ){
+      return 0;
+    }
+    if( got<=0 ) return -1;
+    p->nBody -= got;
+    nIn += got;
+  }
+  return 1;
+}
+
+/*
+** Copy the request content from the client to out, a bounded piece at a
+** time.  If the client sends less than it promised, close the connection
+** after this request.
+*/
+static void PostCopy(FILE *out){
+  char zBuf[16384];
+  while( pIn->nBody>0 ){
+    size_t n = pIn->nBody<(int)sizeof(zBuf) ? (size_t)pIn->nBody
+                                             : sizeof(zBuf);
+    size_t got = ClientRead(zBuf, n);
+    nIn += got;
+    pIn->nBody -= got;
+    if( got>0 ) fwrite(zBuf, 1, got, out);
+    if( got<n ){
+      closeConnection = 1;
+      break;
+    }
+  }
+}
+
+/*
+** Close every file descriptor above standard error, in a child process
+** that is about to run a CGI program or copy POST content.  A long-lived
+** worker holds listening sockets, its epoll set and the parked
+** connections of other clients, and none of those must leak into the
+** child.  The numbers of open descriptors can have gaps, so stopping at
+** the first close() that fails is not enough.
+*/
+static void CloseExtraFds(void){
+  long i, mx;
+#if defined(__linux__) && defined(SYS_close_range)
+  if( syscall(SYS_close_range, 3, ~0U, 0)==0 ) return;
+#endif
+  mx = sysconf(_SC_OPEN_MAX);
+  if( mx<0 ) mx = 1024;
+  for(i=3; i<mx; i++) close((int)i);
+}
+
+/*
+** Write all n bytes of z to fd.  Return 0 on success or -1 on an error.
+*/
+static int WriteAll(int fd, const char *z, int n){
+  while( n>0 ){
+    int got = (int)write(fd, z, n);
+    if( got<0 && errno==EINTR ) continue;
+    if( got<=0 ) return -1;
+    z += got;
+    n -= got;
+  }
+  return 0;
+}
+
+/*
+** Create a pipe that delivers the request content, for use as standard
+** input of a CGI program, and leave its read end in fdPostBody.  A child
+** process copies the content from the client into the pipe a bounded
+** piece at a time, starting with whatever was read along with the header.
+** The child keeps reading the client after the CGI program stops reading
+** the pipe, so that the connection stays in step for the next request.
+*/
+static void PostFeederStart(void){
+  int px[2];
+  int nBuf = pIn->n - pIn->iRd;
+  if( nBuf>pIn->nBody ) nBuf = pIn->nBody;
+  if( pipe(px) ){
+    Malfunction(290, /* LOG: cannot create pipe for POST content */
+                "Cannot create a pipe for POST data");
+  }
+  if( pIn->nBody>0 ){
+    pid_t pid = fork();
+    if( pid<0 ){
+      Malfunction(291, /* LOG: cannot fork to copy POST content */
+                  "Cannot fork a process to copy POST data");
+    }
+    if( pid==0 ){
+      char zBuf[16384];
+      int nLeft = pIn->nBody - nBuf;
+      int rc = 0;
+      signal(SIGPIPE, SIG_IGN);
+      signal(SIGALRM, SIG_DFL);
+      if( useTimeout ) alarm(15 + pIn->nBody/2000);
+      close(px[0]);
+      if( dup2(px[1], 1)!=1 ) _exit(1);
+      CloseExtraFds();
+      if( nBuf>0 ) rc = WriteAll(1, &pIn->a[pIn->iRd], nBuf);
+      while( nLeft>0 ){
+        int want = nLeft<(int)sizeof(zBuf) ? nLeft : (int)sizeof(zBuf);
+        int got = (int)read(0, zBuf, want);
+        if( got<0 && errno==EINTR ) continue;
+        if( got<=0 ) _exit(1);
+        nLeft -= got;
+        if( rc==0 ) rc = WriteAll(1, zBuf, got);
+      }
+      _exit(0);
+    }
+    pidFeeder = pid;
+    pIn->iRd += nBuf;
+  }
+  close(px[1]);
+  fdPostBody = px[0];
+}
+
+/*
+** Copy the request content from the client into a seekable file, and leave
+** the file, positioned at the start, in fdPostBody for use as standard
+** input of a CGI program.
+**
+** On Linux the file is an anonymous memfd_create() file, filled using
+** splice() so the content does not pass through user space, then sealed
+** against further change.  Elsewhere it is a file in /tmp that is
+** unlinked as soon as it is created, so nothing is left behind even if
+** the server crashes.
+*/
+static void PostSpool(void){
+  char zBuf[16384];
+  int fd = -1;
+  int nBuf = pIn->n - pIn->iRd;
+  int nLeft;
+  int got;
+#if defined(linux) && defined(MFD_CLOEXEC)
+  int bSeal = 0;
+  fd = memfd_create("althttpd-post", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+  if( fd>=0 ) bSeal = 1;
+#endif
+  if( fd<0 ){
+    char zTmpNam[] = "/tmp/-post-data-XXXXXX";
+    fd = mkstemp(zTmpNam);
+    if( fd<0 ){
+      Malfunction(280,  /* LOG: mkstemp() failed */
+               "Cannot create a temp file in which to store POST data");
+    }
+    unlink(zTmpNam);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  if( nBuf>pIn->nBody ) nBuf = pIn->nBody;
+  if( nBuf>0 && WriteAll(fd, &pIn->a[pIn->iRd], nBuf) ){
+    Malfunction(292, /* LOG: cannot write POST content to spool file */
+                "Cannot store POST data");
+  }
+  pIn->iRd += nBuf;
+  nLeft = pIn->nBody - nBuf;
+#if defined(linux) && defined(SPLICE_F_MOVE)
+  {
+    int px[2];
+    if( nLeft>0 && pipe(px)==0 ){
+      while( nLeft>0 ){
+        int want = nLeft<65536 ? nLeft : 65536;
+        got = (int)splice(0, 0, px[1], 0, want, SPLICE_F_MOVE);
+        if( got<0 && errno==EINTR ) continue;
+        if( got<=0 ) break;
+        nLeft -= got;
+        while( got>0 ){
+          int n = (int)splice(px[0], 0, fd, 0, got, SPLICE_F_MOVE);
+          if( n<0 && errno==EINTR ) continue;
+          if( n<=0 ){
+            Malfunction(292, "Cannot store POST data");
+          }
+          got -= n;
+        }
+      }
+      close(px[0]);
+      close(px[1]);
+    }
+  }
+#endif
+  /* Standard input might not be something splice() accepts.  Finish
+  ** with ordinary reads. */
+  while( nLeft>0 ){
+    int want = nLeft<(int)sizeof(zBuf) ? nLeft : (int)sizeof(zBuf);
+    got = (int)read(0, zBuf, want);
+    if( got<0 && errno==EINTR ) continue;
+    if( got<=0 ) break;
+    nLeft -= got;
+    if( WriteAll(fd, zBuf, got) ){
+      Malfunction(292, "Cannot store POST data");
+    }
+  }
+  nIn += pIn->nBody - nLeft;
+  if( nLeft>0 ){
+    /* The client sent less than it promised */
+    closeConnection = 1;
+  }
+  pIn->nBody = 0;
+#if defined(linux) && defined(F_ADD_SEALS)
+  if( bSeal ){
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL);
+  }
+#endif
+  lseek(fd, 0, SEEK_SET);
+  fdPostBody = fd;
+}
+
+/*
+** Wait for the process started by PostFeederStart() to finish.  If it
+** could not read all of the request content, close the connection after
+** this request.
+*/
+static void PostFeederFinish(void){
+  int status = 0;
+  if( fdPostBody>=0 ){
+    close(fdPostBody);
+    fdPostBody = -1;
+  }
+  if( pidFeeder>0 ){
+    if( waitpid(pidFeeder, &status, 0)==pidFeeder
+     && WIFEXITED(status) && WEXITSTATUS(status)==0
+    ){
+      nIn += pIn->nBody;
+      pIn->nBody = 0;
+    }else{
+      closeConnection = 1;
+    }
+    pidFeeder = 0;
+  }
+}
+
+/*
+** An SCGI server closes its connection at the end of every reply, so a
+** connection cannot be used for a second request.  Instead, after each
+** SCGI request a long-lived worker starts a non-blocking connect to the
+** same server, and the next request to that server starts out with the
+** TCP handshake already done.  Nothing waits for the connect to finish.
+** It is only checked, without blocking, when the spare is taken.  No
+** spare is started after a reply that ends the client connection, or
+** outside a worker, since the process would exit before using it.
+**
+** A spare that is still connecting, whose connect failed, or that the
+** server has closed in the meantime (because it was restarted, for
+** example) is discarded when it is taken.  Spares older than
+** SCGI_SPARE_AGE seconds are discarded rather than tying up a server
+** connection indefinitely.
+*/
+#ifndef SCGI_SPARE_AGE
+# define SCGI_SPARE_AGE 30
+#endif
+typedef struct ScgiSpare ScgiSpare;
+struct ScgiSpare {
+  char *zHost;             /* Server host name, from the .scgi spec */
+  char *zPort;             /* Server port, from the .scgi spec */
+  int fd;                  /* The spare connection.  -1 if none */
+  time_t tOpen;            /* When the connection was opened */
+};
+static ScgiSpare *aSpare = 0;    /* Spare connections, nScgiSpare entries */
+
+/*
+** Delay in milliseconds before a connection attempt is started on the
+** next address of a server while earlier attempts are still pending.
+*/
+#ifndef SCGI_CONNECT_STAGGER
+# define SCGI_CONNECT_STAGGER 250
+#endif
+
+/*
+** Milliseconds on a monotonic clock.
+*/
+static long long MonotonicMs(void){
+  return MonotonicUs()/1000;
+}
+
+/*
+** Open a TCP connection to one of the addresses in ai.  Connections
+** are non-blocking.  A new attempt is started on the next address every
+** SCGI_CONNECT_STAGGER milliseconds, or at once when every pending
+** attempt has failed, and the first attempt to complete wins.  Give up
+** after msTimeout milliseconds.
+**
+** Return the connected socket, in blocking mode, or -1 if no connection
+** could be made in time.
+*/
+static int ScgiConnect(struct addrinfo *ai, int msTimeout){
+  struct pollfd aPend[8];      /* Attempts in progress */
+  int nPend = 0;               /* Number of entries in aPend[] */
+  struct addrinfo *p = ai;     /* Next address to try */
+  long long tStart = MonotonicMs();
+  long long tNext = tStart;    /* When to start the next attempt */
+  long long tNow;
+  int fd = -1;                 /* The winning connection */
+  int i, rc, wait;
+
+  while( fd<0 ){
+    tNow = MonotonicMs();
+    if( tNow - tStart >= msTimeout ) break;
+    if( p && nPend<(int)(sizeof(aPend)/sizeof(aPend[0]))
+     && (nPend==0 || tNow>=tNext)
+    ){
+      int x = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+      if( x>=0 ){
+        fcntl(x, F_SETFL, fcntl(x, F_GETFL) | O_NONBLOCK);
+        if( connect(x,p->ai_addr,p->ai_addrlen)==0 ){
+          fd = x;
+        }else if( errno==EINPROGRESS ){
+          aPend[nPend].fd = x;
+          aPend[nPend].events = POLLOUT;
+          aPend[nPend].revents = 0;
+          nPend++;
+        }else{
+          close(x);
+        }
+      }
+      p = p->ai_next;
+      tNext = tNow + SCGI_CONNECT_STAGGER;
+      continue;
+    }
+    if( nPend==0 ) break;
+    wait = (int)(tStart + msTimeout - tNow);
+    if( p && tNext - tNow < wait ) wait = (int)(tNext - tNow);
+    rc = poll(aPend, nPend, wait);
+    if( rc<0 && errno!=EINTR ) break;
+    for(i=0; rc>0 && i<nPend; i++){
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if( aPend[i].revents==0 ) continue;
+      if( fd<0
+       && getsockopt(aPend[i].fd, SOL_SOCKET, SO_ERROR, &err, &len)==0
+       && err==0
+      ){
+        fd = aPend[i].fd;
+      }else{
+        close(aPend[i].fd);
+      }
+      aPend[i--] = aPend[--nPend];
+    }
+  }
+  for(i=0; i<nPend; i++) close(aPend[i].fd);
+  if( fd>=0 ) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  return fd;
+}
+
+/*
+** Remove and return the spare connection to SCGI server zHost:zPort.
+** Return -1 if there is no usable spare.
+*/
+static int ScgiSpareTake(const char *zHost, const char *zPort){
+  int i, fd;
+  struct pollfd x;
+  for(i=0; i<nScgiSpare && aSpare; i++){
+    ScgiSpare *p = &aSpare[i];
+    if( p->fd<0 ) continue;
+    if( strcmp(p->zHost,zHost)!=0 || strcmp(p->zPort,zPort)!=0 ) continue;
+    fd = p->fd;
+    p->fd = -1;
+    if( time(0) - p->tOpen > SCGI_SPARE_AGE ){
+      close(fd);
+      break;
+    }
+    x.fd = fd;
+    x.events = POLLIN|POLLOUT;
+    x.revents = 0;
+    if( poll(&x, 1, 0)!=1 || x.revents!=POLLOUT ){
+      /* The connect is still in progress or failed, or the server has
+      ** since closed or reset the connection */
+      close(fd);
+      STATS_ADD(nScgiReconnect, 1);
+      return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    STATS_ADD(nScgiHit, 1);
+    return fd;
+  }
+  STATS_ADD(nScgiMiss, 1);
+  return -1;
+}
+
+/*
+** Start a spare connection to SCGI server zHost:zPort at the first
+** address in ai that accepts a non-blocking connect.  If every slot is
+** full, the oldest spare is closed to make room.
+*/
+static void ScgiSpareAdd(const char *zHost, const char *zPort,
+                         struct addrinfo *ai){
+  int i, fd = -1;
+  ScgiSpare *p = 0;
+  if( ai==0 ) return;
+  if( aSpare==0 ){
+    aSpare = calloc(nScgiSpare, sizeof(aSpare[0]));
+    if( aSpare==0 ) return;
+    for(i=0; i<nScgiSpare; i++) aSpare[i].fd = -1;
+  }
+  for(i=0; i<nScgiSpare; i++){
+    ScgiSpare *pX = &aSpare[i];
+    if( pX->zHost && strcmp(pX->zHost,zHost)==0
+     && strcmp(pX->zPort,zPort)==0
+    ){
+      p = pX;
+      break;
+    }
+    if( p==0 || pX->zHost==0 || (p->zHost && pX->tOpen<p->tOpen) ) p = pX;
+  }
+  if( p->fd>=0 ){
+    close(p->fd);
+    p->fd = -1;
+  }
+  if( p->zHost==0 || strcmp(p->zHost,zHost)!=0
+   || strcmp(p->zPort,zPort)!=0
+  ){
+    free(p->zHost);
+    free(p->zPort);
+    p->zHost = strdup(zHost);
+    p->zPort = strdup(zPort);
+    if( p->zHost==0 || p->zPort==0 ){
+      free(p->zHost);
+      free(p->zPort);
+      p->zHost = p->zPort = 0;
+      return;
+    }
+  }
+  for(; ai && fd<0; ai=ai->ai_next){
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if( fd<0 ) continue;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if( connect(fd, ai->ai_addr, ai->ai_addrlen) && errno!=EINPROGRESS ){
+      close(fd);
+      fd = -1;
+    }
+  }
+  if( fd<0 ) return;
+  p->fd = fd;
+  p->tOpen = time(0);
+}
+
+/*
+** The parsed content of .scgi spec files is cached, along with the
+** resolved addresses of the SCGI servers, so that an SCGI request in a
+** long-lived process needs no file or resolver I/O.  An entry is used
+** only while the spec file is unchanged, as judged by the stat()
+** information the caller already has, and an address is looked up
+** again once it is more than scgiDnsTtl seconds old.
+**
+** Which servers have recently failed is kept in aScgiHealth[], a table
+** keyed by the hash of host and port.  The supervisor maps the table
+** before it forks, so that a failure seen by one process steers the
+** others away from that server too.  Entries are claimed and updated
+** with atomic operations.  Should the table fill up, a server's health
+** is tracked in its cache entry instead, private to the process.
+*/
+#ifndef SCGI_SPEC_CACHE
+# define SCGI_SPEC_CACHE 16
+#endif
+#ifndef SCGI_MAX_BACKOFF
+# define SCGI_MAX_BACKOFF 64
+#endif
+#ifndef SCGI_HEALTH_SLOTS
+# define SCGI_HEALTH_SLOTS 256
+#endif
+typedef struct ScgiHealth ScgiHealth;
+struct ScgiHealth {
+  unsigned int h;          /* Hash of host and port.  0 for an unused slot */
+  int nFail;               /* Consecutive failures to connect */
+  long long tRetry;        /* Avoid this server until this time */
+};
+static ScgiHealth aScgiLocal[SCGI_HEALTH_SLOTS];  /* Used if not shared */
+static ScgiHealth *aScgiHealth = aScgiLocal;      /* Health of SCGI servers */
+
+typedef struct ScgiBackend ScgiBackend;
+struct ScgiBackend {
+  char *zHost;             /* SCGI server host name */
+  char *zPort;             /* SCGI server port */
+  unsigned int h;          /* Hash of zHost and zPort.  Never 0 */
+  struct addrinfo *ai;     /* Resolved address of zHost:zPort, or NULL */
+  time_t tResolve;         /* When ai was resolved */
+  ScgiHealth *pHealth;     /* Health of this server */
+  ScgiHealth sPrivate;     /* Used when aScgiHealth[] is full */
+};
+typedef struct ScgiSpec ScgiSpec;
+struct ScgiSpec {
+  ScgiSpec *pNext;         /* Next entry, in most recently used order */
+  char *zFile;             /* Name of the spec file */
+  struct stat s;           /* stat() of the spec file when it was parsed */
+  int nBackend;            /* Number of SCGI servers */
+  ScgiBackend *aBackend;   /* The SCGI servers */
+  char *zRelight;          /* "relight:" command, or NULL */
+  char *zFallback;         /* "fallback:" file, or NULL */
+  int msConnect;           /* "connect-timeout:" in milliseconds */
+};
+static ScgiSpec *pSpecList = 0;  /* Cached .scgi specs */
+
+/*
+** Create the shared table of SCGI server health.  Call this before
+** forking.
+*/
+static void ScgiHealthInit(void){
+  void *pShared;
+  pShared = mmap(0, sizeof(aScgiLocal), PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if( pShared!=MAP_FAILED ) aScgiHealth = pShared;
+}
+
+/*
+** Free a cached spec entry.
+*/
+static void ScgiSpecFree(ScgiSpec *p){
+  int i;
+  for(i=0; i<p->nBackend; i++){
+    ScgiBackend *pB = &p->aBackend[i];
+    if( pB->ai ) freeaddrinfo(pB->ai);
+    free(pB->zHost);
+    free(pB->zPort);
+  }
+  free(p->aBackend);
+  free(p->zFile);
+  free(p->zRelight);
+  free(p->zFallback);
+  free(p);
+}
+
+/*
+** Duplicate a string into memory that outlives the current request.
+** NULL in gives NULL out.
+*/
+static char *ScgiStrDup(const char *z){
+  char *zNew;
+  if( z==0 ) return 0;
+  zNew = strdup(z);
+  if( zNew==0 ){
+    Malfunction(708, "out of memory");
+  }
+  return zNew;
+}
+
+/*
+** FNV-1a hash of string z, continuing from hash h.
+*/
+static unsigned int ScgiHash(unsigned int h, const char *z){
+  while( *z ){
+    h ^= (unsigned char)*(z++);
+    h *= 16777619;
+  }
+  return h;
+}
+
+/*
+** Add SCGI server zHost:zPort to spec p.
+*/
+static void ScgiSpecAddBackend(ScgiSpec *p, const char *zHost,
+                               const char *zPort){
+  ScgiBackend *pB;
+  pB = realloc(p->aBackend, (p->nBackend+1)*sizeof(p->aBackend[0]));
+  if( pB==0 ){
+    Malfunction(708, "out of memory");
+  }
+  p->aBackend = pB;
+  pB = &p->aBackend[p->nBackend++];
+  memset(pB, 0, sizeof(*pB));
+  pB->zHost = ScgiStrDup(zHost);
+  pB->zPort = ScgiStrDup(zPort);
+  pB->h = ScgiHash(ScgiHash(2166136261u, zHost), zPort);
+  if( pB->h==0 ) pB->h = 1;
+}
+
+/*
+** Point SCGI server pB at its slot in aScgiHealth[], claiming a free
+** slot if no other process has done so.  Call this only once pB has
+** reached its final address, as pB->pHealth may point into pB itself.
+*/
+static void ScgiBackendHealth(ScgiBackend *pB){
+  unsigned int i, k;
+  for(k=0; k<SCGI_HEALTH_SLOTS; k++){
+    ScgiHealth *pH = &aScgiHealth[(pB->h+k)%SCGI_HEALTH_SLOTS];
+    unsigned int h = __atomic_load_n(&pH->h, __ATOMIC_ACQUIRE);
+    if( h==0 ){
+      i = 0;
+      if( __atomic_compare_exchange_n(&pH->h, &i, pB->h, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ){
+        h = pB->h;
+      }else{
+        h = i;
+      }
+    }
+    if( h==pB->h ){
+      pB->pHealth = pH;
+      return;
+    }
+  }
+  pB->pHealth = &pB->sPrivate;
+}
+
+/*
+** Return the parsed content of the SCGI spec file zFile, whose stat()
+** information is pStat.  The file is read only if no cache entry
+** matches.
+*/
+static ScgiSpec *ScgiSpecFind(const char *zFile, const struct stat *pStat){
+  ScgiSpec *p, **pp;
+  FILE *in;
+  char *z;
+  char *zHost;
+  char *zPort = 0;
+  int n = 0;
+  int i;
+  char zLine[1000];
+  char zExtra[1000];
+
+  for(pp=&pSpecList; (p = *pp)!=0; pp=&p->pNext){
+    if( strcmp(p->zFile,zFile)==0 ){
+      *pp = p->pNext;
+      if( SameFile(pStat, &p->s) ){
+        p->pNext = pSpecList;
+        pSpecList = p;
+        return p;
+      }
+      ScgiSpecFree(p);
+      break;
+    }
+  }
+  in = fopen(zFile, "rb");
+  if( in==0 ){
+    Malfunction(700, "cannot open \"%s\"\n", zFile);
+  }
+  if( fgets(zLine, sizeof(zLine)-1, in)==0 ){
+    Malfunction(701, "cannot read \"%s\"\n", zFile);
+  }
+  if( strncmp(zLine,"SCGI ",5)!=0 ){
+    Malfunction(702, "misformatted SCGI spec \"%s\"\n", zFile);
+  }
+  z = zLine+5;
+  zHost = GetFirstElement(z,&z);
+  zPort = GetFirstElement(z,0);
+  if( zHost==0 || zHost[0]==0 || zPort==0 || zPort[0]==0 ){
+    Malfunction(703, "misformatted SCGI spec \"%s\"\n", zFile);
+  }
+  p = calloc(1, sizeof(*p));
+  if( p==0 ){
+    Malfunction(708, "out of memory");
+  }
+  ScgiSpecAddBackend(p, zHost, zPort);
+  p->msConnect = 2000;
+  while( fgets(zExtra, sizeof(zExtra)-1, in) ){
+    char *zCmd = GetFirstElement(zExtra,&z);
+    if( zCmd==0 ) continue;
+    if( zCmd[0]=='#' ) continue;
+    if( strcmp(zCmd, "SCGI")==0 ){
+      zHost = GetFirstElement(z,&z);
+      zPort = GetFirstElement(z,0);
+      if( zHost==0 || zHost[0]==0 || zPort==0 || zPort[0]==0 ){
+        Malfunction(703, "misformatted SCGI spec \"%s\"\n", zFile);
+      }
+      ScgiSpecAddBackend(p, zHost, zPort);
+      continue;
+    }
+    RemoveNewline(z);
+    if( strcmp(zCmd, "relight:")==0 ){
+      free(p->zRelight);
+      p->zRelight = ScgiStrDup(z);
+      continue;
+    }
+    if( strcmp(zCmd, "fallback:")==0 ){
+      free(p->zFallback);
+      p->zFallback = ScgiStrDup(z);
+      continue;
+    }
+    if( strcmp(zCmd, "connect-timeout:")==0 ){
+      p->msConnect = atoi(z);
+      if( p->msConnect<1 ) p->msConnect = 1;
+      continue;
+    }
+    Malfunction(704, "unrecognized line in SCGI spec: \"%s %s\"\n",
+                zCmd, z ? z : "");
+  }
+  fclose(in);
+  for(i=0; i<p->nBackend; i++) ScgiBackendHealth(&p->aBackend[i]);
+
+  p->zFile = ScgiStrDup(zFile);
+  p->s = *pStat;
+  p->pNext = pSpecList;
+  pSpecList = p;
+  for(pp=&pSpecList; *pp; pp=&(*pp)->pNext){
+    if( ++n>SCGI_SPEC_CACHE ){
+      ScgiSpecFree(*pp);
+      *pp = 0;
+      break;
+    }
+  }
+  return p;
+}
+
+/*
+** Make sure the address of SCGI server pB is resolved and no older than
+** scgiDnsTtl seconds.  If a fresh lookup fails but an older address is
+** on hand, keep using the older address.  Return 0 on success.  On
+** failure, return the getaddrinfo() error code.
+*/
+static int ScgiBackendResolve(ScgiBackend *pB, time_t now){
+  struct addrinfo hints;
+  struct addrinfo *ai = 0;
+  int rc;
+  if( pB->ai && now - pB->tResolve < scgiDnsTtl ) return 0;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  rc = getaddrinfo(pB->zHost,pB->zPort,&hints,&ai);
+  if( rc ) return pB->ai ? 0 : rc;
+  if( pB->ai ) freeaddrinfo(pB->ai);
+  pB->ai = ai;
+  pB->tResolve = now;
+  return 0;
+}
+
+/*
+** Record the outcome of an attempt to contact SCGI server pB.
+*/
+static void ScgiBackendResult(ScgiBackend *pB, int bOk, time_t now){
+  ScgiHealth *pH = pB->pHealth;
+  int nFail;
+  int nDelay;
+  if( bOk ){
+    if( __atomic_load_n(&pH->nFail, __ATOMIC_RELAXED) ){
+      __atomic_store_n(&pH->nFail, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&pH->tRetry, 0, __ATOMIC_RELAXED);
+    }
+    return;
+  }
+  nFail = __atomic_fetch_add(&pH->nFail, 1, __ATOMIC_RELAXED);
+  nDelay = nFail<7 ? 1<<nFail : SCGI_MAX_BACKOFF;
+  if( nDelay>SCGI_MAX_BACKOFF ) nDelay = SCGI_MAX_BACKOFF;
+  __atomic_store_n(&pH->tRetry, (long long)now + nDelay, __ATOMIC_RELAXED);
+}
+
+/*
+** Fill aOrder[] with the indexes of the SCGI servers in spec p, in the
+** order in which they should be tried for a request for zKey.  Servers
+** are ranked by rendezvous hashing, so that adding or removing one
+** server only moves the requests that map to that server.  Servers that
+** are currently being avoided go after all the others.
+*/
+static void ScgiBackendOrder(ScgiSpec *p, const char *zKey,
+                             int *aOrder, time_t now){
+  unsigned int hKey = ScgiHash(2166136261u, zKey);
+  unsigned int aScore[64];
+  int i, j, n = p->nBackend;
+  for(i=0; i<n; i++){
+    unsigned int x = hKey ^ p->aBackend[i].h;
+    x ^= x>>16;  x *= 0x7feb352d;
+    x ^= x>>15;  x *= 0x846ca68b;
+    x ^= x>>16;
+    if( __atomic_load_n(&p->aBackend[i].pHealth->tRetry,
+                        __ATOMIC_RELAXED)>now ){
+      x >>= 1;                   /* Avoided servers rank below the rest */
+    }else{
+      x = (x>>1) | 0x80000000;
+    }
+    aOrder[i] = i;
+    aScore[i] = x;
+  }
+  for(i=1; i<n; i++){
+    for(j=i; j>0 && aScore[aOrder[j]]>aScore[aOrder[j-1]]; j--){
+      int t = aOrder[j];
+      aOrder[j] = aOrder[j-1];
+      aOrder[j-1] = t;
+    }
+  }
+}
+
+/*
+** Relay the current request to one of the SCGI servers named in spec
+** file zFile, whose stat() information is pStat, and relay the reply to
+** the client.
+*/
+static void SendScgiRequest(
+  const char *zFile,           /* The .scgi spec file */
+  const struct stat *pStat,    /* stat() of zFile */
+  const char *zScript          /* Script name, for error messages */
+){
+  FILE *s = 0;
+  ScgiSpec *pSpec;
+  ScgiBackend *pB = 0;
+  char *zRelight;
+  char *zFallback;
+  int rc;
+  int iSocket = -1;
+  time_t now;
+  int aOrder[64];
+  char *zHdr;
+  size_t nHdr = 0;
+  size_t nHdrAlloc;
+  int i;
+  pSpec = ScgiSpecFind(zFile, pStat);
+  if( pSpec->nBackend>(int)(sizeof(aOrder)/sizeof(aOrder[0])) ){
+    Malfunction(709, "too many SCGI servers in \"%s\"\n", zFile);
+  }
+  zRelight = pSpec->zRelight;
+  zFallback = pSpec->zFallback;
+  while(1){  /* Exit via break */
+    now = time(0);
+    ScgiBackendOrder(pSpec, zPathInfo ? zPathInfo : "", aOrder, now);
+    for(i=0; i<pSpec->nBackend; i++){
+      pB = &pSpec->aBackend[aOrder[i]];
+      if( nScgiSpare>0 ) iSocket = ScgiSpareTake(pB->zHost, pB->zPort);
+      if( iSocket<0 && ScgiBackendResolve(pB, now)==0 ){
+        iSocket = ScgiConnect(pB->ai, pSpec->msConnect);
+      }
+      if( iSocket>=0 && (s = fdopen(iSocket,"r+"))!=0 ){
+        PROBE3(scgi__connect, pB->zHost, pB->zPort, iSocket);
+        ScgiBackendResult(pB, 1, now);
+        break;
+      }
+      if( iSocket>=0 ) close(iSocket);
+      iSocket = -1;
+      ScgiBackendResult(pB, 0, now);
+    }
+    if( s==0 ){
+      if( zRelight ){
+        rc = system(zRelight);
+        if( rc ){
+          Malfunction(721,"Relight failed with %d: \"%s\"\n",
+                      rc, zRelight);
+        }
+        zRelight = 0;
+        sleep(1);
+        for(i=0; i<pSpec->nBackend; i++){
+          __atomic_store_n(&pSpec->aBackend[i].pHealth->tRetry, 0,
+                           __ATOMIC_RELAXED);
+        }
+        continue;
+      }
+      if( zFallback ){
+        struct stat statbuf;
+        int rc;
+        memset(&statbuf, 0, sizeof(statbuf));
+        if( chdir(zDir) ){
+          char zBuf[1000];
+          Malfunction(720, /* LOG: chdir() failed */
+               "cannot chdir to [%s] from [%s]", 
+               zDir, getcwd(zBuf,999));
+        }
+        rc = stat(zFallback, &statbuf);
+        if( rc==0 && S_ISREG(statbuf.st_mode) && access(zFallback,R_OK)==0 ){
+          closeConnection = 1;
+          rc = SendFile(zFallback, (int)strlen(zFallback), &statbuf);
+          althttpd_exit(0);
+        }else{
+          Malfunction(706, "bad fallback file: \"%s\"\n", zFallback);
+        }
+      }
+      Malfunction(707, "cannot open socket to SCGI server %s\n",
+                  zScript);
+    }
+    break;
+  }
+  PhaseMark(STATS_PHASE_START);
+
+  nHdrAlloc = 0;
+  zHdr = 0;
+  if( zContentLength==0 ) zContentLength = "0";
+  zScgi = "1";
+  for(i=0; i<(int)(sizeof(cgienv)/sizeof(cgienv[0])); i++){
+    int n1, n2;
+    if( cgienv[i].pzEnvValue[0]==0 ) continue;
+    n1 = (int)strlen(cgienv[i].zEnvName);
+    n2 = (int)strlen(*cgienv[i].pzEnvValue);
+    if( n1+n2+2+nHdr >= nHdrAlloc ){
+      nHdrAlloc = nHdr + n1 + n2 + 1000;
+      zHdr = realloc(zHdr, nHdrAlloc);
+      if( zHdr==0 ){
+        Malfunction(708, "out of memory");
+      }
+    }
+    memcpy(zHdr+nHdr, cgienv[i].zEnvName, n1);
+    nHdr += n1;
+    zHdr[nHdr++] = 0;
+    memcpy(zHdr+nHdr, *cgienv[i].pzEnvValue, n2);
+    nHdr += n2;
+    zHdr[nHdr++] = 0;
+  }
+  zScgi = 0;
+  fprintf(s,"%d:",(int)nHdr);
+  fwrite(zHdr, 1, nHdr, s);
+  fprintf(s,",");
+  free(zHdr);
+  if( zMethod[0]=='P' ) PostCopy(s);
+  fflush(s);
+  CgiHandleReply(s);
+  PROBE2(scgi__reply, nIn, nOut);
+  if( nScgiSpare>0 && inWorker && !closeConnection ){
+    ScgiSpareAdd(pB->zHost, pB->zPort, pB->ai);
+  }
+}
+
+/*
+** Request header fields that ProcessOneRequest() acts upon.  All other
+** fields are ignored.
+*/
+#define HDR_UNKNOWN              0
+#define HDR_USER_AGENT           1
+#define HDR_ACCEPT               2
+#define HDR_ACCEPT_ENCODING      3
+#define HDR_CONTENT_LENGTH       4
+#define HDR_CONTENT_TYPE         5
+#define HDR_REFERER              6
+#define HDR_COOKIE               7
+#define HDR_CONNECTION           8
+#define HDR_HOST                 9
+#define HDR_AUTHORIZATION       10
+#define HDR_IF_NONE_MATCH       11
+#define HDR_IF_MODIFIED_SINCE   12
+#define HDR_RANGE               13
+
+/*
+** Among the header field names above, the length of the name together
+** with its first character (folded to lower case) is unique.  Combine
+** the two into a single integer key for a switch.
+*/
+#define HDR_KEY(N,C)  (((N)<<8) | (C))
+
+/*
+** Return the HDR_* code for the nName-byte header field name zName,
+** or HDR_UNKNOWN if it is not a field we care about.  At most one
+** candidate name survives the switch, so each field costs at most a
+** single strncasecmp().
+*/
+static int HttpFieldCode(const char *zName, int nName){
+  const char *zKnown;
+  int eCode;
+  if( nName<4 || nName>17 ) return HDR_UNKNOWN;
+  switch( HDR_KEY(nName, zName[0]|0x20) ){
+    case HDR_KEY(4,'h'):
+      zKnown = "Host";              eCode = HDR_HOST;              break;
+    case HDR_KEY(5,'r'):
+      zKnown = "Range";             eCode = HDR_RANGE;             break;
+    case HDR_KEY(6,'a'):
+      zKnown = "Accept";            eCode = HDR_ACCEPT;            break;
+    case HDR_KEY(6,'c'):
+      zKnown = "Cookie";            eCode = HDR_COOKIE;            break;
+    case HDR_KEY(7,'r'):
+      zKnown = "Referer";           eCode = HDR_REFERER;           break;
+    case HDR_KEY(10,'u'):
+      zKnown = "User-Agent";        eCode = HDR_USER_AGENT;        break;
+    case HDR_KEY(10,'c'):
+      zKnown = "Connection";        eCode = HDR_CONNECTION;        break;
+    case HDR_KEY(12,'c'):
+      zKnown = "Content-type";      eCode = HDR_CONTENT_TYPE;      break;
+    case HDR_KEY(13,'a'):
+      zKnown = "Authorization";     eCode = HDR_AUTHORIZATION;     break;
+    case HDR_KEY(13,'i'):
+      zKnown = "If-None-Match";     eCode = HDR_IF_NONE_MATCH;     break;
+    case HDR_KEY(14,'c'):
+      zKnown = "Content-length";    eCode = HDR_CONTENT_LENGTH;    break;
+    case HDR_KEY(15,'a'):
+      zKnown = "Accept-Encoding";   eCode = HDR_ACCEPT_ENCODING;   break;
+    case HDR_KEY(17,'i'):
+      zKnown = "If-Modified-Since"; eCode = HDR_IF_MODIFIED_SINCE; break;
+    default:
+      return HDR_UNKNOWN;
+  }
+  if( strncasecmp(zName+1, zKnown+1, nName-1)!=0 ) return HDR_UNKNOWN;
+  return eCode;
+}
+
+/*
+** Prepare the current process to become a CGI script:  Set up the
+** environment variables and, for the POST method, redirect standard
+** input to come from the temporary file that holds the POST data.
+*/
+static void CgiSetup(void){
+  int i;
+  putenv("GATEWAY_INTERFACE=CGI/1.0");
+  for(i=0; i<(int)(sizeof(cgienv)/sizeof(cgienv[0])); i++){
+    if( *cgienv[i].pzEnvValue ){
+      SetEnv(cgienv[i].zEnvName,*cgienv[i].pzEnvValue);
+    }
+  }
+  if( useHttps ){
+    putenv("HTTPS=on");
+    putenv("REQUEST_SCHEME=https");
+  }else{
+    putenv("REQUEST_SCHEME=http");
+  }
+
+  /* For the POST method, the request content arrives on a pipe from
+  ** PostFeederStart(), which becomes the standard input of the script.
+  */
+  if( fdPostBody>=0 ){
+    if( dup2(fdPostBody, 0)<0 ){
+      Malfunction(430,  /* LOG: dup(0) failed */
+                  "Unable to duplicate file descriptor %d to 0",
+                  fdPostBody);
+    }
+    close(fdPostBody);
+    fdPostBody = -1;
+  }
+
+#ifdef RLIMIT_CPU
+  /* A script forked from a long-lived worker would otherwise inherit the
+  ** worker's raised limits.  Give it maxCpu seconds that it cannot raise.
+  */
+  if( maxCpu>0 ){
+    struct rlimit rlim;
+    rlim.rlim_cur = maxCpu;
+    rlim.rlim_max = maxCpu;
+    setrlimit(RLIMIT_CPU, &rlim);
+  }
+#endif
+}
+
+/*
+** Text of the /-server-status page as it is being built.
+*/
+static char *zStatusOut = 0;     /* The text */
+static int nStatusOut = 0;       /* Bytes of text */
+static int nStatusAlloc = 0;     /* Bytes allocated for zStatusOut */
+
+/*
+** Append formatted text to the status page.
+*/
+static void StatusPrintf(const char *zFormat, ...){
+  va_list ap;
+  int n;
+  va_start(ap, zFormat);
+  n = vsnprintf(0, 0, zFormat, ap);
+  va_end(ap);
+  if( n<0 ) return;
+  if( nStatusOut+n+1>nStatusAlloc ){
+    char *zNew;
+    int nNew = nStatusAlloc*2 + n + 1000;
+    zNew = realloc(zStatusOut, nNew);
+    if( zNew==0 ) return;
+    zStatusOut = zNew;
+    nStatusAlloc = nNew;
+  }
+  va_start(ap, zFormat);
+  vsnprintf(&zStatusOut[nStatusOut], n+1, zFormat, ap);
+  va_end(ap);
+  nStatusOut += n;
+}
+
+/*
+** Add the metadata of a Prometheus metric to the status page.
+*/
+static void StatusPromHeader(
+  const char *zName,        /* Name of the metric */
+  const char *zType,        /* "counter", "gauge" or "histogram" */
+  const char *zHelp         /* Description */
+){
+  StatusPrintf("# HELP althttpd_%s %s\n# TYPE althttpd_%s %s\n",
+               zName, zHelp, zName, zType);
+}
+
+/*
+** Reply with the /-server-status page, in the Prometheus exposition
+** format if isProm is true and as plain text otherwise.
+*/
+static void ServerStatusPage(int isProm){
+  static const char *azClass[] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+  long long nUptime = time(0) - pStats->tStart;
+  int nOpen = 0, nBusy = 0;
+  int i, j;
+
+  if( pStats->nWorker>0 ){
+    for(i=0; i<pStats->nWorker; i++){
+      nOpen += pStats->anConn[i];
+      if( aBusy && aBusy[i] ) nBusy++;
+    }
+  }else{
+    nOpen = pStats->nChild;
+  }
+  nStatusOut = 0;
+  if( isProm ){
+    StatusPromHeader("uptime_seconds", "gauge",
+                     "Seconds since the server started.");
+    StatusPrintf("althttpd_uptime_seconds %lld\n", nUptime);
+    StatusPromHeader("connections_accepted_total", "counter",
+                     "TCP connections accepted.");
+    StatusPrintf("althttpd_connections_accepted_total %llu\n",
+                 pStats->nConn);
+    StatusPromHeader("connections_open", "gauge",
+                     "TCP connections now open.");
+    StatusPrintf("althttpd_connections_open %d\n", nOpen);
+    StatusPromHeader("workers", "gauge", "Configured worker processes.");
+    StatusPrintf("althttpd_workers %d\n", pStats->nWorker);
+    StatusPromHeader("workers_busy", "gauge",
+                     "Worker processes now serving a request.");
+    StatusPrintf("althttpd_workers_busy %d\n", nBusy);
+    StatusPromHeader("requests_total", "counter",
+                     "Requests completed, by reply status class.");
+    for(i=1; i<=6; i++){
+      StatusPrintf("althttpd_requests_total{class=\"%s\"} %llu\n",
+                   azClass[i%6], pStats->aClass[i%6]);
+    }
+    StatusPromHeader("received_bytes_total", "counter",
+                     "Bytes received from clients.");
+    StatusPrintf("althttpd_received_bytes_total %llu\n", pStats->nIn);
+    StatusPromHeader("sent_bytes_total", "counter",
+                     "Bytes sent to clients.");
+    StatusPrintf("althttpd_sent_bytes_total %llu\n", pStats->nOut);
+    StatusPromHeader("scgi_spare_total", "counter",
+                     "SCGI requests by use of a spare connection.");
+    StatusPrintf("althttpd_scgi_spare_total{result=\"hit\"} %llu\n"
+                 "althttpd_scgi_spare_total{result=\"miss\"} %llu\n"
+                 "althttpd_scgi_spare_total{result=\"reconnect\"} %llu\n",
+                 pStats->nScgiHit, pStats->nScgiMiss,
+                 pStats->nScgiReconnect);
+    StatusPromHeader("request_duration_seconds", "histogram",
+                     "Time spent in each phase of a request.");
+  }else{
+    StatusPrintf("uptime-seconds %lld\n", nUptime);
+    StatusPrintf("connections-accepted %llu\n", pStats->nConn);
+    StatusPrintf("connections-open %d\n", nOpen);
+    StatusPrintf("workers %d\n", pStats->nWorker);
+    StatusPrintf("workers-busy %d\n", nBusy);
+    StatusPrintf("requests %llu\n", pStats->nRequest);
+    for(i=1; i<=6; i++){
+      StatusPrintf("requests-%s %llu\n", azClass[i%6], pStats->aClass[i%6]);
+    }
+    StatusPrintf("bytes-in %llu\n", pStats->nIn);
+    StatusPrintf("bytes-out %llu\n", pStats->nOut);
+    StatusPrintf("scgi-spare-hit %llu\n", pStats->nScgiHit);
+    StatusPrintf("scgi-spare-miss %llu\n", pStats->nScgiMiss);
+    StatusPrintf("scgi-spare-reconnect %llu\n", pStats->nScgiReconnect);
+  }
+  for(i=0; i<STATS_NPHASE; i++){
+    StatsHist *pH = &pStats->aHist[i];
+    unsigned long long nCum = 0;
+    for(j=0; j<=STATS_NBUCKET; j++){
+      nCum += pH->aCount[j];
+      if( isProm ){
+        if( j<STATS_NBUCKET ){
+          StatusPrintf("althttpd_request_duration_seconds_bucket"
+                       "{phase=\"%s\",le=\"%g\"} %llu\n",
+                       azStatsPhase[i], aStatsBound[j]/1e6, nCum);
+        }else{
+          StatusPrintf("althttpd_request_duration_seconds_bucket"
+                       "{phase=\"%s\",le=\"+Inf\"} %llu\n",
+                       azStatsPhase[i], nCum);
+        }
+      }else if( j<STATS_NBUCKET ){
+        StatusPrintf("latency-%s-le-%dus %llu\n",
+                     azStatsPhase[i], aStatsBound[j], nCum);
+      }
+    }
+    if( isProm ){
+      StatusPrintf("althttpd_request_duration_seconds_sum{phase=\"%s\"} %g\n"
+                   "althttpd_request_duration_seconds_count{phase=\"%s\"}"
+                   " %llu\n",
+                   azStatsPhase[i], pH->nSum/1e6, azStatsPhase[i], nCum);
+    }else{
+      StatusPrintf("latency-%s-count %llu\n", azStatsPhase[i], nCum);
+      StatusPrintf("latency-%s-sum-us %llu\n", azStatsPhase[i], pH->nSum);
+    }
+  }
+
+  StartResponse("200 OK");
+  nOut += printf(
+    "Content-type: text/plain; %scharset=utf-8\r\n"
+    "Cache-Control: no-cache, no-store\r\n"
+    "Content-length: %d\r\n"
+    "\r\n",
+    isProm ? "version=0.0.4; " : "", nStatusOut);
+  if( strcmp(zMethod,"HEAD")!=0 && nStatusOut>0 ){
+    nOut += fwrite(zStatusOut, 1, nStatusOut, stdout);
+  }
+  fflush(stdout);
+  PhaseMark(STATS_PHASE_SEND);
+  MakeLogEntry(0, 6);  /* LOG: Server status page */
+  omitLog = 1;
+  if( useTimeout ) alarm(keepAliveTimeout);
+}
+
+#ifdef __linux__
+/*
+** On Linux, a long-lived worker parks idle keep-alive connections in an
+** epoll set, together with its listening sockets, rather than blocking
+** in fgets() waiting for the next request.  An idle connection then
+** costs one of these objects and a file descriptor instead of a whole
+** process.  Input is collected into an HttpInput buffer as it arrives,
+** and the connection is handed to ProcessOneRequest() only once the
+** complete header of its next request is in hand.  The buffer is released
+** whenever the connection goes idle with no unread input.
+**
+** Parking again after a partial header does not restart the clock.  The
+** whole wait for a request header, idle time included, is limited to 15
+** seconds for the first request on a connection and keepAliveTimeout
+** seconds for later ones, the same as a blocking read under alarm().
+**
+** A worker serves one request at a time, and its parked connections wait
+** while it does.  So before a request that may take a long time, a CGI or
+** SCGI request, the worker passes its parked connections that hold no
+** unread input to the other workers.  They go through a queue shared by
+** all workers, an AF_UNIX datagram socket pair that carries each socket
+** with SCM_RIGHTS, and the first idle worker to read the queue parks them
+** in its own epoll set.  Static content is served without handing off.
+*/
+typedef struct WorkerConn WorkerConn;
+struct WorkerConn {
+  int fd;                    /* The socket */
+  int isListener;            /* True for a listening socket */
+  int isQueue;               /* True for the hand-off queue */
+  int nRequest;              /* Requests already processed on fd */
+  time_t tBegin;             /* When this connection was accepted */
+  time_t tIdle;              /* When this connection was last parked */
+  time_t tWait;              /* When the wait for the next header began */
+  HttpInput *pIn;            /* Input not yet processed, or NULL */
+  WorkerConn *pNext;         /* Next newer parked connection */
+  WorkerConn *pPrev;         /* Next older parked connection */
+  char zAddr[64];            /* Remote IP address */
+};
+static int epollFd = -1;               /* The epoll set of a worker */
+static int nWorkerConn = 0;            /* Connections held by the worker */
+static WorkerConn *pIdleFirst = 0;     /* Oldest parked connection */
+static WorkerConn *pIdleLast = 0;      /* Newest parked connection */
+static int fdHandoff[2] = { -1, -1 };  /* Hand-off queue: send, receive */
+static WorkerConn *pReleased = 0;      /* Handed off, not yet freed */
+
+/*
+** A connection passed between workers.  The socket itself travels as
+** SCM_RIGHTS ancillary data.
+*/
+typedef struct WorkerHandoff WorkerHandoff;
+struct WorkerHandoff {
+  int nRequest;              /* Requests already processed */
+  time_t tBegin;             /* When the connection was accepted */
+  time_t tIdle;              /* When the connection was last parked */
+  time_t tWait;              /* When the wait for the next header began */
+  char zAddr[64];            /* Remote IP address */
+};
+
+/*
+** Close a connection held by a worker and free its resources.
+*/
+static void WorkerClose(WorkerConn *pConn){
+  if( !pConn->isListener ) StatsWorkerConn(--nWorkerConn);
+  close(pConn->fd);
+  free(pConn->pIn);
+  free(pConn);
+}
+
+/*
+** Add pConn to the epoll set and to the end of the parked list.
+*/
+static void WorkerPark(WorkerConn *pConn){
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.ptr = pConn;
+  if( epoll_ctl(epollFd, EPOLL_CTL_ADD, pConn->fd, &ev) ){
+    WorkerClose(pConn);
+    return;
+  }
+  time(&pConn->tIdle);
+  pConn->pNext = 0;
+  pConn->pPrev = pIdleLast;
+  if( pIdleLast ){
+    pIdleLast->pNext = pConn;
+  }else{
+    pIdleFirst = pConn;
+  }
+  pIdleLast = pConn;
+}
+
+/*
+** Remove pConn from the epoll set and from the parked list.
+*/
+static void WorkerUnpark(WorkerConn *pConn){
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, pConn->fd, 0);
+  if( pConn->pPrev ){
+    pConn->pPrev->pNext = pConn->pNext;
+  }else{
+    pIdleFirst = pConn->pNext;
+  }
+  if( pConn->pNext ){
+    pConn->pNext->pPrev = pConn->pPrev;
+  }else{
+    pIdleLast = pConn->pPrev;
+  }
+  pConn->pNext = pConn->pPrev = 0;
+}
+
+/*
+** Send parked connection pConn to the hand-off queue.  Return 0 on
+** success or -1 if the queue is full or unusable.
+*/
+static int WorkerSend(WorkerConn *pConn){
+  WorkerHandoff h;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *pCmsg;
+  union {
+    struct cmsghdr hdr;
+    char a[CMSG_SPACE(sizeof(int))];
+  } u;
+  memset(&h, 0, sizeof(h));
+  h.nRequest = pConn->nRequest;
+  h.tBegin = pConn->tBegin;
+  h.tIdle = pConn->tIdle;
+  h.tWait = pConn->tWait;
+  memcpy(h.zAddr, pConn->zAddr, sizeof(h.zAddr));
+  memset(&msg, 0, sizeof(msg));
+  memset(&u, 0, sizeof(u));
+  iov.iov_base = &h;
+  iov.iov_len = sizeof(h);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = u.a;
+  msg.msg_controllen = sizeof(u.a);
+  pCmsg = CMSG_FIRSTHDR(&msg);
+  pCmsg->cmsg_level = SOL_SOCKET;
+  pCmsg->cmsg_type = SCM_RIGHTS;
+  pCmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(pCmsg), &pConn->fd, sizeof(int));
+  if( sendmsg(fdHandoff[0], &msg, MSG_DONTWAIT|MSG_NOSIGNAL)!=sizeof(h) ){
+    return -1;
+  }
+  return 0;
+}
+
+/*
+** Pass the parked connections of this worker that hold no unread input
+** to the other workers, provided that at least one of them is idle.
+** Their objects may still appear in the batch of events that WorkerLoop()
+** is working through, so they are marked with fd<0 and freed only once
+** that batch is done.
+*/
+static void WorkerRelease(void){
+  WorkerConn *pConn, *pNext;
+  int i;
+  if( fdHandoff[0]<0 || aBusy==0 || pIdleFirst==0 ) return;
+  for(i=0; i<nWorker && (i==iWorker || aBusy[i]); i++){}
+  if( i>=nWorker ) return;
+  for(pConn=pIdleFirst; pConn; pConn=pNext){
+    pNext = pConn->pNext;
+    if( pConn->pIn ) continue;
+    if( WorkerSend(pConn) ) break;
+    WorkerUnpark(pConn);
+    StatsWorkerConn(--nWorkerConn);
+    close(pConn->fd);
+    pConn->fd = -1;
+    pConn->pNext = pReleased;
+    pReleased = pConn;
+  }
+}
+#endif /* __linux__ */
+
+/*
+** This routine processes a single HTTP request on standard input and
+** sends the reply to standard output.  If the argument is 1 it means
+** that we are should close the socket without processing additional
+** HTTP requests after the current request finishes.  0 means we are
+** allowed to keep the connection open and to process additional requests.
+** This routine may choose to close the connection even if the argument
+** is 0.
+** 
+** If the connection should be closed, this routine calls althttpd_exit()
+** and thus never returns.  If this routine does return it means that another
+** HTTP request may appear on the wire.
+*/
+void ProcessOneRequest(int forceClose){
+  int i, j, j0, rc;
+  char *z;                  /* Used to parse up a string */
+  struct stat statbuf;      /* Information about the file to be retrieved */
+  FILE *in;                 /* For reading from CGI scripts */
+#ifdef LOG_HEADER
+  FILE *hdrLog = 0;         /* Log file for complete header content */
+#endif
+  char zLine[1000];         /* A buffer for input lines or forming names */
+  char *zCacheKey = 0;      /* Key for this request in the file cache */
+  char *zSite = 0;          /* The *.website directory named by Host: */
+  FileCacheEntry *pEntry;   /* Entry in the file cache */
+  int mAccept = 0;          /* Encodings the client accepts */
+
+  /* Change directories to the root of the HTTP filesystem
+  */
+  if( chdir(zRoot[0] ? zRoot : "/")!=0 ){
+    char zBuf[1000];
+    Malfunction(190,   /* LOG: chdir() failed */
+         "cannot chdir to [%s] from [%s]",
+         zRoot, getcwd(zBuf,999));
+  }
+  nRequest++;
+  ArenaReset();
+
+  /*
+  ** We must receive a complete header within 15 seconds, or within
+  ** keepAliveTimeout seconds if this is not the first request on the
+  ** connection
+  */
+  signal(SIGALRM, Timeout);
+  signal(SIGSEGV, Timeout);
+  signal(SIGPIPE, Timeout);
+  signal(SIGXCPU, Timeout);
+  if( useTimeout ) alarm(nRequest>1 ? keepAliveTimeout : 15);
+
+  /* Read the complete request header.  A worker might already have
+  ** collected all of it before calling this routine.
+  */
+  zMethod = zScript = zRealScript = zProtocol = 0;
+  PROBE1(request__start, nRequest);
+  if( pIn->nBody>0 && HttpInputSkip(pIn, 0, 0)<0 ) althttpd_exit(0);
+  if( !pIn->inHeader ) HttpInputBegin(pIn);
+  while( (rc = HttpInputParse(pIn))==0 ){
+    LogFlush();
+    if( HttpInputFill(pIn, 0, 0)<=0 ) althttpd_exit(0);
+  }
+  pIn->inHeader = 0;
+  gettimeofday(&beginTime, 0);
+  PhaseBegin();
+  omitLog = 0;
+  if( rc<0 ){
+    nIn += pIn->n;
+    zProtocol = "HTTP/1.0";
+    closeConnection = 1;
+    StartResponse("431 Request Header Fields Too Large");
+    nOut += printf(
+      "Content-type: text/plain; charset=utf-8\r\n"
+      "\r\n"
+      "The request header is too large\n"
+    );
+    MakeLogEntry(0, 195); /* LOG: Request header too large */
+    althttpd_exit(0);
+  }
+  nIn += pIn->nHead;
+
+  /* Parse the first line of the HTTP request.  The method, script and
+  ** protocol are left in place in the input buffer.
+  */
+  z = &pIn->a[pIn->iReq];
+  z[pIn->nReq] = 0;
+  zMethod = GetFirstElement(z,&z);
+  zRealScript = zScript = GetFirstElement(z,&z);
+  zProtocol = GetFirstElement(z,&z);
+  if( zProtocol==0 || strncmp(zProtocol,"HTTP/",5)!=0 || strlen(zProtocol)!=8 ){
+    StartResponse("400 Bad Request");
+    nOut += printf(
+      "Content-type: text/plain; charset=utf-8\r\n"
+      "\r\n"
+      "This server does not understand the requested protocol\n"
+    );
+    MakeLogEntry(0, 200); /* LOG: bad protocol in HTTP header */
+    althttpd_exit(0);
+  }
+  if( zScript[0]!='/' ) NotFound(210); /* LOG: Empty request URI */
+  while( zScript[1]=='/' ){
+    zScript++;
+    zRealScript++;
+  }
+  if( forceClose ){
+    closeConnection = 1;
+  }else if( zProtocol[5]<'1' || zProtocol[7]<'1' ){
+    closeConnection = 1;
+  }
+
+  /* This very simple server only understands the GET, POST
+  ** and HEAD methods
+  */
+  if( strcmp(zMethod,"GET")!=0 && strcmp(zMethod,"POST")!=0
+       && strcmp(zMethod,"HEAD")!=0 ){
+    StartResponse("501 Not Implemented");
+    nOut += printf(
+      "Content-type: text/plain; charset=utf-8\r\n"
+      "\r\n"
+      "The %s method is not implemented on this server.\n",
+      zMethod);
+    MakeLogEntry(0, 220); /* LOG: Unknown request method */
+    althttpd_exit(0);
+  }
+
+  /* If there is a log file (if zLogFile!=0) and if the pathname in
+  ** the first line of the http request contains the magic string
+  ** "FullHeaderLog" then write the complete header text into the
+  ** file %s(zLogFile)-hdr.  Overwrite the file.  This is for protocol
+  ** debugging only and is only enabled if althttpd is compiled with
+  ** the -DLOG_HEADER=1 option.
+  */
+#ifdef LOG_HEADER
+  if( zLogFile
+   && strstr(zScript,"FullHeaderLog")!=0
+   && strlen(zLogFile)<sizeof(zLine)-50
+  ){
+    sprintf(zLine, "%s-hdr", zLogFile);
+    hdrLog = fopen(zLine, "wb");
+    if( hdrLog ){
+      fwrite(&pIn->a[pIn->iHdr], 1, pIn->nHead - pIn->iHdr, hdrLog);
+      fclose(hdrLog);
+    }
+  }
+#endif
+
+
+  /* Get all the optional fields that follow the first line.
+  */
+  zCookie = 0;
+  zAuthType = 0;
+  zAuthArg = 0;
+  zRemoteUser = 0;
+  zReferer = 0;
+  zIfNoneMatch = 0;
+  zIfModifiedSince = 0;
+  zAgent = 0;
+  zAccept = 0;
+  zAcceptEncoding = 0;
+  zContentLength = 0;
+  zContentType = 0;
+  zHttpHost = 0;
+  zServerName = 0;
+  zServerPort = 0;
+  rangeEnd = 0;
+  for(i=0; i<pIn->nField; i++){
+    HttpField *pF = &pIn->aField[i];
+    char *zFieldName = &pIn->a[pF->iName];
+    char *zVal = &pIn->a[pF->iVal];
+
+    zFieldName[pF->nName] = 0;
+    zVal[pF->nVal] = 0;
+    switch( HttpFieldCode(zFieldName, pF->nName) ){
+    case HDR_USER_AGENT: {
+      zAgent = zVal;
+      break;
+    }
+    case HDR_ACCEPT: {
+      zAccept = zVal;
+      break;
+    }
+    case HDR_ACCEPT_ENCODING: {
+      zAcceptEncoding = zVal;
+      break;
+    }
+    case HDR_CONTENT_LENGTH: {
+      zContentLength = zVal;
+      break;
+    }
+    case HDR_CONTENT_TYPE: {
+      zContentType = zVal;
+      break;
+    }
+    case HDR_REFERER: {
+      zReferer = zVal;
+      if( strstr(zVal, "devids.net/")!=0 ){ zReferer = "devids.net.smut";
+        Forbidden(230); /* LOG: Referrer is devids.net */
+      }
+      break;
+    }
+    case HDR_COOKIE: {
+      zCookie = StrAppend(zCookie,"; ",zVal);
+      break;
+    }
+    case HDR_CONNECTION: {
+      if( strcasecmp(zVal,"close")==0 ){
+        closeConnection = 1;
+      }else if( !forceClose && strcasecmp(zVal, "keep-alive")==0 ){
+        closeConnection = 0;
+      }
+      break;
+    }
+    case HDR_HOST: {
+      int inSquare = 0;
+      char c;
+      if( sanitizeString(zVal) ){
+        Forbidden(240);  /* LOG: Illegal content in HOST: parameter */
+      }
+      zHttpHost = zVal;
+      zServerPort = zServerName = StrDup(zHttpHost);
+      while( zServerPort && (c = *zServerPort)!=0
+              && (c!=':' || inSquare) ){
+        if( c=='[' ) inSquare = 1;
+        if( c==']' ) inSquare = 0;
+        zServerPort++;
+      }
+      if( zServerPort && *zServerPort ){
+        *zServerPort = 0;
+        zServerPort++;
+      }
+      if( zRealPort ){
+        zServerPort = StrDup(zRealPort);
+      }
+      break;
+    }
+    case HDR_AUTHORIZATION: {
+      zAuthType = GetFirstElement(zVal, &zAuthArg);
+      break;
+    }
+    case HDR_IF_NONE_MATCH: {
+      zIfNoneMatch = zVal;
+      break;
+    }
+    case HDR_IF_MODIFIED_SINCE: {
+      zIfModifiedSince = zVal;
+      break;
+    }
+    case HDR_RANGE: {
+      int x1 = 0, x2 = 0;
+      int n;
+      if( strcmp(zMethod,"GET")!=0 ) break;
+      n = sscanf(zVal, "bytes=%d-%d", &x1, &x2);
+      if( n==2 && x1>=0 && x2>=x1 ){
+        rangeStart = x1;
+        rangeEnd = x2;
+      }else if( n==1 && x1>0 ){
+        rangeStart = x1;
+        rangeEnd = 0x7fffffff;
+      }
+      break;
+    }
+    }
+  }
+  /* Disallow requests from certain clients */
+  if( zAgent ){
+    const char *azDisallow[] = {
+      "Windows 9",
+      "Download Master",
+      "Ezooms/",
+      "HTTrace",
+      "AhrefsBot",
+      "MicroMessenger",
+      "OPPO A33 Build",
+      "SemrushBot",
+      "MegaIndex.ru",
+      "MJ12bot",
+      "Chrome/0.A.B.C",
+      "Neevabot/",
+      "BLEXBot/",
+    };
+    size_t ii;
+    for(ii=0; ii<sizeof(azDisallow)/sizeof(azDisallow[0]); ii++){
+      if( strstr(zAgent,azDisallow[ii])!=0 ){
+        Forbidden(250);  /* LOG: Disallowed user agent */
+      }
+    }
+#if 0
+    /* Spider attack from 2019-04-24 */
+    if( strcmp(zAgent,
+            "Mozilla/5.0 (Windows NT 10.0; WOW64) AppleWebKit/537.36 "
+            "(KHTML, like Gecko) Chrome/50.0.2661.102 Safari/537.36")==0 ){
+      Forbidden(251);  /* LOG: Disallowed user agent (20190424) */
+    }
+#endif
+  }
+#if 0
+  if( zReferer ){
+    static const char *azDisallow[] = {
+      "skidrowcrack.com",
+      "hoshiyuugi.tistory.com",
+      "skidrowgames.net",
+    };
+    int i;
+    for(i=0; i<sizeof(azDisallow)/sizeof(azDisallow[0]); i++){
+      if( strstr(zReferer, azDisallow[i])!=0 ){
+        NotFound(260);  /* LOG: Disallowed referrer */
+      }
+    }
+  }
+#endif
+
+  PhaseMark(STATS_PHASE_HEADER);
+  PROBE4(header__parsed, nRequest, nIn, zMethod, zScript);
+
+  /* Make an extra effort to get a valid server name and port number.
+  ** Only Netscape provides this information.  If the browser is
+  ** Internet Explorer, then we have to find out the information for
+  ** ourselves.
+  */
+  if( zServerName==0 ){
+    zServerName = SafeMalloc( 100 );
+    gethostname(zServerName,100);
+  }
+  if( zServerPort==0 || *zServerPort==0 ){
+    zServerPort = DEFAULT_PORT;
+  }
+
+  /* Remove the query string from the end of the requested file.
+  */
+  for(z=zScript; *z && *z!='?'; z++){}
+  if( *z=='?' ){
+    zQuerySuffix = StrDup(z);
+    *z = 0;
+  }else{
+    zQuerySuffix = "";
+  }
+  zQueryString = *zQuerySuffix ? &zQuerySuffix[1] : zQuerySuffix;
+
+  /* POST content, if any, is not read here.  It is streamed to a CGI
+  ** program or SCGI server as they consume it, and whatever no handler
+  ** reads is skipped before the next request header.
+  */
+  if( zMethod[0]=='P' && zContentLength!=0 ){
+    size_t len = atoi(zContentLength);
+
+    if( len>MAX_CONTENT_LENGTH ){
+      StartResponse("500 Request too large");
+      nOut += printf(
+        "Content-type: text/plain; charset=utf-8\r\n"
+        "\r\n"
+        "Too much POST data\n"
+      );
+      MakeLogEntry(0, 270); /* LOG: Request too large */
+      althttpd_exit(0);
+    }
+    rangeEnd = 0;
+    pIn->nBody = (int)len;
+  }
+
+  /* Make sure the running time is not too great, allowing extra time
+  ** for any request content to arrive */
+  if( useTimeout ){
+    alarm(pIn->nBody>0 ? 25 + pIn->nBody/2000 : 10);
+  }
+
+  /* The live statistics page.  Its name begins with "/-" so that it
+  ** can never be the name of a file being served.
+  */
+  if( zStatusAuth && strcmp(zScript, "/-server-status")==0 ){
+    if( !CheckBasicAuthorization(zStatusAuth) ) return;
+    ServerStatusPage(strcmp(zQueryString, "format=prometheus")==0);
+    return;
+  }
+
+  /* Convert all unusual characters in the script name into "_".
+  **
+  ** This is a defense against various attacks, XSS attacks in particular.
+  */
+  sanitizeString(zScript);
+
+  /* Do not allow "/." or "/-" to to occur anywhere in the entity name.
+  ** This prevents attacks involving ".." and also allows us to create
+  ** files and directories whose names begin with "-" or "." which are
+  ** invisible to the webserver.
+  **
+  ** Exception:  Allow the "/.well-known/" prefix in accordance with
+  ** RFC-5785.
+  */
+  for(z=zScript; *z; z++){
+    if( *z=='/' && (z[1]=='.' || z[1]=='-') ){
+      if( strncmp(zScript,"/.well-known/",13)==0 && (z[1]!='.' || z[2]!='.') ){
+        /* Exception:  Allow "/." and "/-" for URLs that being with
+        ** "/.well-known/".  But do not allow "/..". */
+        continue;
+      }
+      NotFound(300); /* LOG: Path element begins with "." or "-" */
+    }
+  }
+
+  /* Figure out what the root of the filesystem should be.  If the
+  ** HTTP_HOST parameter exists (stored in zHttpHost) then remove the
+  ** port number from the end (if any), convert all characters to lower
+  ** case, and convert non-alphanumber characters (including ".") to "_".
+  ** Then try to find a directory with that name and the extension .website.
+  ** If not found, look for "default.website".
+  */
+  if( zScript[0]!='/' ){
+    NotFound(310); /* LOG: URI does not start with "/" */
+  }
+  if( strlen(zRoot)+40 >= sizeof(zLine) ){
+    NotFound(320); /* LOG: URI too long */
+  }
+  if( zHttpHost==0 || zHttpHost[0]==0 ){
+    NotFound(330);  /* LOG: Missing HOST: parameter */
+  }else if( strlen(zHttpHost)+strlen(zRoot)+10 >= sizeof(zLine) ){
+    NotFound(340);  /* LOG: HOST parameter too long */
+  }else{
+    sprintf(zLine, "%s/%s", zRoot, zHttpHost);
+    for(i=strlen(zRoot)+1; zLine[i] && zLine[i]!=':'; i++){
+      unsigned char c = (unsigned char)zLine[i];
+      if( !isalnum(c) ){
+        if( c=='.' && (zLine[i+1]==0 || zLine[i+1]==':') ){
+          /* If the client sent a FQDN with a "." at the end
+          ** (example: "sqlite.org." instead of just "sqlite.org") then
+          ** omit the final "." from the document root directory name */
+          break;
+        }
+        zLine[i] = '_';
+      }else if( isupper(c) ){
+        zLine[i] = tolower(c);
+      }
     }
-    nOut += printf("Content-Range: bytes %d-%d/%d\r\n",
-                    rangeStart, rangeEnd, (int)pStat->st_size);
-    pStat->st_size = rangeEnd + 1 - rangeStart;
+    strcpy(&zLine[i], ".website");
+  }
+
+  /* Static content that is in the file cache is sent without looking
+  ** at the filesystem
+  */
+  if( nFileCache>0
+   && (strcmp(zMethod,"GET")==0 || strcmp(zMethod,"HEAD")==0)
+  ){
+    char zEnc[20];
+    mAccept = AcceptedEncodings();
+    sprintf(zEnc, "%d", mAccept);
+    zSite = StrDup(zLine);
+    zCacheKey = StrAppend(StrAppend(StrDup(zLine), " ", zScript), " ", zEnc);
+    if( (pEntry = FileCacheFind(zCacheKey))!=0 ){
+      zFile = pEntry->zFile;
+      zRealScript = pEntry->zRealScript;
+      zPathInfo = "";
+      statbuf = pEntry->sSend;
+      PhaseMark(STATS_PHASE_HOST);
+      if( SendFileContent(pEntry->fd, zFile, pEntry->zMime, pEntry->zETag,
+                          &statbuf, pEntry->iSide, pEntry->bVary) ){
+        return;
+      }
+      fflush(stdout);
+      MakeLogEntry(0, 5);  /* LOG: Normal reply from the file cache */
+      omitLog = 1;
+      if( useTimeout ) alarm(keepAliveTimeout);
+      return;
+    }
+  }
+
+  if( stat(zLine,&statbuf) || !S_ISDIR(statbuf.st_mode) ){
+    sprintf(zLine, "%s/default.website", zRoot);
+    if( stat(zLine,&statbuf) || !S_ISDIR(statbuf.st_mode) ){
+      if( standalone ){
+        sprintf(zLine, "%s", zRoot);
+      }else{
+        NotFound(350);  /* LOG: *.website permissions */
+      }
+    }
+  }
+  zHome = StrDup(zLine);
+  if( zSite && strcmp(zSite, zHome)==0 ) zSite = 0;
+  PhaseMark(STATS_PHASE_HOST);
+
+  /* Change directories to the root of the HTTP filesystem
+  */
+  if( chdir(zHome)!=0 ){
+    char zBuf[1000];
+    Malfunction(360,  /* LOG: chdir() failed */
+         "cannot chdir to [%s] from [%s]",
+         zHome, getcwd(zBuf,999));
+  }
+
+  /* Locate the file in the filesystem.  We might have to append
+  ** a name like "/home" or "/index.html" or "/index.cgi" in order
+  ** to find it.  Any excess path information is put into the
+  ** zPathInfo variable.
+  */
+  j = j0 = (int)strlen(zLine);
+  i = 0;
+  while( zScript[i] ){
+    while( zScript[i] && (i==0 || zScript[i]!='/') ){
+      zLine[j] = zScript[i];
+      i++; j++;
+    }
+    zLine[j] = 0;
+    if( stat(zLine,&statbuf)!=0 ){
+      int stillSearching = 1;
+      while( stillSearching && i>0 && j>j0 ){
+        while( j>j0 && zLine[j-1]!='/' ){ j--; }
+        strcpy(&zLine[j-1], "/not-found.html");
+        if( stat(zLine,&statbuf)==0 && S_ISREG(statbuf.st_mode)
+            && access(zLine,R_OK)==0 ){
+          zRealScript = StrDup(&zLine[j0]);
+          Redirect(zRealScript, 302, 1, 370); /* LOG: redirect to not-found */
+          return;
+        }else{
+          j--;
+        }
+      }
+      if( stillSearching ) NotFound(380); /* LOG: URI not found */
+      break;
+    }
+    if( S_ISREG(statbuf.st_mode) ){
+      if( access(zLine,R_OK) ){
+        NotFound(390);  /* LOG: File not readable */
+      }
+      zRealScript = StrDup(&zLine[j0]);
+      break;
+    }
+    if( zScript[i]==0 || zScript[i+1]==0 ){
+      static const char *azIndex[] = { "/home", "/index.html", "/index.cgi" };
+      int k = j>0 && zLine[j-1]=='/' ? j-1 : j;
+      unsigned int jj;
+      for(jj=0; jj<sizeof(azIndex)/sizeof(azIndex[0]); jj++){
+        strcpy(&zLine[k],azIndex[jj]);
+        if( stat(zLine,&statbuf)!=0 ) continue;
+        if( !S_ISREG(statbuf.st_mode) ) continue;
+        if( access(zLine,R_OK) ) continue;
+        break;
+      }
+      if( jj>=sizeof(azIndex)/sizeof(azIndex[0]) ){
+        NotFound(400); /* LOG: URI is a directory w/o index.html */
+      }
+      zRealScript = StrDup(&zLine[j0]);
+      if( zScript[i]==0 ){
+        /* If the requested URL does not end with "/" but we had to
+        ** append "index.html", then a redirect is necessary.  Otherwise
+        ** none of the relative URLs in the delivered document will be
+        ** correct. */
+        Redirect(zRealScript,301,1,410); /* LOG: redirect to add trailing / */
+        return;
+      }
+      break;
+    }
+    zLine[j] = zScript[i];
+    i++; j++;
+  }
+  zFile = StrDup(zLine);
+  zPathInfo = StrDup(&zScript[i]);
+  lenFile = strlen(zFile);
+  zDir = StrDup(zFile);
+  for(i=strlen(zDir)-1; i>0 && zDir[i]!='/'; i--){};
+  if( i==0 ){
+     strcpy(zDir,"/");
+  }else{
+     zDir[i] = 0;
+  }
+  PhaseMark(STATS_PHASE_PATH);
+  PROBE2(file__resolved, zFile, (long long)statbuf.st_size);
+
+  /* Check to see if there is an authorization file.  If there is,
+  ** process it.
+  */
+  sprintf(zLine, "%s/-auth", zDir);
+  if( access(zLine,R_OK)==0 ){
+    if( !CheckBasicAuthorization(zLine) ) return;
+    zCacheKey = 0;
+  }
+  PhaseMark(STATS_PHASE_AUTH);
+
+  /* Take appropriate action
+  */
+  if( (statbuf.st_mode & 0100)==0100 && access(zFile,X_OK)==0 ){
+    char *zBaseFilename;         /* Filename without directory prefix */
+
+    /*
+    ** Abort with an error if the CGI script is writable by anyone other
+    ** than its owner.
+    */
+    if( statbuf.st_mode & 0022 ){
+      CgiScriptWritable();
+    }
+#ifdef __linux__
+    if( inWorker ) WorkerRelease();
+#endif
+
+    /* If its executable, it must be a CGI program.  Start by
+    ** changing directories to the directory holding the program.
+    */
+    if( chdir(zDir) ){
+      char zBuf[1000];
+      Malfunction(420, /* LOG: chdir() failed */
+           "cannot chdir to [%s] from [%s]", 
+           zDir, getcwd(zBuf,999));
+    }
+
+    /* Compute the base filename of the CGI script */
+    for(i=strlen(zFile)-1; i>=0 && zFile[i]!='/'; i--){}
+    zBaseFilename = &zFile[i+1];
+
+    /* Start the request content on its way to the script */
+    if( zMethod[0]=='P' ){
+      if( spoolPost ){
+        PostSpool();
+      }else{
+        PostFeederStart();
+      }
+    }
+
+    if( strncmp(zBaseFilename,"nph-",4)==0 ){
+      /* If the name of the CGI script begins with "nph-" then we are
+      ** dealing with a "non-parsed headers" CGI script.  Just exec()
+      ** it directly and let it handle all its own header generation.
+      */
+      if( inWorker ){
+        /* A worker runs the script in a child and then drops the
+        ** connection, since it cannot know where the reply ends. */
+        pid_t pid = fork();
+        if( pid==0 ){
+          inWorker = 0;
+          CgiSetup();
+          execl(zBaseFilename,zBaseFilename,(char*)0);
+          exit(0);
+        }
+        if( pid>0 ){
+          int waitStatus = 0;
+          PROBE2(cgi__spawn, (int)pid, zFile);
+          waitpid(pid, &waitStatus, 0);
+          PROBE2(cgi__exit, (int)pid, waitStatus);
+        }
+        althttpd_exit(0);
+      }
+      CgiSetup();
+      execl(zBaseFilename,zBaseFilename,(char*)0);
+      /* NOTE: No log entry written for nph- scripts */
+      exit(0);
+    }
+
+    /* Fall thru to here only if this process (the server) is going
+    ** to read and augment the header sent back by the CGI process.
+    ** Open a pipe to receive the output from the CGI process.  Then
+    ** fork the CGI process.  Once everything is done, we should be
+    ** able to read the output of CGI on the "in" stream.
+    */
+    {
+      int px[2];
+      pid_t pid;
+      if( pipe(px) ){
+        Malfunction(440, /* LOG: pipe() failed */
+                    "Unable to create a pipe for the CGI program");
+      }
+      pid = fork();
+      if( pid==0 ){
+        /* The environment and standard input are set up in the child,
+        ** so that the server keeps its own for later requests. */
+        inWorker = 0;
+        CgiSetup();
+        close(px[0]);
+        close(1);
+        if( dup(px[1])!=1 ){
+          Malfunction(450, /* LOG: dup(1) failed */
+                 "Unable to duplicate file descriptor %d to 1",
+                 px[1]);
+        }
+        close(px[1]);
+        CloseExtraFds();
+        execl(zBaseFilename, zBaseFilename, (char*)0);
+        exit(0);
+      }
+      if( pid>0 ){
+        PROBE2(cgi__spawn, (int)pid, zFile);
+      }
+      close(px[1]);
+      in = fdopen(px[0], "rb");
+    }
+    PhaseMark(STATS_PHASE_START);
+    if( in==0 ){
+      CgiError();
+    }else{
+      CgiHandleReply(in);
+      PostFeederFinish();
+    }
+  }else if( lenFile>5 && strcmp(&zFile[lenFile-5],".scgi")==0 ){
+    /* Any file that ends with ".scgi" is assumed to be text of the
+    ** form:
+    **     SCGI hostname port
+    ** Open a TCP/IP connection to that host and send it an SCGI request
+    */
+#ifdef __linux__
+    if( inWorker ) WorkerRelease();
+#endif
+    SendScgiRequest(zFile, &statbuf, zScript);
+  }else if( countSlashes(zRealScript)!=countSlashes(zScript) ){
+    /* If the request URI for static content contains material past the
+    ** actual content file name, report that as a 404 error. */
+    NotFound(460); /* LOG: Excess URI content past static file name */
+  }else if( zCacheKey
+         && (pEntry = FileCacheAdd(zCacheKey, zSite, zFile, lenFile,
+                                   zRealScript, zLine, mAccept,
+                                   &statbuf))!=0 ){
+    /* Static content that is now in the file cache */
+    if( SendFileContent(pEntry->fd, zFile, pEntry->zMime, pEntry->zETag,
+                        &statbuf, pEntry->iSide, pEntry->bVary) ){
+      return;
+    }
+  }else{
+    /* If it isn't executable then it
+    ** must a simple file that needs to be copied to output.
+    */
+    if( SendFile(zFile, lenFile, &statbuf) ) return;
+  }
+  fflush(stdout);
+  MakeLogEntry(0, 0);  /* LOG: Normal reply */
+
+  /* The next request must arrive within keepAliveTimeout seconds or we
+  ** close the connection
+  */
+  omitLog = 1;
+  if( useTimeout ) alarm(keepAliveTimeout);
+}
+
+#define MAX_PARALLEL 50  /* Number of simultaneous children */
+
+/*
+** All possible forms of an IP address.  Needed to work around GCC strict
+** aliasing rules.
+*/
+typedef union {
+  struct sockaddr sa;              /* Abstract superclass */
+  struct sockaddr_in sa4;          /* IPv4 */
+  struct sockaddr_in6 sa6;         /* IPv6 */
+  struct sockaddr_storage sas;     /* Should be the maximum of the above 3 */
+} address;
+
+/*
+** Open listening sockets for TCP port zPort and store them in aListener[].
+** If reusePort is true, set SO_REUSEPORT so that other processes can bind
+** their own sockets to the same port.  Return the number of sockets
+** opened, which is also stored in nListener.
+*/
+static int OpenListeners(const char *zPort, int localOnly){
+  int *listener = aListener;   /* The server sockets */
+  int opt = 1;                 /* setsockopt flag */
+  struct addrinfo sHints;      /* Address hints */
+  struct addrinfo *pAddrs, *p; /* */
+  int rc;                      /* Result code */
+  int n;
+
+  memset(&sHints, 0, sizeof(sHints));
+  if( ipv4Only ){
+    sHints.ai_family = PF_INET;
+    /*printf("ipv4 only\n");*/
+  }else if( ipv6Only ){
+    sHints.ai_family = PF_INET6;
+    /*printf("ipv6 only\n");*/
   }else{
-    StartResponse("200 OK");
-    rangeStart = 0;
-  }
-  nOut += DateTag("Last-Modified", pStat->st_mtime);
-  nOut += printf("Cache-Control: max-age=%d\r\n", mxAge);
-  nOut += printf("ETag: \"%s\"\r\n", zETag);
-  nOut += printf("Content-type: %s; charset=utf-8\r\n",zContentType);
-  nOut += printf("Content-length: %d\r\n\r\n",(int)pStat->st_size);
-  fflush(stdout);
-  if( strcmp(zMethod,"HEAD")==0 ){
-    MakeLogEntry(0, 2); /* LOG: Normal HEAD reply */
-    fclose(in);
-    fflush(stdout);
-    return 1;
+    sHints.ai_family = PF_UNSPEC;
   }
-  if( useTimeout ) alarm(30 + pStat->st_size/1000);
-#ifdef linux
-  {
-    off_t offset = rangeStart;
-    nOut += sendfile(fileno(stdout), fileno(in), &offset, pStat->st_size);
+  sHints.ai_socktype = SOCK_STREAM;
+  sHints.ai_flags = AI_PASSIVE;
+  sHints.ai_protocol = 0;
+  rc = getaddrinfo(localOnly ? "localhost": 0, zPort, &sHints, &pAddrs);
+  if( rc ){
+    fprintf(stderr, "could not get addr info: %s", 
+            rc!=EAI_SYSTEM ? gai_strerror(rc) : strerror(errno));
+    return 0;
   }
-#else
-  xferBytes(in, stdout, (int)pStat->st_size, rangeStart);
+  for(n=0, p=pAddrs; n<(int)(sizeof(aListener)/sizeof(aListener[0])) && p!=0;
+        p=p->ai_next){
+    listener[n] = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if( listener[n]>=0 ){
+      fcntl(listener[n], F_SETFD, FD_CLOEXEC);
+      /* if we can't terminate nicely, at least allow the socket to be reused */
+      setsockopt(listener[n], SOL_SOCKET, SO_REUSEADDR,&opt, sizeof(opt));
+
+#if defined(SO_REUSEPORT)
+      if( reusePort ){
+        setsockopt(listener[n], SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+      }
 #endif
-  fclose(in);
-  return 0;
+      
+#if defined(IPV6_V6ONLY)
+      if( p->ai_family==AF_INET6 ){
+        int v6only = 1;
+        setsockopt(listener[n], IPPROTO_IPV6, IPV6_V6ONLY,
+                    &v6only, sizeof(v6only));
+      }
+#endif
+      
+      if( bind(listener[n], p->ai_addr, p->ai_addrlen)<0 ){
+        printf("bind failed: %s\n", strerror(errno));
+        close(listener[n]);
+        continue;
+      }
+      if( listen(listener[n], listenBacklog)<0 ){
+        printf("listen() failed: %s\n", strerror(errno));
+        close(listener[n]);
+        continue;
+      }
+      if( nWorker>0 ){
+        /* Workers make their listening sockets non-blocking so that a
+        ** worker that loses the race for a connection goes back to
+        ** select() rather than hanging in accept(). */
+        fcntl(listener[n], F_SETFL, fcntl(listener[n], F_GETFL) | O_NONBLOCK);
+      }
+      n++;
+    }
+  }
+  freeaddrinfo(pAddrs);
+  nListener = n;
+  return n;
 }
 
 /*
-** A CGI or SCGI script has run and is sending its reply back across
-** the channel "in".  Process this reply into an appropriate HTTP reply.
-** Close the "in" channel when done.
+** Implement an HTTP server daemon listening on port zPort.
+**
+** As new connections arrive, fork a child and let the child return
+** out of this procedure call.  The child will handle the request.
+** The parent never returns from this procedure.
+**
+** If nWorker is positive, then instead fork nWorker long-lived workers
+** up front.  Each worker returns out of this procedure with inWorker set
+** and the listening sockets in aListener[], and later accepts connections
+** for itself in WorkerLoop().  The parent stays here and starts a
+** replacement whenever a worker exits.  With reusePort, each worker binds
+** its own SO_REUSEPORT sockets so that the kernel spreads new connections
+** across the workers, and the parent holds no listening sockets at all.
+**
+** Return 0 to each child as it runs.  If unable to establish a
+** listening socket, return non-zero.
 */
-static void CgiHandleReply(FILE *in){
-  int seenContentLength = 0;   /* True if Content-length: header seen */
-  int contentLength = 0;       /* The content length */
-  size_t nRes = 0;             /* Bytes of payload */
-  size_t nMalloc = 0;          /* Bytes of space allocated to aRes */
-  char *aRes = 0;              /* Payload */
-  int c;                       /* Next character from in */
-  char *z;                     /* Pointer to something inside of zLine */
-  int iStatus = 0;             /* Reply status code */
-  char zLine[1000];            /* One line of reply from the CGI script */
+int http_server(const char *zPort, int localOnly){
+  int *listener = aListener;   /* The server sockets */
+  int connection;              /* A socket for each individual connection */
+  fd_set readfds;              /* Set of file descriptors for select() */
+  address inaddr;              /* Remote address */
+  socklen_t lenaddr;           /* Length of the inaddr structure */
+  int child;                   /* PID of the child process */
+  int nchildren = 0;           /* Number of child processes */
+  struct timeval delay;        /* How long to wait inside select() */
+  int i, n;
+  int maxFd = -1;
 
-  if( useTimeout ){
-    /* Disable the timeout, so that we can implement Hanging-GET or
-    ** long-poll style CGIs.  The RLIMIT_CPU will serve as a safety
-    ** to help prevent a run-away CGI */
-    alarm(0);
+#if !defined(SO_REUSEPORT)
+  reusePort = 0;
+#endif
+  if( nWorker<=0 ) reusePort = 0;
+  n = OpenListeners(zPort, localOnly);
+  if( n==0 ){
+    fprintf(stderr, "cannot open any sockets\n");
+    return 1;
   }
-  while( fgets(zLine,sizeof(zLine),in) && !isspace((unsigned char)zLine[0]) ){
-    if( strncasecmp(zLine,"Location:",9)==0 ){
-      StartResponse("302 Redirect");
-      RemoveNewline(zLine);
-      z = &zLine[10];
-      while( isspace(*(unsigned char*)z) ){ z++; }
-      nOut += printf("Location: %s\r\n",z);
-      rangeEnd = 0;
-    }else if( strncasecmp(zLine,"Status:",7)==0 ){
-      int i;
-      for(i=7; isspace((unsigned char)zLine[i]); i++){}
-      nOut += printf("%s %s", zProtocol, &zLine[i]);
-      strncpy(zReplyStatus, &zLine[i], 3);
-      zReplyStatus[3] = 0;
-      iStatus = atoi(zReplyStatus);
-      if( iStatus!=200 ) rangeEnd = 0;
-      statusSent = 1;
-    }else if( strncasecmp(zLine, "Content-length:", 15)==0 ){
-      seenContentLength = 1;
-      contentLength = atoi(zLine+15);
-    }else{
-      size_t nLine = strlen(zLine);
-      if( nRes+nLine >= nMalloc ){
-        nMalloc += nMalloc + nLine*2;
-        aRes = realloc(aRes, nMalloc+1);
-        if( aRes==0 ){
-          Malfunction(600, "Out of memory: %d bytes", nMalloc);
+  if( reusePort ){
+    /* The sockets were only opened to check that the port is usable.
+    ** Close them so that no connections get queued on them. */
+    for(i=0; i<n; i++) close(listener[i]);
+    nListener = 0;
+  }
+  StatsInit();
+  ScgiHealthInit();
+
+  if( nWorker>0 ){
+    /* aPid[i] is the process id of worker i, or 0 if it needs to be
+    ** started.  aBusy[] is shared with the workers, each of which sets
+    ** its own entry while it is serving a request. */
+    pid_t *aPid = calloc(nWorker, sizeof(pid_t));
+    pid_t pidWriter = 0;
+    void *pShared;
+    if( aPid==0 ){
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+    pShared = mmap(0, nWorker, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if( pShared!=MAP_FAILED ) aBusy = pShared;
+#ifdef __linux__
+    if( nWorker>1
+     && socketpair(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0,
+                   fdHandoff) ){
+      fdHandoff[0] = fdHandoff[1] = -1;
+    }
+#endif
+    if( nLogRing>0 && zLogFile ) LogRingInit();
+    supervisor = getpid();
+    while( 1 ){
+      if( pLogRing && pidWriter==0 ){
+        child = fork();
+        if( child==0 ){
+          inLogWriter = 1;
+          for(i=0; i<nListener; i++) close(aListener[i]);
+          nListener = 0;
+          return 0;
         }
+        if( child>0 ) pidWriter = child;
+      }
+      for(i=0; i<nWorker; i++){
+        if( aPid[i] ) continue;
+        child = fork();
+        if( child==0 ){
+          inWorker = 1;
+          iWorker = i;
+          if( reusePort && OpenListeners(zPort, localOnly)==0 ){
+            exit(1);
+          }
+          return 0;
+        }
+        if( child<0 ){
+          sleep(1);
+          break;
+        }
+        aPid[i] = child;
+      }
+      child = wait(0);
+      if( child>0 && child==pidWriter ) pidWriter = 0;
+      for(i=0; child>0 && i<nWorker; i++){
+        if( aPid[i]!=child ) continue;
+        aPid[i] = 0;
+        if( aBusy ) aBusy[i] = 0;
+        if( i<pStats->nWorker ) pStats->anConn[i] = 0;
+        if( reusePort ) sleep(1);  /* Do not spin if bind() keeps failing */
       }
-      memcpy(aRes+nRes, zLine, nLine);
-      nRes += nLine;
     }
   }
 
-  /* Copy everything else thru without change or analysis.
-  */
-  if( rangeEnd>0 && seenContentLength && rangeStart<contentLength ){
-    StartResponse("206 Partial Content");
-    if( rangeEnd>=contentLength ){
-      rangeEnd = contentLength-1;
+  while( 1 ){
+    if( nchildren>MAX_PARALLEL ){
+      /* Slow down if connections are arriving too fast */
+      sleep( nchildren-MAX_PARALLEL );
+    }
+    delay.tv_sec = 60;
+    delay.tv_usec = 0;
+    FD_ZERO(&readfds);
+    for(i=0; i<n; i++){
+      assert( listener[i]>=0 );
+      FD_SET( listener[i], &readfds);
+      if( listener[i]>maxFd ) maxFd = listener[i];
+    }
+    select( maxFd+1, &readfds, 0, 0, &delay);
+    for(i=0; i<n; i++){
+      if( FD_ISSET(listener[i], &readfds) ){
+        lenaddr = sizeof(inaddr);
+        connection = accept(listener[i], &inaddr.sa, &lenaddr);
+        if( connection>=0 ){
+          child = fork();
+          if( child!=0 ){
+            if( child>0 ) nchildren++;
+            STATS_ADD(nConn, 1);
+            pStats->nChild = nchildren;
+            close(connection);
+            /* printf("subprocess %d started...\n", child); fflush(stdout); */
+          }else{
+            int nErr = 0, fd;
+            close(0);
+            fd = dup(connection);
+            if( fd!=0 ) nErr++;
+            close(1);
+            fd = dup(connection);
+            if( fd!=1 ) nErr++;
+            close(connection);
+            return nErr;
+          }
+        }
+      }
+      /* Bury dead children */
+      while( (child = waitpid(0, 0, WNOHANG))>0 ){
+        /* printf("process %d ends\n", child); fflush(stdout); */
+        nchildren--;
+      }
+      pStats->nChild = nchildren;
     }
-    nOut += printf("Content-Range: bytes %d-%d/%d\r\n",
-                    rangeStart, rangeEnd, contentLength);
-    contentLength = rangeEnd + 1 - rangeStart;
-  }else{
-    StartResponse("200 OK");
   }
-  if( nRes>0 ){
-    aRes[nRes] = 0;
-    printf("%s", aRes);
-    nOut += nRes;
-    nRes = 0;
+  /* NOT REACHED */  
+  exit(1);
+}
+
+/*
+** Write the IP address of the peer on socket fd into zAddr[], which is
+** nAddr bytes in size.  An IPv4 address mapped into IPv6 is written in
+** its plain IPv4 form.  zAddr[] is an empty string if the address is
+** unknown.
+*/
+static void GetRemoteAddr(int fd, char *zAddr, int nAddr){
+  address remoteAddr;
+  socklen_t size = sizeof(remoteAddr);
+  zAddr[0] = 0;
+  if( getpeername(fd, &remoteAddr.sa, &size)<0
+   || getnameinfo(&remoteAddr.sa, size, zAddr, nAddr, 0, 0, NI_NUMERICHOST)
+  ){
+    zAddr[0] = 0;
+    return;
   }
-  if( iStatus==304 ){
-    nOut += printf("\r\n\r\n");
-  }else if( seenContentLength ){
-    nOut += printf("Content-length: %d\r\n\r\n", contentLength);
-    xferBytes(in, stdout, contentLength, rangeStart);
-  }else{
-    while( (c = getc(in))!=EOF ){
-      if( nRes>=nMalloc ){
-        nMalloc = nMalloc*2 + 1000;
-        aRes = realloc(aRes, nMalloc+1);
-        if( aRes==0 ){
-           Malfunction(610, "Out of memory: %d bytes", nMalloc);
-        }
+  if( strncmp(zAddr, "::ffff:", 7)==0
+   && strchr(zAddr+7, ':')==0
+   && strchr(zAddr+7, '.')!=0
+  ){
+    memmove(zAddr, zAddr+7, strlen(zAddr+7)+1);
+  }
+}
+
+/*
+** Give the connection that a long-lived worker is about to serve up to
+** maxCpu more seconds of CPU time.
+*/
+static void WorkerCpuLimit(void){
+#ifdef RLIMIT_CPU
+  if( maxCpu>0 ){
+    struct rusage ru;
+    struct rlimit rlim;
+    getrusage(RUSAGE_SELF, &ru);
+    if( getrlimit(RLIMIT_CPU, &rlim)==0 ){
+      rlim.rlim_cur = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + maxCpu + 1;
+      if( rlim.rlim_max!=RLIM_INFINITY && rlim.rlim_cur>rlim.rlim_max ){
+        rlim.rlim_cur = rlim.rlim_max;
       }
-      aRes[nRes++] = c;
+      setrlimit(RLIMIT_CPU, &rlim);
     }
-    if( nRes ){
-      aRes[nRes] = 0;
-      nOut += printf("Content-length: %d\r\n\r\n%s", (int)nRes, aRes);
-    }else{
-      nOut += printf("Content-length: 0\r\n\r\n");
+  }
+#endif
+}
+
+/*
+** Return true if a long-lived worker is too close to its hard CPU limit
+** to give another connection a full maxCpu seconds.  The worker should
+** then exit and let the supervisor start a fresh one.
+*/
+static int WorkerCpuSpent(void){
+#ifdef RLIMIT_CPU
+  if( maxCpu>0 ){
+    struct rusage ru;
+    struct rlimit rlim;
+    getrusage(RUSAGE_SELF, &ru);
+    if( getrlimit(RLIMIT_CPU, &rlim)==0 && rlim.rlim_max!=RLIM_INFINITY
+     && ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + maxCpu + 1
+          > (long long)rlim.rlim_max
+    ){
+      return 1;
+    }
+  }
+#endif
+  return 0;
+}
+
+/*
+** Make the connection on socket fd the standard input and output of a
+** long-lived worker.  The socket fd itself is left open.
+*/
+static void WorkerAttach(int fd){
+  dup2(fd, 0);
+  dup2(fd, 1);
+  clearerr(stdout);
+  nIn = nOut = 0;
+  nInStats = nOutStats = 0;
+  statusSent = 0;
+  closeConnection = 0;
+  omitLog = 0;
+  zHttp = useHttps ? "https" : "http";
+  WorkerCpuLimit();
+  if( aBusy ) aBusy[iWorker] = 1;
+}
+
+/*
+** A long-lived worker has finished with the connection on its standard
+** input and output, either for good or until the next request arrives.
+** Detach it and clean up after the last request, including releasing
+** any per-request memory so that a parked connection holds none.
+**
+** Descriptors 0 and 1 are pointed at the read end of an otherwise unused
+** pipe rather than closed, so that they are never handed out to some
+** other socket or file.
+*/
+static void WorkerDetach(void){
+  static int fdIdle = -1;
+  pid_t pid;
+  int waitStatus;
+  fflush(stdout);
+  clearerr(stdout);
+  if( fdIdle<0 ){
+    int px[2];
+    if( pipe(px) ) exit(1);
+    close(px[1]);
+    fdIdle = px[0];
+    fcntl(fdIdle, F_SETFD, FD_CLOEXEC);
+  }
+  dup2(fdIdle, 0);
+  dup2(fdIdle, 1);
+  if( fdPostBody>=0 ){
+    close(fdPostBody);
+    fdPostBody = -1;
+  }
+  if( useTimeout ) alarm(0);
+  while( (pid = waitpid(-1, &waitStatus, WNOHANG))>0 ){
+    if( pid!=pidFeeder ){
+      PROBE2(cgi__exit, (int)pid, waitStatus);
     }
   }
-  free(aRes);
-  fclose(in);
+  if( fdContent>=0 ){
+    close(fdContent);
+    fdContent = -1;
+  }
+  ArenaReset();
+  if( aBusy ) aBusy[iWorker] = 0;
 }
 
 /*
-** Send an SCGI request to a host identified by zFile and process the
-** reply.
+** Return true if some fraction, shedLoad percent or more, of the other
+** workers are busy serving requests.
 */
-static void SendScgiRequest(const char *zFile, const char *zScript){
-  FILE *in;
-  FILE *s;
-  char *z;
-  char *zHost;
-  char *zPort = 0;
-  char *zRelight = 0;
-  char *zFallback = 0;
+static int ServerIsBusy(void){
+  int i, nBusy = 0;
+  if( aBusy==0 || shedLoad<=0 || nWorker<2 ) return 0;
+  for(i=0; i<nWorker; i++){
+    if( i!=iWorker && aBusy[i] ) nBusy++;
+  }
+  return nBusy*100 >= shedLoad*(nWorker-1);
+}
+
+/*
+** Return true if the current connection should be closed after the
+** request that is about to be processed, either because it has reached
+** the --max-requests or --max-lifetime limit or because the server is
+** busy.
+*/
+static int ConnectionDone(void){
+  if( maxRequest>0 && nRequest>=maxRequest ) return 1;
+  if( maxLifetime>0 && time(0)-connBegin>=maxLifetime ) return 1;
+  return ServerIsBusy();
+}
+
+#ifdef __linux__
+/*
+** Collect as much of the next request header on socket fd as has
+** already arrived, without waiting for more.  Return 1 if the header is
+** complete (or too large, which ProcessOneRequest() will report), 0 if
+** more input is needed, or -1 if the client has closed the connection.
+*/
+static int HttpInputPoll(HttpInput *p, int fd){
   int rc;
-  int iSocket = -1;
-  struct addrinfo hints;
-  struct addrinfo *ai = 0;
-  struct addrinfo *p;
-  char *zHdr;
-  size_t nHdr = 0;
-  size_t nHdrAlloc;
-  int i;
-  char zLine[1000];
-  char zExtra[1000];
-  in = fopen(zFile, "rb");
-  if( in==0 ){
-    Malfunction(700, "cannot open \"%s\"\n", zFile);
+  if( p->nBody>0 && (rc = HttpInputSkip(p, fd, 1))<=0 ) return rc;
+  if( !p->inHeader ) HttpInputBegin(p);
+  while( (rc = HttpInputParse(p))==0 ){
+    int got = HttpInputFill(p, fd, 1);
+    if( got==0 ) return -1;
+    if( got<0 ) return errno==EAGAIN || errno==EWOULDBLOCK ? 0 : -1;
   }
-  if( fgets(zLine, sizeof(zLine)-1, in)==0 ){
-    Malfunction(701, "cannot read \"%s\"\n", zFile);
+  return 1;
+}
+
+/*
+** Input has arrived on the parked connection pConn.  Serve requests from
+** it for as long as complete request headers are available, then park it
+** again or close it.
+*/
+static void WorkerServe(WorkerConn *pConn){
+  int rc;
+  WorkerUnpark(pConn);
+  if( pConn->pIn==0 && (pConn->pIn = calloc(1, sizeof(HttpInput)))==0 ){
+    WorkerClose(pConn);
+    return;
   }
-  if( strncmp(zLine,"SCGI ",5)!=0 ){
-    Malfunction(702, "misformatted SCGI spec \"%s\"\n", zFile);
+  rc = HttpInputPoll(pConn->pIn, pConn->fd);
+  if( rc==0
+   && time(0) - pConn->tWait >= (pConn->nRequest ? keepAliveTimeout : 15)
+  ){
+    rc = -1;    /* The header is taking too long to arrive */
   }
-  z = zLine+5;
-  zHost = GetFirstElement(z,&z);
-  zPort = GetFirstElement(z,0);
-  if( zHost==0 || zHost[0]==0 || zPort==0 || zPort[0]==0 ){
-    Malfunction(703, "misformatted SCGI spec \"%s\"\n", zFile);
+  if( rc<=0 ){
+    if( rc<0 ){
+      WorkerClose(pConn);
+    }else{
+      WorkerPark(pConn);
+    }
+    return;
   }
-  while( fgets(zExtra, sizeof(zExtra)-1, in) ){
-    char *zCmd = GetFirstElement(zExtra,&z);
-    if( zCmd==0 ) continue;
-    if( zCmd[0]=='#' ) continue;
-    RemoveNewline(z);
-    if( strcmp(zCmd, "relight:")==0 ){
-      free(zRelight);
-      zRelight = StrDup(z);
+  WorkerAttach(pConn->fd);
+  pIn = pConn->pIn;
+  nRequest = pConn->nRequest;
+  connBegin = pConn->tBegin;
+  zRemoteAddr = pConn->zAddr;
+  if( sigsetjmp(workerEnd, 1) ){
+    /* The connection has ended */
+    WorkerDetach();
+    pIn = &sStdIn;
+    WorkerClose(pConn);
+    return;
+  }
+  do{
+    ProcessOneRequest(ConnectionDone());
+  }while( (rc = HttpInputPoll(pIn, pConn->fd))>0 );
+  if( rc<0 ) althttpd_exit(0);
+  pConn->nRequest = nRequest;
+  time(&pConn->tWait);
+  WorkerDetach();
+  pIn = &sStdIn;
+  if( pConn->pIn->n==0 && pConn->pIn->nBody==0 ){
+    free(pConn->pIn);
+    pConn->pIn = 0;
+  }
+  WorkerPark(pConn);
+}
+
+/*
+** Park the connections waiting in the hand-off queue in this worker.
+*/
+static void WorkerReceive(void){
+  WorkerHandoff h;
+  WorkerConn *pNew;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *pCmsg;
+  union {
+    struct cmsghdr hdr;
+    char a[CMSG_SPACE(sizeof(int))];
+  } u;
+  int fd;
+  while( 1 ){
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &h;
+    iov.iov_len = sizeof(h);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.a;
+    msg.msg_controllen = sizeof(u.a);
+    if( recvmsg(fdHandoff[1], &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC)<0 ){
+      return;
+    }
+    pCmsg = CMSG_FIRSTHDR(&msg);
+    if( pCmsg==0 || pCmsg->cmsg_level!=SOL_SOCKET
+     || pCmsg->cmsg_type!=SCM_RIGHTS ){
       continue;
     }
-    if( strcmp(zCmd, "fallback:")==0 ){
-      free(zFallback);
-      zFallback = StrDup(z);
+    memcpy(&fd, CMSG_DATA(pCmsg), sizeof(int));
+    pNew = calloc(1, sizeof(*pNew));
+    if( pNew==0 ){
+      close(fd);
       continue;
     }
-    Malfunction(704, "unrecognized line in SCGI spec: \"%s %s\"\n",
-                zCmd, z ? z : "");
+    pNew->fd = fd;
+    pNew->nRequest = h.nRequest;
+    pNew->tBegin = h.tBegin;
+    pNew->tWait = h.tWait;
+    memcpy(pNew->zAddr, h.zAddr, sizeof(pNew->zAddr));
+    pNew->zAddr[sizeof(pNew->zAddr)-1] = 0;
+    StatsWorkerConn(++nWorkerConn);
+    WorkerPark(pNew);
+    if( pIdleLast==pNew ){
+      /* Moving does not make the connection any less idle.  Entries in
+      ** the parked list may then be slightly out of order, which only
+      ** delays closing the later ones until the head has expired. */
+      pNew->tIdle = h.tIdle;
+    }
   }
-  fclose(in);
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
-  rc = getaddrinfo(zHost,zPort,&hints,&ai);
-  if( rc ){
-    Malfunction(704, "cannot resolve SCGI server name %s:%s\n%s\n",
-                zHost, zPort, gai_strerror(rc));
+}
+
+/*
+** The main loop of a long-lived worker process on Linux.  This routine
+** never returns.  The worker exits if its supervisor goes away.
+*/
+static void WorkerLoop(void){
+  struct epoll_event aEv[64];
+  WorkerConn *pConn;
+  int i, n;
+  time_t now;
+
+  WorkerDetach();
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if( epollFd<0 ) exit(1);
+  for(i=0; i<nListener; i++){
+    struct epoll_event ev;
+    pConn = calloc(1, sizeof(*pConn));
+    if( pConn==0 ) exit(1);
+    pConn->fd = aListener[i];
+    pConn->isListener = 1;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    if( !reusePort ) ev.events |= EPOLLEXCLUSIVE;
+#endif
+    ev.data.ptr = pConn;
+    if( epoll_ctl(epollFd, EPOLL_CTL_ADD, pConn->fd, &ev) ) exit(1);
   }
-  while(1){  /* Exit via break */
-    for(p=ai; p; p=p->ai_next){
-      iSocket = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-      if( iSocket<0 ) continue;
-      if( connect(iSocket,p->ai_addr,p->ai_addrlen)>=0 ) break;
-      close(iSocket);
+  if( fdHandoff[1]>=0 ){
+    struct epoll_event ev;
+    pConn = calloc(1, sizeof(*pConn));
+    if( pConn==0 ) exit(1);
+    pConn->fd = fdHandoff[1];
+    pConn->isQueue = 1;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    ev.events |= EPOLLEXCLUSIVE;
+#endif
+    ev.data.ptr = pConn;
+    if( epoll_ctl(epollFd, EPOLL_CTL_ADD, pConn->fd, &ev) ) exit(1);
+  }
+  while( 1 ){
+    n = epoll_wait(epollFd, aEv, sizeof(aEv)/sizeof(aEv[0]), 1000);
+    if( getppid()!=supervisor ) exit(0);
+    if( WorkerCpuSpent() ){
+      LogFlush();
+      exit(0);
     }
-    if( iSocket<0 || (s = fdopen(iSocket,"r+"))==0 ){
-      if( iSocket>=0 ) close(iSocket);
-      if( zRelight ){
-        rc = system(zRelight);
-        if( rc ){
-          Malfunction(721,"Relight failed with %d: \"%s\"\n",
-                      rc, zRelight);
+
+    /* Close connections that have been idle for too long */
+    time(&now);
+    LogFlushIfOld(now);
+    while( (pConn = pIdleFirst)!=0
+        && now - pConn->tIdle >= keepAliveTimeout ){
+      WorkerUnpark(pConn);
+      WorkerClose(pConn);
+    }
+
+    for(i=0; i<n; i++){
+      pConn = (WorkerConn*)aEv[i].data.ptr;
+      if( pConn->fd<0 ) continue;   /* Handed off to another worker */
+      if( pConn->isListener ){
+        /* New connections wait in the epoll set until they send data */
+        int fd;
+        while( (fd = accept4(pConn->fd, 0, 0, SOCK_CLOEXEC))>=0 ){
+          WorkerConn *pNew = calloc(1, sizeof(*pNew));
+          if( pNew==0 ){
+            close(fd);
+            continue;
+          }
+          pNew->fd = fd;
+          pNew->tBegin = now;
+          pNew->tWait = now;
+          STATS_ADD(nConn, 1);
+          StatsWorkerConn(++nWorkerConn);
+          GetRemoteAddr(fd, pNew->zAddr, sizeof(pNew->zAddr));
+          WorkerPark(pNew);
         }
-        free(zRelight);
-        zRelight = 0;
-        sleep(1);
-        continue;
+      }else if( pConn->isQueue ){
+        WorkerReceive();
+      }else{
+        WorkerServe(pConn);
       }
-      if( zFallback ){
-        struct stat statbuf;
-        int rc;
-        memset(&statbuf, 0, sizeof(statbuf));
-        if( chdir(zDir) ){
-          char zBuf[1000];
-          Malfunction(720, /* LOG: chdir() failed */
-               "cannot chdir to [%s] from [%s]", 
-               zDir, getcwd(zBuf,999));
-        }
-        rc = stat(zFallback, &statbuf);
-        if( rc==0 && S_ISREG(statbuf.st_mode) && access(zFallback,R_OK)==0 ){
-          closeConnection = 1;
-          rc = SendFile(zFallback, (int)strlen(zFallback), &statbuf);
-          free(zFallback);
-          exit(0);
-        }else{
-          Malfunction(706, "bad fallback file: \"%s\"\n", zFallback);
-        }
+    }
+    while( (pConn = pReleased)!=0 ){
+      pReleased = pConn->pNext;
+      free(pConn);
+    }
+  }
+}
+#else /* !__linux__ */
+/*
+** Wait for the next connection on any of the listening sockets of a
+** long-lived worker, then process all requests on that connection the
+** same as a forked child would.  The connection ends either by a
+** return from this routine or by a siglongjmp() from althttpd_exit().
+*/
+static void WorkerConnection(void){
+  static char zAddr[64];     /* Remote IP address */
+  fd_set readfds;
+  int i;
+  int maxFd = -1;
+  int connection = -1;
+
+  while( connection<0 ){
+    FD_ZERO(&readfds);
+    for(i=0; i<nListener; i++){
+      FD_SET(aListener[i], &readfds);
+      if( aListener[i]>maxFd ) maxFd = aListener[i];
+    }
+    LogFlush();
+    if( select(maxFd+1, &readfds, 0, 0, 0)<=0 ) continue;
+    for(i=0; connection<0 && i<nListener; i++){
+      if( FD_ISSET(aListener[i], &readfds) ){
+        connection = accept(aListener[i], 0, 0);
+        if( connection>=0 ) fcntl(connection, F_SETFD, FD_CLOEXEC);
       }
-      Malfunction(707, "cannot open socket to SCGI server %s\n",
-                  zScript);
     }
-    break;
   }
+  WorkerAttach(connection);
+  close(connection);
+  STATS_ADD(nConn, 1);
+  StatsWorkerConn(1);
+  sStdIn.n = sStdIn.iRd = 0;
+  sStdIn.nBody = 0;
+  sStdIn.inHeader = 0;
+  nRequest = 0;
+  time(&connBegin);
+  GetRemoteAddr(0, zAddr, sizeof(zAddr));
+  zRemoteAddr = zAddr;
+  do{
+    i = ConnectionDone();
+    ProcessOneRequest(i);
+  }while( !i );
+}
 
-  nHdrAlloc = 0;
-  zHdr = 0;
-  if( zContentLength==0 ) zContentLength = "0";
-  zScgi = "1";
-  for(i=0; i<(int)(sizeof(cgienv)/sizeof(cgienv[0])); i++){
-    int n1, n2;
-    if( cgienv[i].pzEnvValue[0]==0 ) continue;
-    n1 = (int)strlen(cgienv[i].zEnvName);
-    n2 = (int)strlen(*cgienv[i].pzEnvValue);
-    if( n1+n2+2+nHdr >= nHdrAlloc ){
-      nHdrAlloc = nHdr + n1 + n2 + 1000;
-      zHdr = realloc(zHdr, nHdrAlloc);
-      if( zHdr==0 ){
-        Malfunction(706, "out of memory");
+/*
+** The main loop of a long-lived worker process.  Serve one connection
+** after another, cleaning up after each.  This routine never returns.
+** The worker exits if its supervisor goes away.
+*/
+static void WorkerLoop(void){
+  WorkerDetach();
+  while( getppid()==supervisor && !WorkerCpuSpent() ){
+    if( sigsetjmp(workerEnd, 1)==0 ){
+      WorkerConnection();
+    }
+    WorkerDetach();
+    StatsWorkerConn(0);
+  }
+  exit(0);
+}
+#endif /* !__linux__ */
+
+
+
+#ifdef ALTHTTPD_BENCH
+/*
+** Microbenchmarks for code that runs on every request.  Compile with
+** -DALTHTTPD_BENCH and run with the "--bench N" command-line option to
+** time N iterations of each and report the average cost per operation.
+** The "--bench-fuzz N" option checks the per-request helper functions
+** against reference versions on N random inputs each.
+*/
+static const char zBenchRequest[] =
+  "GET /src/timeline?n=50&y=ci HTTP/1.1\r\n"
+  "Host: www.sqlite.org\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:95.0) Gecko/20100101 "
+      "Firefox/95.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+      "image/avif,image/webp,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Referer: https://www.sqlite.org/src/info/5c3a0a5a8e7f2b1d\r\n"
+  "DNT: 1\r\n"
+  "Connection: keep-alive\r\n"
+  "Cookie: fossil-5c3a0a5a8e7f2b1d=ABCDEF0123456789%2F1640000000\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "Sec-Fetch-Dest: document\r\n"
+  "Sec-Fetch-Mode: navigate\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "Sec-Fetch-User: ?1\r\n"
+  "If-None-Match: \"m61c8a5a1s3b1f\"\r\n"
+  "If-Modified-Since: Sun, 26 Dec 2021 18:00:01 GMT\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "\r\n";
+
+/* Names of the request header fields that ProcessOneRequest() uses */
+static const char *azBenchField[] = {
+  "User-Agent", "Accept", "Accept-Encoding", "Content-length",
+  "Content-type", "Referer", "Cookie", "Connection", "Host",
+  "Authorization", "If-None-Match", "If-Modified-Since", "Range",
+};
+
+/*
+** Return the current time in nanoseconds.
+*/
+static long long BenchNow(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*(long long)1000000000 + ts.tv_nsec;
+}
+
+/*
+** Parse zBenchRequest one line at a time using fgets(), GetFirstElement()
+** and a malloc() for each value, the way ProcessOneRequest() used to.
+*/
+static int BenchFgetsParse(FILE *in){
+  char zLine[1000];
+  char *z;
+  char *azVal[20];
+  int nVal = 0;
+  int i;
+  size_t k;
+  rewind(in);
+  if( fgets(zLine, sizeof(zLine), in)==0 ) return 0;
+  azVal[nVal++] = strdup(GetFirstElement(zLine, &z));
+  azVal[nVal++] = strdup(GetFirstElement(z, &z));
+  azVal[nVal++] = strdup(GetFirstElement(z, &z));
+  while( fgets(zLine, sizeof(zLine), in) ){
+    char *zFieldName = GetFirstElement(zLine, &z);
+    if( zFieldName==0 || *zFieldName==0 ) break;
+    RemoveNewline(z);
+    for(k=0; k<sizeof(azBenchField)/sizeof(azBenchField[0]); k++){
+      size_t n = strlen(azBenchField[k]);
+      if( strncasecmp(zFieldName, azBenchField[k], n)==0
+       && zFieldName[n]==':' && zFieldName[n+1]==0 ){
+        if( nVal<20 ) azVal[nVal++] = strdup(z);
+        break;
       }
     }
-    memcpy(zHdr+nHdr, cgienv[i].zEnvName, n1);
-    nHdr += n1;
-    zHdr[nHdr++] = 0;
-    memcpy(zHdr+nHdr, *cgienv[i].pzEnvValue, n2);
-    nHdr += n2;
-    zHdr[nHdr++] = 0;
   }
-  zScgi = 0;
-  fprintf(s,"%d:",(int)nHdr);
-  fwrite(zHdr, 1, nHdr, s);
-  fprintf(s,",");
-  free(zHdr);
-  if( zMethod[0]=='P'
-   && atoi(zContentLength)>0 
-   && (in = fopen(zTmpNam,"r"))!=0 ){
-    size_t n;
-    while( (n = fread(zLine,1,sizeof(zLine),in))>0 ){
-      fwrite(zLine, 1, n, s);
+  for(i=0; i<nVal; i++) free(azVal[i]);
+  return nVal;
+}
+
+/*
+** Parse zBenchRequest in place using HttpInputParse().
+*/
+static int BenchBufferParse(HttpInput *p){
+  char *z;
+  int i, nVal = 0;
+  p->n = p->iRd = 0;
+  HttpInputBegin(p);
+  memcpy(p->a, zBenchRequest, sizeof(zBenchRequest)-1);
+  p->n = sizeof(zBenchRequest)-1;
+  if( HttpInputParse(p)!=1 ) return 0;
+  z = &p->a[p->iReq];
+  z[p->nReq] = 0;
+  if( GetFirstElement(z, &z) ) nVal++;
+  if( GetFirstElement(z, &z) ) nVal++;
+  if( GetFirstElement(z, &z) ) nVal++;
+  for(i=0; i<p->nField; i++){
+    HttpField *pF = &p->aField[i];
+    p->a[pF->iName+pF->nName] = 0;
+    p->a[pF->iVal+pF->nVal] = 0;
+    if( HttpFieldCode(&p->a[pF->iName], pF->nName)!=HDR_UNKNOWN ) nVal++;
+  }
+  return nVal;
+}
+
+/*
+** Match every header field name of zBenchRequest against azBenchField[]
+** using a chain of strcasecmp() calls, or using HttpFieldCode() if
+** useSwitch is true.  The request must already be parsed into p.
+*/
+static int BenchFieldDispatch(HttpInput *p, int useSwitch){
+  int i, nVal = 0;
+  size_t k;
+  for(i=0; i<p->nField; i++){
+    HttpField *pF = &p->aField[i];
+    const char *zName = &p->a[pF->iName];
+    if( useSwitch ){
+      if( HttpFieldCode(zName, pF->nName)!=HDR_UNKNOWN ) nVal++;
+    }else{
+      for(k=0; k<sizeof(azBenchField)/sizeof(azBenchField[0]); k++){
+        if( strcasecmp(zName, azBenchField[k])==0 ){
+          nVal++;
+          break;
+        }
+      }
     }
-    fclose(in);
   }
-  fflush(s);
-  CgiHandleReply(s);
+  return nVal;
 }
 
 /*
-** This routine processes a single HTTP request on standard input and
-** sends the reply to standard output.  If the argument is 1 it means
-** that we are should close the socket without processing additional
-** HTTP requests after the current request finishes.  0 means we are
-** allowed to keep the connection open and to process additional requests.
-** This routine may choose to close the connection even if the argument
-** is 0.
-** 
-** If the connection should be closed, this routine calls exit() and
-** thus never returns.  If this routine does return it means that another
-** HTTP request may appear on the wire.
+** Realistic inputs for the per-request helper functions.
 */
-void ProcessOneRequest(int forceClose){
-  int i, j, j0;
-  char *z;                  /* Used to parse up a string */
-  struct stat statbuf;      /* Information about the file to be retrieved */
-  FILE *in;                 /* For reading from CGI scripts */
-#ifdef LOG_HEADER
-  FILE *hdrLog = 0;         /* Log file for complete header content */
-#endif
-  char zLine[1000];         /* A buffer for input lines or forming names */
+static const char *azBenchName[] = {
+  "/index.html", "/style.css", "/js/app.js", "/img/logo.png",
+  "/photos/IMG_0042.JPG", "/dl/sqlite-src-3380000.zip", "/README",
+  "/doc/trunk/www/index.wiki", "/favicon.ico", "/robots.txt",
+};
+static const char *azBenchPath[] = {
+  "/src/timeline", "/doc/trunk/www/index.wiki", "/forum/forumpost/5c3a0a5a8e",
+  "/a%20b/c%2Fd.html", "/cgi-bin/search.cgi", "/~drh/notes.txt",
+};
+static const char *azBenchDate[] = {
+  "Sun, 26 Dec 2021 18:00:01 GMT", "Tue, 01 Mar 2022 09:15:42 GMT",
+  "Thu, 29 Feb 2024 23:59:59 GMT", "Mon, 04 Jan 1999 00:00:00 GMT",
+};
+static const char *azBenchEtag[] = {
+  "\"m61c8a5a1s3b1f\"", "m61c8a5a1s3b1f", "\"m61c8a5a1s3b20\"", "*",
+};
+static const char *azBenchEscape[] = {
+  "Mozilla/5.0 (X11; Linux x86_64; rv:95.0) Gecko/20100101 Firefox/95.0",
+  "curl/7.81.0", "/search?q=\"exact phrase\"", "https://www.sqlite.org/",
+};
+static const char *azBenchLine[] = {
+  "GET /src/timeline?n=50&y=ci HTTP/1.1",
+  "  POST   /cgi-bin/form.cgi   HTTP/1.0  ",
+  "Basic dXNlcjpwYXNzd29yZA==",
+};
+static const char *azBenchBase64[] = {
+  "dXNlcjpwYXNzd29yZA==", "YWRtaW46c2VjcmV0", "Zm9zc2lsOmE=",
+  "bG9uZy11c2VyLW5hbWVAZXhhbXBsZS5jb206Y29ycmVjdCBob3JzZSBiYXR0ZXJ5",
+};
+#define BENCH_COUNT(A) ((int)(sizeof(A)/sizeof(A[0])))
 
-  /* Change directories to the root of the HTTP filesystem
-  */
-  if( chdir(zRoot[0] ? zRoot : "/")!=0 ){
-    char zBuf[1000];
-    Malfunction(190,   /* LOG: chdir() failed */
-         "cannot chdir to [%s] from [%s]",
-         zRoot, getcwd(zBuf,999));
+/*
+** Run each of the per-request helper functions N times on the inputs
+** above and print the average cost per call.  Functions that change
+** their input work on a fresh copy each time, and the copy is part of
+** the cost.
+*/
+static void BenchHelpers(int N){
+  static char zBuf[200];
+  long long t0, t1;
+  int i, x = 0;
+  time_t t = 0;
+  size_t nLen[20];
+
+  for(i=0; i<BENCH_COUNT(azBenchName); i++) nLen[i] = strlen(azBenchName[i]);
+  t0 = BenchNow();
+  for(i=0; i<N; i++){
+    int j = i%BENCH_COUNT(azBenchName);
+    x += GetMimeType(azBenchName[j], (int)nLen[j])[0];
   }
-  nRequest++;
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "GetMimeType", (t1-t0)/(double)N);
 
-  /*
-  ** We must receive a complete header within 15 seconds
-  */
-  signal(SIGALRM, Timeout);
-  signal(SIGSEGV, Timeout);
-  signal(SIGPIPE, Timeout);
-  signal(SIGXCPU, Timeout);
-  if( useTimeout ) alarm(15);
+  t0 = BenchNow();
+  for(i=0; i<N; i++){
+    const char *z = azBenchPath[i%BENCH_COUNT(azBenchPath)];
+    strcpy(zBuf, z);
+    x += sanitizeString(zBuf);
+  }
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "sanitizeString", (t1-t0)/(double)N);
 
-  /* Get the first line of the request and parse out the
-  ** method, the script and the protocol.
-  */
-  if( fgets(zLine,sizeof(zLine),stdin)==0 ){
-    exit(0);
+  t0 = BenchNow();
+  for(i=0; i<N; i++){
+    t += ParseRfc822Date(azBenchDate[i%BENCH_COUNT(azBenchDate)]);
   }
-  gettimeofday(&beginTime, 0);
-  omitLog = 0;
-  nIn += strlen(zLine);
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "ParseRfc822Date", (t1-t0)/(double)N);
 
-  /* Parse the first line of the HTTP request */
-  zMethod = StrDup(GetFirstElement(zLine,&z));
-  zRealScript = zScript = StrDup(GetFirstElement(z,&z));
-  zProtocol = StrDup(GetFirstElement(z,&z));
-  if( zProtocol==0 || strncmp(zProtocol,"HTTP/",5)!=0 || strlen(zProtocol)!=8 ){
-    StartResponse("400 Bad Request");
-    nOut += printf(
-      "Content-type: text/plain; charset=utf-8\r\n"
-      "\r\n"
-      "This server does not understand the requested protocol\n"
-    );
-    MakeLogEntry(0, 200); /* LOG: bad protocol in HTTP header */
-    exit(0);
+  t0 = BenchNow();
+  for(i=0; i<N; i++){
+    x += Rfc822Date(1640541601 + (time_t)i*7919)[5];
+  }
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "Rfc822Date", (t1-t0)/(double)N);
+
+  t0 = BenchNow();
+  for(i=0; i<N; i++){
+    x += CompareEtags(azBenchEtag[i%BENCH_COUNT(azBenchEtag)],
+                      "m61c8a5a1s3b1f")==0;
   }
-  if( zScript[0]!='/' ) NotFound(210); /* LOG: Empty request URI */
-  while( zScript[1]=='/' ){
-    zScript++;
-    zRealScript++;
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "CompareEtags", (t1-t0)/(double)N);
+
+  t0 = BenchNow();
+  for(i=0; i<N; i++){
+    x += Escape((char*)azBenchEscape[i%BENCH_COUNT(azBenchEscape)])[0];
+    ArenaReset();
   }
-  if( forceClose ){
-    closeConnection = 1;
-  }else if( zProtocol[5]<'1' || zProtocol[7]<'1' ){
-    closeConnection = 1;
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "Escape", (t1-t0)/(double)N);
+
+  t0 = BenchNow();
+  for(i=0; i<N; i++){
+    char *zRest;
+    strcpy(zBuf, azBenchLine[i%BENCH_COUNT(azBenchLine)]);
+    x += GetFirstElement(zBuf, &zRest)[0];
+    x += GetFirstElement(zRest, &zRest)[0];
   }
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "GetFirstElement x2", (t1-t0)/(double)N);
 
-  /* This very simple server only understands the GET, POST
-  ** and HEAD methods
-  */
-  if( strcmp(zMethod,"GET")!=0 && strcmp(zMethod,"POST")!=0
-       && strcmp(zMethod,"HEAD")!=0 ){
-    StartResponse("501 Not Implemented");
-    nOut += printf(
-      "Content-type: text/plain; charset=utf-8\r\n"
-      "\r\n"
-      "The %s method is not implemented on this server.\n",
-      zMethod);
-    MakeLogEntry(0, 220); /* LOG: Unknown request method */
-    exit(0);
+  t0 = BenchNow();
+  for(i=0; i<N; i++){
+    strcpy(zBuf, azBenchBase64[i%BENCH_COUNT(azBenchBase64)]);
+    Decode64(zBuf);
+    x += zBuf[0];
   }
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "Decode64", (t1-t0)/(double)N);
+  if( x==0 && t==0 ) printf("nothing computed\n");
+}
 
-  /* If there is a log file (if zLogFile!=0) and if the pathname in
-  ** the first line of the http request contains the magic string
-  ** "FullHeaderLog" then write the complete header text into the
-  ** file %s(zLogFile)-hdr.  Overwrite the file.  This is for protocol
-  ** debugging only and is only enabled if althttpd is compiled with
-  ** the -DLOG_HEADER=1 option.
-  */
-#ifdef LOG_HEADER
-  if( zLogFile
-   && strstr(zScript,"FullHeaderLog")!=0
-   && strlen(zLogFile)<sizeof(zLine)-50
-  ){
-    sprintf(zLine, "%s-hdr", zLogFile);
-    hdrLog = fopen(zLine, "wb");
+/*
+** Reference versions of the per-request helper functions, used by
+** --bench-fuzz.  Each is written for clarity rather than speed.  When
+** one of the real functions is rewritten, BenchFuzz() shows whether the
+** new code still gives the same answers.
+*/
+static const char *BenchRefMimeType(const char *zName, int nName){
+  char zSuffix[20];
+  int i, j;
+  for(i=nName-1; i>0 && zName[i]!='.'; i--){}
+  if( nName-i>=(int)sizeof(zSuffix)-1 ) return "application/octet-stream";
+  for(j=0; zName[i+1+j]; j++){
+    zSuffix[j] = tolower((unsigned char)zName[i+1+j]);
   }
-#endif
+  zSuffix[j] = 0;
+  for(j=0; j<BENCH_COUNT(aMime); j++){
+    if( strcmp(zSuffix, aMime[j].zSuffix)==0 ) return aMime[j].zMimetype;
+  }
+  return "application/octet-stream";
+}
+static int BenchRefSanitize(const char *zIn, char *zOut){
+  int nChange = 0;
+  while( *zIn ){
+    if( allowedInName[*(unsigned char*)zIn] ){
+      *(zOut++) = *(zIn++);
+      continue;
+    }
+    if( zIn[0]=='%' && zIn[1]!=0 && zIn[2]!=0 ) zIn += 2;
+    *(zOut++) = '_';
+    zIn++;
+    nChange++;
+  }
+  *zOut = 0;
+  return nChange;
+}
+static time_t BenchRefParseDate(const char *zDate){
+  static const char zMonths[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char zIgnore[4], zMonth[4];
+  struct tm tm;
+  int i;
+  memset(&tm, 0, sizeof(tm));
+  if( sscanf(zDate, "%3[A-Za-z], %d %3[A-Za-z] %d %d:%d:%d", zIgnore,
+             &tm.tm_mday, zMonth, &tm.tm_year, &tm.tm_hour, &tm.tm_min,
+             &tm.tm_sec)!=7 ){
+    return 0;
+  }
+  for(i=0; i<12 && memcmp(&zMonths[i*3], zMonth, 3)!=0; i++){}
+  if( i>=12 || strlen(zMonth)!=3 ) return 0;
+  tm.tm_mon = i;
+  if( tm.tm_year>1900 ) tm.tm_year -= 1900;
+  return timegm(&tm);
+}
+static void BenchRefDate(time_t t, char *zOut){
+  static const char zDays[] = "SunMonTueWedThuFriSat";
+  static const char zMonths[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  sprintf(zOut, "%.3s, %02d %.3s %d %02d:%02d:%02d GMT",
+          &zDays[tm.tm_wday*3], tm.tm_mday, &zMonths[tm.tm_mon*3],
+          tm.tm_year+1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+static int BenchRefEtagsMatch(const char *zA, const char *zB){
+  size_t n = strlen(zB);
+  if( zA==0 ) return 0;
+  if( strcmp(zA, zB)==0 ) return 1;
+  return zA[0]=='"' && strncmp(zA+1, zB, n)==0 && zA[n+1]=='"';
+}
+static void BenchRefEscape(const char *zIn, char *zOut){
+  while( *zIn ){
+    if( *zIn=='"' ) *(zOut++) = '"';
+    *(zOut++) = *(zIn++);
+  }
+  *zOut = 0;
+}
+static int BenchRefFirstElement(const char *zIn, char *zTok){
+  int i = 0, j = 0;
+  while( isspace((unsigned char)zIn[i]) ) i++;
+  while( zIn[i] && !isspace((unsigned char)zIn[i]) ) zTok[j++] = zIn[i++];
+  zTok[j] = 0;
+  while( isspace((unsigned char)zIn[i]) ) i++;
+  return i;
+}
+static int BenchRefDecode64(const char *zIn, unsigned char *aOut){
+  static const char zBase[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int n = (int)strlen(zIn), i, nBit = 0, nOut = 0;
+  unsigned int acc = 0;
+  while( n>0 && zIn[n-1]=='=' ) n--;
+  for(i=0; i<n; i++){
+    const char *p = strchr(zBase, zIn[i] & 0x7f);
+    acc = (acc<<6) | (p && *p ? (unsigned)(p - zBase) : 0);
+    nBit += 6;
+    if( nBit>=8 ){
+      nBit -= 8;
+      aOut[nOut++] = (unsigned char)(acc>>nBit);
+    }
+  }
+  return nOut;
+}
 
+/*
+** A pseudo-random number generator for BenchFuzz()
+*/
+static unsigned int BenchRandom(void){
+  static unsigned int x = 0x2545f491;
+  x ^= x<<13;
+  x ^= x>>17;
+  x ^= x<<5;
+  return x;
+}
 
-  /* Get all the optional fields that follow the first line.
-  */
-  zCookie = 0;
-  zAuthType = 0;
-  zRemoteUser = 0;
-  zReferer = 0;
-  zIfNoneMatch = 0;
-  zIfModifiedSince = 0;
-  rangeEnd = 0;
-  while( fgets(zLine,sizeof(zLine),stdin) ){
-    char *zFieldName;
-    char *zVal;
+/*
+** Fill z[] with a random string of up to nMax bytes that mixes the
+** characters in zAlphabet with occasional arbitrary bytes.
+*/
+static int BenchRandomString(char *z, int nMax, const char *zAlphabet){
+  int n = BenchRandom()%(nMax+1), i;
+  int nAlpha = (int)strlen(zAlphabet);
+  for(i=0; i<n; i++){
+    if( BenchRandom()%16==0 ){
+      z[i] = (char)(1 + BenchRandom()%255);
+    }else{
+      z[i] = zAlphabet[BenchRandom()%nAlpha];
+    }
+  }
+  z[n] = 0;
+  return n;
+}
 
-#ifdef LOG_HEADER
-    if( hdrLog ) fprintf(hdrLog, "%s", zLine);
-#endif
-    nIn += strlen(zLine);
-    zFieldName = GetFirstElement(zLine,&zVal);
-    if( zFieldName==0 || *zFieldName==0 ) break;
-    RemoveNewline(zVal);
-    if( strcasecmp(zFieldName,"User-Agent:")==0 ){
-      zAgent = StrDup(zVal);
-    }else if( strcasecmp(zFieldName,"Accept:")==0 ){
-      zAccept = StrDup(zVal);
-    }else if( strcasecmp(zFieldName,"Accept-Encoding:")==0 ){
-      zAcceptEncoding = StrDup(zVal);
-    }else if( strcasecmp(zFieldName,"Content-length:")==0 ){
-      zContentLength = StrDup(zVal);
-    }else if( strcasecmp(zFieldName,"Content-type:")==0 ){
-      zContentType = StrDup(zVal);
-    }else if( strcasecmp(zFieldName,"Referer:")==0 ){
-      zReferer = StrDup(zVal);
-      if( strstr(zVal, "devids.net/")!=0 ){ zReferer = "devids.net.smut";
-        Forbidden(230); /* LOG: Referrer is devids.net */
-      }
-    }else if( strcasecmp(zFieldName,"Cookie:")==0 ){
-      zCookie = StrAppend(zCookie,"; ",zVal);
-    }else if( strcasecmp(zFieldName,"Connection:")==0 ){
-      if( strcasecmp(zVal,"close")==0 ){
-        closeConnection = 1;
-      }else if( !forceClose && strcasecmp(zVal, "keep-alive")==0 ){
-        closeConnection = 0;
-      }
-    }else if( strcasecmp(zFieldName,"Host:")==0 ){
-      int inSquare = 0;
-      char c;
-      if( sanitizeString(zVal) ){
-        Forbidden(240);  /* LOG: Illegal content in HOST: parameter */
-      }
-      zHttpHost = StrDup(zVal);
-      zServerPort = zServerName = StrDup(zHttpHost);
-      while( zServerPort && (c = *zServerPort)!=0
-              && (c!=':' || inSquare) ){
-        if( c=='[' ) inSquare = 1;
-        if( c==']' ) inSquare = 0;
-        zServerPort++;
-      }
-      if( zServerPort && *zServerPort ){
-        *zServerPort = 0;
-        zServerPort++;
-      }
-      if( zRealPort ){
-        zServerPort = StrDup(zRealPort);
-      }
-    }else if( strcasecmp(zFieldName,"Authorization:")==0 ){
-      zAuthType = GetFirstElement(StrDup(zVal), &zAuthArg);
-    }else if( strcasecmp(zFieldName,"If-None-Match:")==0 ){
-      zIfNoneMatch = StrDup(zVal);
-    }else if( strcasecmp(zFieldName,"If-Modified-Since:")==0 ){
-      zIfModifiedSince = StrDup(zVal);
-    }else if( strcasecmp(zFieldName,"Range:")==0
-           && strcmp(zMethod,"GET")==0 ){
-      int x1 = 0, x2 = 0;
-      int n = sscanf(zVal, "bytes=%d-%d", &x1, &x2);
-      if( n==2 && x1>=0 && x2>=x1 ){
-        rangeStart = x1;
-        rangeEnd = x2;
-      }else if( n==1 && x1>0 ){
-        rangeStart = x1;
-        rangeEnd = 0x7fffffff;
-      }
+/*
+** Report a difference found by BenchFuzz()
+*/
+static int BenchFuzzFail(const char *zFunc, const char *zInput){
+  int i;
+  printf("%-20s MISMATCH on input \"", zFunc);
+  for(i=0; zInput[i]; i++){
+    unsigned char c = (unsigned char)zInput[i];
+    if( c>=0x20 && c<0x7f && c!='"' && c!='\\' ){
+      putchar(c);
+    }else{
+      printf("\\x%02x", c);
     }
   }
-#ifdef LOG_HEADER
-  if( hdrLog ) fclose(hdrLog);
-#endif
+  printf("\"\n");
+  return 1;
+}
 
-  /* Disallow requests from certain clients */
-  if( zAgent ){
-    const char *azDisallow[] = {
-      "Windows 9",
-      "Download Master",
-      "Ezooms/",
-      "HTTrace",
-      "AhrefsBot",
-      "MicroMessenger",
-      "OPPO A33 Build",
-      "SemrushBot",
-      "MegaIndex.ru",
-      "MJ12bot",
-      "Chrome/0.A.B.C",
-      "Neevabot/",
-      "BLEXBot/",
-    };
-    size_t ii;
-    for(ii=0; ii<sizeof(azDisallow)/sizeof(azDisallow[0]); ii++){
-      if( strstr(zAgent,azDisallow[ii])!=0 ){
-        Forbidden(250);  /* LOG: Disallowed user agent */
+/*
+** Implementation of the --bench-fuzz N command-line option.  Run each
+** per-request helper function and its reference version on N random
+** inputs and report any difference.  Return the number of functions
+** that failed.
+*/
+static int BenchFuzz(int N){
+  static char zIn[300], zA[700], zB[700];
+  int i, j, n, nFail = 0, bad;
+
+  if( N<=0 ) N = 100000;
+
+  /* GetMimeType(): every suffix in the table, then random names built
+  ** from real suffixes in mixed case */
+  for(i=bad=0; i<N+BENCH_COUNT(aMime) && !bad; i++){
+    if( i<BENCH_COUNT(aMime) ){
+      n = sprintf(zIn, "x.%s", aMime[i].zSuffix);
+    }else{
+      const char *zSfx = aMime[BenchRandom()%BENCH_COUNT(aMime)].zSuffix;
+      n = BenchRandomString(zIn, 8, "ab./");
+      n += sprintf(zIn+n, "%s%s", BenchRandom()%4 ? "." : "", zSfx);
+      for(j=0; j<n; j++){
+        if( BenchRandom()%3==0 ) zIn[j] = toupper((unsigned char)zIn[j]);
       }
+      if( BenchRandom()%4==0 ) n += BenchRandomString(zIn+n, 20, "az9.");
     }
-#if 0
-    /* Spider attack from 2019-04-24 */
-    if( strcmp(zAgent,
-            "Mozilla/5.0 (Windows NT 10.0; WOW64) AppleWebKit/537.36 "
-            "(KHTML, like Gecko) Chrome/50.0.2661.102 Safari/537.36")==0 ){
-      Forbidden(251);  /* LOG: Disallowed user agent (20190424) */
+    if( strcmp(GetMimeType(zIn, n), BenchRefMimeType(zIn, n))!=0 ){
+      bad = BenchFuzzFail("GetMimeType", zIn);
     }
-#endif
   }
-#if 0
-  if( zReferer ){
-    static const char *azDisallow[] = {
-      "skidrowcrack.com",
-      "hoshiyuugi.tistory.com",
-      "skidrowgames.net",
-    };
-    int i;
-    for(i=0; i<sizeof(azDisallow)/sizeof(azDisallow[0]); i++){
-      if( strstr(zReferer, azDisallow[i])!=0 ){
-        NotFound(260);  /* LOG: Disallowed referrer */
-      }
+  if( !bad ) printf("%-20s ok\n", "GetMimeType");
+  nFail += bad;
+
+  /* sanitizeString() */
+  for(i=bad=0; i<N && !bad; i++){
+    BenchRandomString(zIn, 60, "abcXYZ019-_./~% ?&=\"'<>");
+    strcpy(zA, zIn);
+    if( sanitizeString(zA)!=BenchRefSanitize(zIn, zB) || strcmp(zA, zB) ){
+      bad = BenchFuzzFail("sanitizeString", zIn);
     }
   }
-#endif
+  if( !bad ) printf("%-20s ok\n", "sanitizeString");
+  nFail += bad;
 
-  /* Make an extra effort to get a valid server name and port number.
-  ** Only Netscape provides this information.  If the browser is
-  ** Internet Explorer, then we have to find out the information for
-  ** ourselves.
-  */
-  if( zServerName==0 ){
-    zServerName = SafeMalloc( 100 );
-    gethostname(zServerName,100);
+  /* Rfc822Date() on times from 1970 through 9999 */
+  for(i=bad=0; i<N && !bad; i++){
+    time_t t = ((time_t)BenchRandom()<<16 ^ BenchRandom())%253402300800LL;
+    BenchRefDate(t, zB);
+    if( strcmp(Rfc822Date(t), zB)!=0 ) bad = BenchFuzzFail("Rfc822Date", zB);
   }
-  if( zServerPort==0 || *zServerPort==0 ){
-    zServerPort = DEFAULT_PORT;
+  if( !bad ) printf("%-20s ok\n", "Rfc822Date");
+  nFail += bad;
+
+  /* ParseRfc822Date() on dates with and without one character changed.
+  ** Any two results of zero or less both mean "no date" */
+  for(i=bad=0; i<N && !bad; i++){
+    time_t t = ((time_t)BenchRandom()<<16 ^ BenchRandom())%253402300800LL;
+    time_t tA, tB;
+    BenchRefDate(t, zIn);
+    if( i%2 ){
+      zIn[BenchRandom()%strlen(zIn)] = "0123456789 :,JanGMTx"[BenchRandom()%20];
+    }
+    tA = ParseRfc822Date(zIn);
+    tB = BenchRefParseDate(zIn);
+    if( tA!=tB && (tA>0 || tB>0) ){
+      bad = BenchFuzzFail("ParseRfc822Date", zIn);
+    }
   }
+  if( !bad ) printf("%-20s ok\n", "ParseRfc822Date");
+  nFail += bad;
 
-  /* Remove the query string from the end of the requested file.
-  */
-  for(z=zScript; *z && *z!='?'; z++){}
-  if( *z=='?' ){
-    zQuerySuffix = StrDup(z);
-    *z = 0;
-  }else{
-    zQuerySuffix = "";
+  /* CompareEtags() */
+  for(i=bad=0; i<N && !bad; i++){
+    char zTag[16], zTail[8];
+    BenchRandomString(zTag, 12, "m61c\"");
+    BenchRandomString(zTail, 3, "\"x");
+    switch( BenchRandom()%4 ){
+      case 0:  snprintf(zIn, sizeof(zIn), "%s", zTag);             break;
+      case 1:  snprintf(zIn, sizeof(zIn), "\"%s\"", zTag);         break;
+      case 2:  BenchRandomString(zIn, 14, "m61c\"");              break;
+      default: snprintf(zIn, sizeof(zIn), "\"%s%s", zTag, zTail);  break;
+    }
+    if( (CompareEtags(zIn, zTag)==0)!=BenchRefEtagsMatch(zIn, zTag)
+     || CompareEtags(0, zTag)==0
+    ){
+      bad = BenchFuzzFail("CompareEtags", zIn);
+    }
   }
-  zQueryString = *zQuerySuffix ? &zQuerySuffix[1] : zQuerySuffix;
+  if( !bad ) printf("%-20s ok\n", "CompareEtags");
+  nFail += bad;
 
-  /* Create a file to hold the POST query data, if any.  We have to
-  ** do it this way.  We can't just pass the file descriptor down to
-  ** the child process because the fgets() function may have already
-  ** read part of the POST data into its internal buffer.
-  */
-  if( zMethod[0]=='P' && zContentLength!=0 ){
-    size_t len = atoi(zContentLength);
-    FILE *out;
-    char *zBuf;
-    int n;
+  /* Escape() */
+  for(i=bad=0; i<N && !bad; i++){
+    BenchRandomString(zIn, 200, "ab \"\"");
+    BenchRefEscape(zIn, zB);
+    if( strcmp(Escape(zIn), zB)!=0 ) bad = BenchFuzzFail("Escape", zIn);
+    ArenaReset();
+  }
+  if( !bad ) printf("%-20s ok\n", "Escape");
+  nFail += bad;
 
-    if( len>MAX_CONTENT_LENGTH ){
-      StartResponse("500 Request too large");
-      nOut += printf(
-        "Content-type: text/plain; charset=utf-8\r\n"
-        "\r\n"
-        "Too much POST data\n"
-      );
-      MakeLogEntry(0, 270); /* LOG: Request too large */
-      exit(0);
+  /* GetFirstElement() */
+  for(i=bad=0; i<N && !bad; i++){
+    char *zRest, *zTok;
+    BenchRandomString(zIn, 40, "GET /x  \t\r\n");
+    strcpy(zA, zIn);
+    n = BenchRefFirstElement(zIn, zB);
+    zTok = GetFirstElement(zA, &zRest);
+    if( strcmp(zTok, zB)!=0 || zRest!=zA+n ){
+      bad = BenchFuzzFail("GetFirstElement", zIn);
     }
-    rangeEnd = 0;
-    sprintf(zTmpNamBuf, "/tmp/-post-data-XXXXXX");
-    zTmpNam = zTmpNamBuf;
-    if( mkstemp(zTmpNam)<0 ){
-      Malfunction(280,  /* LOG: mkstemp() failed */
-               "Cannot create a temp file in which to store POST data");
+  }
+  if( !bad ) printf("%-20s ok\n", "GetFirstElement");
+  nFail += bad;
+
+  /* Decode64() */
+  for(i=bad=0; i<N && !bad; i++){
+    BenchRandomString(zIn, 80, "ABCXYZabcxyz0189+/=");
+    strcpy(zA, zIn);
+    Decode64(zA);
+    n = BenchRefDecode64(zIn, (unsigned char*)zB);
+    if( memcmp(zA, zB, n)!=0 || zA[n]!=0 ){
+      bad = BenchFuzzFail("Decode64", zIn);
     }
-    out = fopen(zTmpNam,"wb");
-    if( out==0 ){
-      StartResponse("500 Cannot create /tmp file");
-      nOut += printf(
-        "Content-type: text/plain; charset=utf-8\r\n"
-        "\r\n"
-        "Could not open \"%s\" for writing\n", zTmpNam
-      );
-      MakeLogEntry(0, 290); /* LOG: cannot create temp file for POST */
-      exit(0);
+  }
+  if( !bad ) printf("%-20s ok\n", "Decode64");
+  nFail += bad;
+
+  /* HttpInputParse() must accept up to MAX_HEADER_FIELD fields and
+  ** reject any more, however the header is split across reads */
+  for(i=bad=0; i<N/100+10 && !bad; i++){
+    static HttpInput sIn;
+    int nHdr, nField = MAX_HEADER_FIELD - 2 + BenchRandom()%4;
+    int rc = 0, iEnd = 0;
+    nHdr = sprintf(sIn.a, "POST /x.cgi HTTP/1.1\r\n");
+    for(j=1; j<nField; j++){
+      nHdr += sprintf(sIn.a+nHdr, "X-%d: %d\r\n", j, j);
+    }
+    nHdr += sprintf(sIn.a+nHdr, "Content-Length: 4\r\n\r\nabcd");
+    sIn.n = sIn.iRd = 0;
+    HttpInputBegin(&sIn);
+    while( rc==0 && iEnd<nHdr ){
+      iEnd += 1 + BenchRandom()%200;
+      sIn.n = iEnd<nHdr ? iEnd : nHdr;
+      rc = HttpInputParse(&sIn);
     }
-    zBuf = SafeMalloc( len+1 );
-    if( useTimeout ) alarm(15 + len/2000);
-    n = fread(zBuf,1,len,stdin);
-    nIn += n;
-    fwrite(zBuf,1,n,out);
-    free(zBuf);
-    fclose(out);
+    if( rc!=(nField<=MAX_HEADER_FIELD ? 1 : -1)
+     || HttpInputParse(&sIn)!=rc
+     || (rc==1 && sIn.nField!=nField)
+    ){
+      sprintf(zIn, "header with %d fields", nField);
+      bad = BenchFuzzFail("HttpInputParse", zIn);
+    }
+  }
+  if( !bad ) printf("%-20s ok\n", "HttpInputParse");
+  nFail += bad;
+  return nFail;
+}
+
+/*
+** Run each benchmark N times and print the results.
+*/
+static void Bench(int N){
+  static HttpInput sBench;
+  long long t0, t1;
+  int i, x = 0;
+  FILE *in;
+
+  if( N<=0 ) N = 100000;
+  in = fmemopen((void*)zBenchRequest, sizeof(zBenchRequest)-1, "rb");
+  if( in==0 ) return;
+  t0 = BenchNow();
+  for(i=0; i<N; i++) x += BenchFgetsParse(in);
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "header-parse-fgets", (t1-t0)/(double)N);
+  fclose(in);
+  t0 = BenchNow();
+  for(i=0; i<N; i++) x += BenchBufferParse(&sBench);
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "header-parse-buffer", (t1-t0)/(double)N);
+  t0 = BenchNow();
+  for(i=0; i<N; i++) x += BenchFieldDispatch(&sBench, 0);
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "header-dispatch-strcasecmp",
+         (t1-t0)/(double)N);
+  t0 = BenchNow();
+  for(i=0; i<N; i++) x += BenchFieldDispatch(&sBench, 1);
+  t1 = BenchNow();
+  printf("%-28s %10.1f ns/op\n", "header-dispatch-switch",
+         (t1-t0)/(double)N);
+  if( x==0 ) printf("no header fields found\n");
+  BenchHelpers(N);
+}
+
+/*
+** A replay load test.  Compile with -DALTHTTPD_BENCH and run
+**
+**      althttpd [OPTIONS] --replay N
+**
+** to send N copies of each request in a corpus to a fresh server, first
+** one process per request with --input, then over keep-alive connections
+** to a server started with --port.  Options must come before --replay:
+**
+**   --replay-clients C   Number of concurrent clients.  Default 4.
+**   --replay-corpus DIR  Each file in DIR is one recorded request, named
+**                        after the file.  The server then uses the --root
+**                        given before --replay, which must hold the
+**                        content the requests ask for.
+**   --replay-out FILE    Append the results to FILE as CSV.
+**   --replay-label TEXT  Label for the results in FILE.  Default "althttpd".
+**
+** The --workers, --file-cache, --shed-load, --scgi-spares and --logfile
+** options are passed on to the server under test.  Without a corpus
+** directory, a built-in corpus is used with a scratch website holding a
+** static file, a CGI script and an SCGI server, and covering static
+** content, 304 replies, byte ranges, CGI, SCGI and POST.
+**
+** For each request and mode, the report gives requests per second, the
+** 50th, 99th and 99.9th percentile latency, system calls per request
+** made by the server and its children (counted with ptrace() in a
+** separate pass, -1 if ptrace() is unavailable), the peak resident
+** set size of the largest server process, and the number of errors.  A
+** request is an error if it gets no complete reply or if its reply
+** status is unexpected: anything but 200, 206 or 304 for the built-in
+** corpus, and 400 or above for a corpus directory.
+*/
+typedef struct ReplayReq ReplayReq;
+struct ReplayReq {
+  char *zName;              /* Name of the request */
+  char *zFile;              /* File holding the request text */
+  char *zText;              /* Text of the request */
+  int nText;                /* Bytes of zText */
+  int bStrict;              /* Only 200, 206 and 304 replies succeed */
+};
+static int nReplayClient = 4;           /* --replay-clients */
+static char *zReplayCorpus = 0;         /* --replay-corpus */
+static char *zReplayOut = 0;            /* --replay-out */
+static char *zReplayLabel = "althttpd"; /* --replay-label */
+static char zReplayExe[1000];           /* This program */
+static char *zReplayRoot = 0;           /* --root of the server under test */
+static char *zReplayTmp = 0;            /* Scratch directory, if any */
+
+/* The built-in corpus.  %d is the size of the POST content. */
+static const char *azReplayBuiltin[] = {
+  "static",
+  "GET /index.html HTTP/1.1\r\nHost: localhost\r\n"
+  "User-Agent: althttpd-replay\r\nAccept-Encoding: gzip\r\n\r\n",
+  "304",
+  "GET /index.html HTTP/1.1\r\nHost: localhost\r\n"
+  "User-Agent: althttpd-replay\r\n"
+  "If-Modified-Since: Fri, 01 Jan 2037 00:00:00 GMT\r\n\r\n",
+  "range",
+  "GET /index.html HTTP/1.1\r\nHost: localhost\r\n"
+  "User-Agent: althttpd-replay\r\nRange: bytes=1000-1999\r\n\r\n",
+  "cgi",
+  "GET /echo.cgi?x=1 HTTP/1.1\r\nHost: localhost\r\n"
+  "User-Agent: althttpd-replay\r\n\r\n",
+  "scgi",
+  "GET /app.scgi/item/1 HTTP/1.1\r\nHost: localhost\r\n"
+  "User-Agent: althttpd-replay\r\n\r\n",
+  "post",
+  "POST /echo.cgi HTTP/1.1\r\nHost: localhost\r\n"
+  "User-Agent: althttpd-replay\r\n"
+  "Content-Type: application/x-www-form-urlencoded\r\n"
+  "Content-Length: %d\r\n\r\n",
+};
+#define REPLAY_POST_SIZE 2000
+#define REPLAY_MX_CLIENT 256
+#define REPLAY_MX_SCGI 16
+
+/*
+** Write n bytes of z into a new file zName with permissions iMode.
+*/
+static void ReplayWriteFile(const char *zName, const char *z, int n,
+                            int iMode){
+  int fd = open(zName, O_WRONLY|O_CREAT|O_TRUNC, iMode);
+  if( fd<0 || WriteAll(fd, z, n) || fchmod(fd, iMode) ){
+    fprintf(stderr, "cannot write %s\n", zName);
+    exit(1);
   }
+  close(fd);
+}
 
-  /* Make sure the running time is not too great */
-  if( useTimeout ) alarm(10);
+/*
+** Read the whole of file zName into memory obtained from malloc().
+** Return NULL if it cannot be read.
+*/
+static char *ReplayReadFile(const char *zName, int *pn){
+  struct stat st;
+  char *z;
+  int fd = open(zName, O_RDONLY);
+  if( fd<0 ) return 0;
+  if( fstat(fd, &st) || (z = malloc(st.st_size+1))==0 ){
+    close(fd);
+    return 0;
+  }
+  *pn = (int)read(fd, z, st.st_size);
+  close(fd);
+  if( *pn!=(int)st.st_size ){
+    free(z);
+    return 0;
+  }
+  z[*pn] = 0;
+  return z;
+}
 
-  /* Convert all unusual characters in the script name into "_".
-  **
-  ** This is a defense against various attacks, XSS attacks in particular.
-  */
-  sanitizeString(zScript);
+/*
+** Open a TCP listening socket on an unused port of the loopback
+** interface.  Return the socket and write the port number into *pPort.
+*/
+static int ReplayListen(int *pPort){
+  struct sockaddr_in sa;
+  socklen_t n = sizeof(sa);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if( fd<0 || bind(fd, (struct sockaddr*)&sa, sizeof(sa))
+   || listen(fd, 64) || getsockname(fd, (struct sockaddr*)&sa, &n)
+  ){
+    fprintf(stderr, "cannot open a listening socket\n");
+    exit(1);
+  }
+  *pPort = ntohs(sa.sin_port);
+  return fd;
+}
 
-  /* Do not allow "/." or "/-" to to occur anywhere in the entity name.
-  ** This prevents attacks involving ".." and also allows us to create
-  ** files and directories whose names begin with "-" or "." which are
-  ** invisible to the webserver.
-  **
-  ** Exception:  Allow the "/.well-known/" prefix in accordance with
-  ** RFC-5785.
-  */
-  for(z=zScript; *z; z++){
-    if( *z=='/' && (z[1]=='.' || z[1]=='-') ){
-      if( strncmp(zScript,"/.well-known/",13)==0 && (z[1]!='.' || z[2]!='.') ){
-        /* Exception:  Allow "/." and "/-" for URLs that being with
-        ** "/.well-known/".  But do not allow "/..". */
-        continue;
+/*
+** Connect to port iPort on the loopback interface.  Return the socket,
+** or -1 on failure.
+*/
+static int ReplayConnect(int iPort){
+  struct sockaddr_in sa;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  if( fd<0 ) return -1;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.sin_port = htons(iPort);
+  if( connect(fd, (struct sockaddr*)&sa, sizeof(sa)) ){
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+/*
+** The SCGI server of the scratch website.  Answer each request with a
+** short reply after reading all of its content.  Several processes
+** accept connections, as althttpd may hold spare connections open
+** before it has a request to send.  Never returns.
+*/
+static void ReplayScgiServer(int fdListen){
+  static char a[65536];
+  int i;
+  setpgid(0, 0);
+  for(i=1; i<REPLAY_MX_SCGI && fork()>0; i++){}
+  while( 1 ){
+    int fd = accept(fdListen, 0, 0);
+    int n = 0, got, nHdr = -1, nBody = 0, i;
+    const char *zReply =
+      "Status: 200 OK\r\nContent-Type: text/plain\r\n"
+      "Content-Length: 9\r\n\r\nscgi ok.\n";
+    if( fd<0 ) continue;
+    while( n<(int)sizeof(a) && (got = (int)read(fd, a+n, sizeof(a)-n))>0 ){
+      n += got;
+      if( nHdr<0 ){
+        for(i=0; i<n && a[i]!=':'; i++){}
+        if( i>=n ) continue;
+        nHdr = atoi(a) + i + 2;
+        for(i=i+1; i+15<n && i<nHdr; i += (int)strlen(a+i)+1){
+          if( strcmp(a+i, "CONTENT_LENGTH")==0 ){
+            nBody = atoi(a+i+15);
+            break;
+          }
+        }
       }
-      NotFound(300); /* LOG: Path element begins with "." or "-" */
+      if( nHdr>=0 && n>=nHdr+nBody ) break;
     }
+    WriteAll(fd, zReply, (int)strlen(zReply));
+    close(fd);
   }
+}
 
-  /* Figure out what the root of the filesystem should be.  If the
-  ** HTTP_HOST parameter exists (stored in zHttpHost) then remove the
-  ** port number from the end (if any), convert all characters to lower
-  ** case, and convert non-alphanumber characters (including ".") to "_".
-  ** Then try to find a directory with that name and the extension .website.
-  ** If not found, look for "default.website".
-  */
-  if( zScript[0]!='/' ){
-    NotFound(310); /* LOG: URI does not start with "/" */
+/*
+** Build the scratch website and the built-in corpus in a new temporary
+** directory.  Start an SCGI server for the website and return its
+** process id.  Store the corpus in *paReq and return its size in *pnReq.
+*/
+static pid_t ReplaySetup(ReplayReq **paReq, int *pnReq){
+  static char zTmp[] = "/tmp/althttpd-replay-XXXXXX";
+  char zName[1200];
+  char zBuf[5000];
+  int i, n, fd, iPort;
+  pid_t pid;
+  ReplayReq *aReq;
+
+  if( mkdtemp(zTmp)==0 || chmod(zTmp, 0755) ){
+    fprintf(stderr, "cannot create a scratch directory\n");
+    exit(1);
   }
-  if( strlen(zRoot)+40 >= sizeof(zLine) ){
-    NotFound(320); /* LOG: URI too long */
+  zReplayTmp = zTmp;
+  zReplayRoot = zTmp;
+  snprintf(zName, sizeof(zName), "%s/default.website", zTmp);
+  if( mkdir(zName, 0755) ){
+    fprintf(stderr, "cannot create %s\n", zName);
+    exit(1);
   }
-  if( zHttpHost==0 || zHttpHost[0]==0 ){
-    NotFound(330);  /* LOG: Missing HOST: parameter */
-  }else if( strlen(zHttpHost)+strlen(zRoot)+10 >= sizeof(zLine) ){
-    NotFound(340);  /* LOG: HOST parameter too long */
-  }else{
-    sprintf(zLine, "%s/%s", zRoot, zHttpHost);
-    for(i=strlen(zRoot)+1; zLine[i] && zLine[i]!=':'; i++){
-      unsigned char c = (unsigned char)zLine[i];
-      if( !isalnum(c) ){
-        if( c=='.' && (zLine[i+1]==0 || zLine[i+1]==':') ){
-          /* If the client sent a FQDN with a "." at the end
-          ** (example: "sqlite.org." instead of just "sqlite.org") then
-          ** omit the final "." from the document root directory name */
-          break;
-        }
-        zLine[i] = '_';
-      }else if( isupper(c) ){
-        zLine[i] = tolower(c);
-      }
-    }
-    strcpy(&zLine[i], ".website");
+  for(i=n=0; n<(int)sizeof(zBuf)-80; i++){
+    n += sprintf(zBuf+n, "Line %04d of the static file used by the"
+                         " replay test\n", i);
   }
-  if( stat(zLine,&statbuf) || !S_ISDIR(statbuf.st_mode) ){
-    sprintf(zLine, "%s/default.website", zRoot);
-    if( stat(zLine,&statbuf) || !S_ISDIR(statbuf.st_mode) ){
-      if( standalone ){
-        sprintf(zLine, "%s", zRoot);
-      }else{
-        NotFound(350);  /* LOG: *.website permissions */
-      }
+  snprintf(zName, sizeof(zName), "%s/default.website/index.html", zTmp);
+  ReplayWriteFile(zName, zBuf, n, 0644);
+  snprintf(zName, sizeof(zName), "%s/default.website/echo.cgi", zTmp);
+  n = sprintf(zBuf, "#!/bin/sh\n"
+                    "[ -n \"$CONTENT_LENGTH\" ] && head -c $CONTENT_LENGTH"
+                    " >/dev/null\n"
+                    "printf 'Content-Type: text/plain\\r\\n"
+                    "Content-Length: 8\\r\\n\\r\\ncgi ok.\\n'\n");
+  ReplayWriteFile(zName, zBuf, n, 0755);
+  fd = ReplayListen(&iPort);
+  pid = fork();
+  if( pid==0 ) ReplayScgiServer(fd);
+  close(fd);
+  snprintf(zName, sizeof(zName), "%s/default.website/app.scgi", zTmp);
+  n = sprintf(zBuf, "SCGI 127.0.0.1 %d\n", iPort);
+  ReplayWriteFile(zName, zBuf, n, 0644);
+
+  n = (int)(sizeof(azReplayBuiltin)/sizeof(azReplayBuiltin[0]))/2;
+  aReq = calloc(n, sizeof(ReplayReq));
+  if( aReq==0 ) exit(1);
+  for(i=0; i<n; i++){
+    ReplayReq *p = &aReq[i];
+    p->zName = (char*)azReplayBuiltin[i*2];
+    p->zText = malloc(strlen(azReplayBuiltin[i*2+1]) + REPLAY_POST_SIZE + 20);
+    if( p->zText==0 ) exit(1);
+    p->nText = sprintf(p->zText, azReplayBuiltin[i*2+1], REPLAY_POST_SIZE);
+    if( strncmp(p->zText, "POST", 4)==0 ){
+      memset(p->zText+p->nText, 'x', REPLAY_POST_SIZE);
+      p->nText += REPLAY_POST_SIZE;
     }
+    snprintf(zName, sizeof(zName), "%s/%s.req", zTmp, p->zName);
+    p->zFile = strdup(zName);
+    p->bStrict = 1;
+    ReplayWriteFile(p->zFile, p->zText, p->nText, 0644);
   }
-  zHome = StrDup(zLine);
+  *paReq = aReq;
+  *pnReq = n;
+  return pid;
+}
 
-  /* Change directories to the root of the HTTP filesystem
-  */
-  if( chdir(zHome)!=0 ){
-    char zBuf[1000];
-    Malfunction(360,  /* LOG: chdir() failed */
-         "cannot chdir to [%s] from [%s]",
-         zHome, getcwd(zBuf,999));
+/*
+** Load the recorded requests in directory zDir.
+*/
+static void ReplayLoadCorpus(const char *zDir, ReplayReq **paReq,
+                             int *pnReq){
+  DIR *pDir = opendir(zDir);
+  struct dirent *pEntry;
+  ReplayReq *aReq = 0;
+  int n = 0;
+  if( pDir==0 ){
+    fprintf(stderr, "cannot open --replay-corpus directory %s\n", zDir);
+    exit(1);
+  }
+  while( (pEntry = readdir(pDir))!=0 ){
+    char zName[1200];
+    ReplayReq *p;
+    if( pEntry->d_name[0]=='.' ) continue;
+    aReq = realloc(aReq, (n+1)*sizeof(ReplayReq));
+    if( aReq==0 ) exit(1);
+    p = &aReq[n];
+    snprintf(zName, sizeof(zName), "%s/%s", zDir, pEntry->d_name);
+    p->zText = ReplayReadFile(zName, &p->nText);
+    if( p->zText==0 ) continue;
+    p->zName = strdup(pEntry->d_name);
+    p->zFile = strdup(zName);
+    p->bStrict = 0;
+    n++;
   }
+  closedir(pDir);
+  *paReq = aReq;
+  *pnReq = n;
+}
 
-  /* Locate the file in the filesystem.  We might have to append
-  ** a name like "/home" or "/index.html" or "/index.cgi" in order
-  ** to find it.  Any excess path information is put into the
-  ** zPathInfo variable.
-  */
-  j = j0 = (int)strlen(zLine);
-  i = 0;
-  while( zScript[i] ){
-    while( zScript[i] && (i==0 || zScript[i]!='/') ){
-      zLine[j] = zScript[i];
-      i++; j++;
-    }
-    zLine[j] = 0;
-    if( stat(zLine,&statbuf)!=0 ){
-      int stillSearching = 1;
-      while( stillSearching && i>0 && j>j0 ){
-        while( j>j0 && zLine[j-1]!='/' ){ j--; }
-        strcpy(&zLine[j-1], "/not-found.html");
-        if( stat(zLine,&statbuf)==0 && S_ISREG(statbuf.st_mode)
-            && access(zLine,R_OK)==0 ){
-          zRealScript = StrDup(&zLine[j0]);
-          Redirect(zRealScript, 302, 1, 370); /* LOG: redirect to not-found */
-          return;
-        }else{
-          j--;
-        }
-      }
-      if( stillSearching ) NotFound(380); /* LOG: URI not found */
+/*
+** Fill azArg[] with the command line for a server under test that reads
+** zInput, or listens on port iPort if zInput is NULL.
+*/
+static void ReplayServerArgs(char **azArg, const char *zInput, int iPort){
+  static char azNum[6][30];
+  int n = 0;
+  azArg[n++] = zReplayExe;
+  azArg[n++] = "--root";
+  azArg[n++] = zReplayRoot;
+  azArg[n++] = "--jail";
+  azArg[n++] = "0";
+  if( getuid()==0 ){
+    azArg[n++] = "--user";
+    azArg[n++] = "nobody";
+  }
+  if( zLogFile ){
+    azArg[n++] = "--logfile";
+    azArg[n++] = zLogFile;
+  }
+  if( zInput ){
+    azArg[n++] = "--input";
+    azArg[n++] = (char*)zInput;
+  }else{
+    sprintf(azNum[0], "%d", iPort);
+    sprintf(azNum[1], "%d", nWorker);
+    sprintf(azNum[2], "%d", nFileCache);
+    sprintf(azNum[3], "%d", shedLoad);
+    sprintf(azNum[4], "%d", nScgiSpare);
+    azArg[n++] = "--port";
+    azArg[n++] = azNum[0];
+    azArg[n++] = "--workers";
+    azArg[n++] = azNum[1];
+    azArg[n++] = "--file-cache";
+    azArg[n++] = azNum[2];
+    azArg[n++] = "--shed-load";
+    azArg[n++] = azNum[3];
+    azArg[n++] = "--scgi-spares";
+    azArg[n++] = azNum[4];
+  }
+  azArg[n] = 0;
+}
+
+/*
+** Start a server under test, as a child process of this one.  If
+** bTrace is true, the child stops for ptrace() before it runs.  The
+** server writes its standard output to fdOut, or discards it if fdOut
+** is negative.
+*/
+static pid_t ReplayServerStart(const char *zInput, int iPort, int bTrace,
+                               int fdOut){
+  char *azArg[30];
+  pid_t pid;
+  ReplayServerArgs(azArg, zInput, iPort);
+  pid = fork();
+  if( pid==0 ){
+    int fd = open("/dev/null", O_RDWR);
+    dup2(fdOut>=0 ? fdOut : fd, 1);
+    dup2(fd, 2);
+    if( zInput==0 ) setpgid(0, 0);
+    if( bTrace && ptrace(PTRACE_TRACEME, 0, 0, 0) ) _exit(1);
+    execv(zReplayExe, azArg);
+    _exit(1);
+  }
+  return pid;
+}
+
+/*
+** Trace process pid, which is stopped at its exec(), and all of its
+** descendants until they have all exited, adding one to *pnStop each
+** time one of them enters or leaves a system call.  *pnStop may be in
+** memory shared with other processes.  Return 0 on success or -1 if
+** tracing does not work.
+*/
+static int ReplayTrace(pid_t pid, volatile long long *pnStop){
+  int st, nLive = 1;
+  if( waitpid(pid, &st, __WALL)!=pid || !WIFSTOPPED(st) ) return -1;
+  if( ptrace(PTRACE_SETOPTIONS, pid, 0,
+             PTRACE_O_TRACESYSGOOD|PTRACE_O_TRACEFORK|PTRACE_O_TRACEVFORK
+             |PTRACE_O_TRACECLONE|PTRACE_O_EXITKILL) ){
+    kill(pid, SIGKILL);
+    waitpid(pid, 0, __WALL);
+    return -1;
+  }
+  ptrace(PTRACE_SYSCALL, pid, 0, 0);
+  while( nLive>0 ){
+    int sig = 0;
+    pid_t p = waitpid(-1, &st, __WALL);
+    if( p<0 ){
+      if( errno==EINTR ) continue;
       break;
     }
-    if( S_ISREG(statbuf.st_mode) ){
-      if( access(zLine,R_OK) ){
-        NotFound(390);  /* LOG: File not readable */
-      }
-      zRealScript = StrDup(&zLine[j0]);
-      break;
+    if( WIFEXITED(st) || WIFSIGNALED(st) ){
+      nLive--;
+      continue;
     }
-    if( zScript[i]==0 || zScript[i+1]==0 ){
-      static const char *azIndex[] = { "/home", "/index.html", "/index.cgi" };
-      int k = j>0 && zLine[j-1]=='/' ? j-1 : j;
-      unsigned int jj;
-      for(jj=0; jj<sizeof(azIndex)/sizeof(azIndex[0]); jj++){
-        strcpy(&zLine[k],azIndex[jj]);
-        if( stat(zLine,&statbuf)!=0 ) continue;
-        if( !S_ISREG(statbuf.st_mode) ) continue;
-        if( access(zLine,R_OK) ) continue;
-        break;
-      }
-      if( jj>=sizeof(azIndex)/sizeof(azIndex[0]) ){
-        NotFound(400); /* LOG: URI is a directory w/o index.html */
-      }
-      zRealScript = StrDup(&zLine[j0]);
-      if( zScript[i]==0 ){
-        /* If the requested URL does not end with "/" but we had to
-        ** append "index.html", then a redirect is necessary.  Otherwise
-        ** none of the relative URLs in the delivered document will be
-        ** correct. */
-        Redirect(zRealScript,301,1,410); /* LOG: redirect to add trailing / */
-        return;
-      }
-      break;
+    if( !WIFSTOPPED(st) ) continue;
+    if( WSTOPSIG(st)==(SIGTRAP|0x80) ){
+      (*pnStop)++;
+    }else if( (st>>16)==PTRACE_EVENT_FORK || (st>>16)==PTRACE_EVENT_VFORK
+           || (st>>16)==PTRACE_EVENT_CLONE ){
+      nLive++;
+    }else if( (st>>16)==0 && WSTOPSIG(st)!=SIGSTOP ){
+      sig = WSTOPSIG(st);
     }
-    zLine[j] = zScript[i];
-    i++; j++;
-  }
-  zFile = StrDup(zLine);
-  zPathInfo = StrDup(&zScript[i]);
-  lenFile = strlen(zFile);
-  zDir = StrDup(zFile);
-  for(i=strlen(zDir)-1; i>0 && zDir[i]!='/'; i--){};
-  if( i==0 ){
-     strcpy(zDir,"/");
-  }else{
-     zDir[i] = 0;
+    ptrace(PTRACE_SYSCALL, p, 0, sig);
   }
+  return 0;
+}
 
-  /* Check to see if there is an authorization file.  If there is,
-  ** process it.
-  */
-  sprintf(zLine, "%s/-auth", zDir);
-  if( access(zLine,R_OK)==0 && !CheckBasicAuthorization(zLine) ) return;
+/*
+** Read more of a reply from socket fd into a[], which has space for
+** nAlloc bytes and holds *pn bytes already.  Keep a[] zero-terminated.
+** Return 0 on success or -1 if the connection is closed or the buffer
+** is full.
+*/
+static int ReplayFill(int fd, char *a, int nAlloc, int *pn){
+  int got;
+  if( *pn>=nAlloc-1 ) return -1;
+  got = (int)read(fd, a+*pn, nAlloc-1-*pn);
+  if( got<=0 ) return -1;
+  *pn += got;
+  a[*pn] = 0;
+  return 0;
+}
 
-  /* Take appropriate action
-  */
-  if( (statbuf.st_mode & 0100)==0100 && access(zFile,X_OK)==0 ){
-    char *zBaseFilename;         /* Filename without directory prefix */
+/*
+** Discard the next nSkip bytes of a reply from socket fd, of which
+** a[] holds the first *pn.  Return 0 on success or -1 on an error.
+*/
+static int ReplaySkip(int fd, char *a, int nAlloc, int *pn,
+                      long long nSkip){
+  while( nSkip>0 ){
+    int k;
+    if( *pn==0 && ReplayFill(fd, a, nAlloc, pn) ) return -1;
+    k = *pn<nSkip ? *pn : (int)nSkip;
+    memmove(a, a+k, *pn-k+1);
+    *pn -= k;
+    nSkip -= k;
+  }
+  return 0;
+}
 
-    /*
-    ** Abort with an error if the CGI script is writable by anyone other
-    ** than its owner.
-    */
-    if( statbuf.st_mode & 0022 ){
-      CgiScriptWritable();
-    }
+/*
+** Read the reply to one request from socket fd, using a[] of size
+** nAlloc as a buffer.  *pn is the number of bytes already in a[], and
+** is updated to the bytes of the following reply, if any.  The reply
+** status goes into *piStatus.  Return 0 if the connection remains open,
+** 1 if the server closed it, -2 if it was closed before any of the
+** reply arrived, or -1 on another error.
+*/
+static int ReplayReadReply(int fd, char *a, int nAlloc, int *pn,
+                           int *piStatus){
+  int i, iStatus, bChunked = 0, bClose = 0;
+  long long nBody = -1;
+  char *zEnd;
 
-    /* If its executable, it must be a CGI program.  Start by
-    ** changing directories to the directory holding the program.
-    */
-    if( chdir(zDir) ){
-      char zBuf[1000];
-      Malfunction(420, /* LOG: chdir() failed */
-           "cannot chdir to [%s] from [%s]", 
-           zDir, getcwd(zBuf,999));
+  while( (zEnd = strstr(a, "\r\n\r\n"))==0 ){
+    if( ReplayFill(fd, a, nAlloc, pn) ) return *pn ? -1 : -2;
+  }
+  iStatus = strncmp(a, "HTTP/", 5)==0 ? atoi(a+9) : 0;
+  *piStatus = iStatus;
+  for(i=0; a+i<zEnd; i++){
+    if( a[i]!='\n' ) continue;
+    if( strncasecmp(a+i+1, "Content-Length:", 15)==0 ){
+      nBody = atoll(a+i+16);
+    }else if( strncasecmp(a+i+1, "Transfer-Encoding: chunked", 26)==0 ){
+      bChunked = 1;
+    }else if( strncasecmp(a+i+1, "Connection: close", 17)==0 ){
+      bClose = 1;
+    }
+  }
+  if( iStatus==0 ) return -1;
+  if( iStatus==304 || iStatus==204 ) nBody = 0;
+  if( ReplaySkip(fd, a, nAlloc, pn, zEnd + 4 - a) ) return -1;
+  if( bChunked ){
+    while( 1 ){
+      long long nChunk;
+      while( (zEnd = strstr(a, "\r\n"))==0 ){
+        if( ReplayFill(fd, a, nAlloc, pn) ) return -1;
+      }
+      nChunk = strtoll(a, 0, 16);
+      if( ReplaySkip(fd, a, nAlloc, pn, zEnd + 2 - a + nChunk + 2) ){
+        return -1;
+      }
+      if( nChunk==0 ) break;
     }
+  }else if( nBody<0 ){
+    /* The body ends when the server closes the connection */
+    while( ReplayFill(fd, a, nAlloc, pn)==0 ){ *pn = 0; }
+    *pn = 0;
+    return 1;
+  }else if( ReplaySkip(fd, a, nAlloc, pn, nBody) ){
+    return -1;
+  }
+  return bClose;
+}
 
-    /* Compute the base filename of the CGI script */
-    for(i=strlen(zFile)-1; i>=0 && zFile[i]!='/'; i--){}
-    zBaseFilename = &zFile[i+1];
+/*
+** Return true if iStatus is an acceptable reply status for request p.
+*/
+static int ReplayStatusOk(const ReplayReq *p, int iStatus){
+  if( p->bStrict ){
+    return iStatus==200 || iStatus==206 || iStatus==304;
+  }
+  return iStatus>=100 && iStatus<400;
+}
 
-    /* Setup the environment appropriately.
-    */
-    putenv("GATEWAY_INTERFACE=CGI/1.0");
-    for(i=0; i<(int)(sizeof(cgienv)/sizeof(cgienv[0])); i++){
-      if( *cgienv[i].pzEnvValue ){
-        SetEnv(cgienv[i].zEnvName,*cgienv[i].pzEnvValue);
+/*
+** Send request p nReq times over keep-alive connections to port iPort,
+** storing the latency of each in aLat[], in microseconds.  Return the
+** number of requests that failed.
+*/
+static int ReplayPortClient(ReplayReq *p, int nReq, int iPort, int *aLat){
+  static char a[65536];
+  int i, n = 0, nErr = 0, rc, nUse = 0, iStatus;
+  int fd = -1;
+  for(i=0; i<nReq; i++){
+    long long t0 = BenchNow();
+    iStatus = 0;
+    do{
+      if( fd<0 ){
+        fd = ReplayConnect(iPort);
+        n = 0;
+        a[0] = 0;
+        nUse = 0;
+      }
+      if( fd<0 || WriteAll(fd, p->zText, p->nText) ){
+        rc = -1;
+      }else{
+        rc = ReplayReadReply(fd, a, sizeof(a), &n, &iStatus);
+      }
+      if( rc ){
+        if( fd>=0 ) close(fd);
+        fd = -1;
       }
+      /* A server may close an idle connection at any time.  Try again
+      ** on a new connection if nothing at all came back on an old one */
+    }while( rc==-2 && nUse>0 );
+    nUse++;
+    aLat[i] = (int)((BenchNow() - t0)/1000);
+    if( rc<0 || !ReplayStatusOk(p, iStatus) ) nErr++;
+  }
+  if( fd>=0 ) close(fd);
+  return nErr;
+}
+
+/*
+** Run request p nReq times as separate processes in --input mode,
+** storing the latency of each in aLat[].  Return the number of runs
+** that failed and write the largest resident set size into *pRss.
+** Each reply goes to a scratch file so that its status can be checked.
+*/
+static int ReplayInputClient(ReplayReq *p, int nReq, int *aLat, long *pRss){
+  int i, st, bOk, nErr = 0;
+  FILE *pOut = tmpfile();
+  int fdOut = pOut ? fileno(pOut) : -1;
+  char a[100];
+  for(i=0; i<nReq; i++){
+    struct rusage ru;
+    long long t0;
+    pid_t pid;
+    int n;
+    if( fdOut>=0 ){
+      lseek(fdOut, 0, SEEK_SET);
+      if( ftruncate(fdOut, 0) ){}
     }
-    if( useHttps ){
-      putenv("HTTPS=on");
-      putenv("REQUEST_SCHEME=https");
-    }else{
-      putenv("REQUEST_SCHEME=http");
+    memset(&ru, 0, sizeof(ru));
+    t0 = BenchNow();
+    pid = ReplayServerStart(p->zFile, 0, 0, fdOut);
+    bOk = pid>0 && wait4(pid, &st, 0, &ru)==pid
+          && WIFEXITED(st) && WEXITSTATUS(st)==0;
+    aLat[i] = (int)((BenchNow() - t0)/1000);
+    if( bOk && fdOut>=0 ){
+      n = (int)pread(fdOut, a, sizeof(a)-1, 0);
+      a[n>0 ? n : 0] = 0;
+      bOk = strncmp(a, "HTTP/", 5)==0 && ReplayStatusOk(p, atoi(a+9));
     }
+    if( !bOk ) nErr++;
+    if( pid>0 && ru.ru_maxrss>*pRss ) *pRss = ru.ru_maxrss;
+  }
+  if( pOut ) fclose(pOut);
+  return nErr;
+}
 
-    /* For the POST method all input has been written to a temporary file,
-    ** so we have to redirect input to the CGI script from that file.
-    */
-    if( zMethod[0]=='P' ){
-      if( dup(0)<0 ){
-        Malfunction(430,  /* LOG: dup(0) failed */
-                    "Unable to duplication file descriptor 0");
-      }
-      close(0);
-      open(zTmpNam, O_RDONLY);
+/*
+** Return the peak resident set size, in KiB, of the largest of process
+** pid and its children.
+*/
+static long ReplayServerRss(pid_t pid){
+  DIR *pDir = opendir("/proc");
+  struct dirent *pEntry;
+  long mx = 0;
+  if( pDir==0 ) return -1;
+  while( (pEntry = readdir(pDir))!=0 ){
+    char zName[300], zLine[200];
+    FILE *in;
+    long ppid = -1, rss = 0;
+    if( !isdigit((unsigned char)pEntry->d_name[0]) ) continue;
+    snprintf(zName, sizeof(zName), "/proc/%s/status", pEntry->d_name);
+    in = fopen(zName, "rb");
+    if( in==0 ) continue;
+    while( fgets(zLine, sizeof(zLine), in) ){
+      if( strncmp(zLine, "PPid:", 5)==0 ) ppid = atol(zLine+5);
+      if( strncmp(zLine, "VmHWM:", 6)==0 ) rss = atol(zLine+6);
     }
+    fclose(in);
+    if( (ppid==pid || atol(pEntry->d_name)==pid) && rss>mx ) mx = rss;
+  }
+  closedir(pDir);
+  return mx;
+}
 
-    if( strncmp(zBaseFilename,"nph-",4)==0 ){
-      /* If the name of the CGI script begins with "nph-" then we are
-      ** dealing with a "non-parsed headers" CGI script.  Just exec()
-      ** it directly and let it handle all its own header generation.
-      */
-      execl(zBaseFilename,zBaseFilename,(char*)0);
-      /* NOTE: No log entry written for nph- scripts */
-      exit(0);
+/*
+** Compare two integers for qsort().
+*/
+static int ReplayCmp(const void *a, const void *b){
+  return *(const int*)a - *(const int*)b;
+}
+
+/*
+** Start a server for a port-mode run and wait until it accepts
+** connections.  Return its process id.
+*/
+static pid_t ReplayPortServer(int *pPort, int bTrace,
+                              volatile long long *pnStop){
+  pid_t pid;
+  int i, fd;
+  close(ReplayListen(pPort));
+  if( bTrace ){
+    /* Trace from a separate process, so that this one can drive the
+    ** clients while the server runs */
+    pid = fork();
+    if( pid==0 ){
+      pid_t pidServer = ReplayServerStart(0, *pPort, 1, -1);
+      if( ReplayTrace(pidServer, pnStop) ) *pnStop = -1;
+      _exit(0);
+    }
+  }else{
+    pid = ReplayServerStart(0, *pPort, 0, -1);
+  }
+  for(i=0; i<200; i++){
+    if( bTrace && *pnStop<0 ) break;
+    if( (fd = ReplayConnect(*pPort))>=0 ){
+      close(fd);
+      break;
     }
+    poll(0, 0, 25);
+  }
+  return pid;
+}
 
-    /* Fall thru to here only if this process (the server) is going
-    ** to read and augment the header sent back by the CGI process.
-    ** Open a pipe to receive the output from the CGI process.  Then
-    ** fork the CGI process.  Once everything is done, we should be
-    ** able to read the output of CGI on the "in" stream.
-    */
-    {
-      int px[2];
-      if( pipe(px) ){
-        Malfunction(440, /* LOG: pipe() failed */
-                    "Unable to create a pipe for the CGI program");
-      }
-      if( fork()==0 ){
-        close(px[0]);
-        close(1);
-        if( dup(px[1])!=1 ){
-          Malfunction(450, /* LOG: dup(1) failed */
-                 "Unable to duplicate file descriptor %d to 1",
-                 px[1]);
-        }
-        close(px[1]);
-        for(i=3; close(i)==0; i++){}
-        execl(zBaseFilename, zBaseFilename, (char*)0);
-        exit(0);
+/*
+** Run request p nReq times in one mode and print and record the results.
+*/
+static void ReplayRun(ReplayReq *p, int nReq, int bPort, FILE *out){
+  int nClient = nReplayClient;
+  int *aLat;                /* Latencies.  Shared with the clients */
+  long long *aShared;       /* [0] syscall stops, [1] errors, [2] peak RSS */
+  size_t sz = nReq*sizeof(int) + 3*sizeof(long long);
+  void *pMem;
+  int i, iPort = 0, nCount, p50, p99, p999;
+  pid_t pidServer = 0;
+  pid_t aClient[REPLAY_MX_CLIENT];
+  long long t0, t1;
+  double rRate, rCalls = -1;
+  long rss = 0;
+
+  if( nClient<1 ) nClient = 1;
+  if( nClient>REPLAY_MX_CLIENT ) nClient = REPLAY_MX_CLIENT;
+  if( nClient>nReq ) nClient = nReq;
+  pMem = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if( pMem==MAP_FAILED ) exit(1);
+  aShared = pMem;
+  aLat = (int*)&aShared[3];
+  memset(pMem, 0, sz);
+  if( bPort ) pidServer = ReplayPortServer(&iPort, 0, 0);
+
+  /* The timed run */
+  t0 = BenchNow();
+  for(i=0; i<nClient; i++){
+    if( (aClient[i] = fork())==0 ){
+      int iFirst = (int)((long long)nReq*i/nClient);
+      int n = (int)((long long)nReq*(i+1)/nClient) - iFirst;
+      int nErr;
+      long mx = 0;
+      long long mxOld;
+      if( bPort ){
+        nErr = ReplayPortClient(p, n, iPort, &aLat[iFirst]);
+      }else{
+        nErr = ReplayInputClient(p, n, &aLat[iFirst], &mx);
       }
-      close(px[1]);
-      in = fdopen(px[0], "rb");
+      __atomic_fetch_add(&aShared[1], nErr, __ATOMIC_RELAXED);
+      mxOld = aShared[2];
+      while( mx>mxOld && !__atomic_compare_exchange_n(&aShared[2], &mxOld,
+                          (long long)mx, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+      ){}
+      _exit(0);
     }
-    if( in==0 ){
-      CgiError();
-    }else{
-      CgiHandleReply(in);
+  }
+  for(i=0; i<nClient; i++){
+    while( waitpid(aClient[i], 0, 0)<0 && errno==EINTR ){}
+  }
+  t1 = BenchNow();
+  rRate = nReq*1e9/(double)(t1-t0);
+  if( bPort ){
+    rss = ReplayServerRss(pidServer);
+    kill(-pidServer, SIGKILL);
+    waitpid(pidServer, 0, 0);
+  }else{
+    rss = (long)aShared[2];
+  }
+
+  qsort(aLat, nReq, sizeof(int), ReplayCmp);
+  p50 = aLat[(nReq-1)/2];
+  p99 = aLat[(int)((nReq-1)*0.99)];
+  p999 = aLat[(int)((nReq-1)*0.999)];
+
+  /* A shorter pass under ptrace() to count system calls */
+  nCount = nReq<1000 ? nReq : 1000;
+  if( bPort ){
+    pid_t pidTracer = ReplayPortServer(&iPort, 1, &aShared[0]);
+    if( aShared[0]>=0 ){
+      long long nBase;
+      poll(0, 0, 100);
+      nBase = aShared[0];
+      ReplayPortClient(p, nCount, iPort, aLat);
+      rCalls = (aShared[0] - nBase)/(2.0*nCount);
     }
-  }else if( lenFile>5 && strcmp(&zFile[lenFile-5],".scgi")==0 ){
-    /* Any file that ends with ".scgi" is assumed to be text of the
-    ** form:
-    **     SCGI hostname port
-    ** Open a TCP/IP connection to that host and send it an SCGI request
-    */
-    SendScgiRequest(zFile, zScript);
-  }else if( countSlashes(zRealScript)!=countSlashes(zScript) ){
-    /* If the request URI for static content contains material past the
-    ** actual content file name, report that as a 404 error. */
-    NotFound(460); /* LOG: Excess URI content past static file name */
+    kill(pidTracer, SIGKILL);  /* PTRACE_O_EXITKILL stops the server */
+    waitpid(pidTracer, 0, 0);
   }else{
-    /* If it isn't executable then it
-    ** must a simple file that needs to be copied to output.
-    */
-    if( SendFile(zFile, lenFile, &statbuf) ) return;
+    int ok = 0;
+    for(i=0; i<nCount; i++){
+      pid_t pid = ReplayServerStart(p->zFile, 0, 1, -1);
+      ok = pid>0 && ReplayTrace(pid, &aShared[0])==0;
+      if( !ok ) break;
+    }
+    if( ok ) rCalls = aShared[0]/(2.0*nCount);
   }
-  fflush(stdout);
-  MakeLogEntry(0, 0);  /* LOG: Normal reply */
 
-  /* The next request must arrive within 30 seconds or we close the connection
-  */
-  omitLog = 1;
-  if( useTimeout ) alarm(30);
+  printf("%-5s %-12s %7d %8d %10.1f %8d %8d %8d %9.1f %8ld %6lld\n",
+         bPort ? "port" : "input", p->zName, nClient, nReq, rRate,
+         p50, p99, p999, rCalls, rss, aShared[1]);
+  fflush(stdout);
+  if( out ){
+    fprintf(out, "%s,%s,%s,%d,%d,%.1f,%d,%d,%d,%.1f,%ld,%lld\n",
+            zReplayLabel, bPort ? "port" : "input", p->zName, nClient, nReq,
+            rRate, p50, p99, p999, rCalls, rss, aShared[1]);
+    fflush(out);
+  }
+  munmap(pMem, sz);
 }
 
-#define MAX_PARALLEL 50  /* Number of simultaneous children */
-
 /*
-** All possible forms of an IP address.  Needed to work around GCC strict
-** aliasing rules.
+** Implementation of the --replay N command-line option.
 */
-typedef union {
-  struct sockaddr sa;              /* Abstract superclass */
-  struct sockaddr_in sa4;          /* IPv4 */
-  struct sockaddr_in6 sa6;         /* IPv6 */
-  struct sockaddr_storage sas;     /* Should be the maximum of the above 3 */
-} address;
+static void Replay(int N){
+  ReplayReq *aReq = 0;
+  int nReq = 0, i, n;
+  pid_t pidScgi = 0;
+  FILE *out = 0;
+  char zName[1200];
 
-/*
-** Implement an HTTP server daemon listening on port zPort.
-**
-** As new connections arrive, fork a child and let the child return
-** out of this procedure call.  The child will handle the request.
-** The parent never returns from this procedure.
-**
-** Return 0 to each child as it runs.  If unable to establish a
-** listening socket, return non-zero.
-*/
-int http_server(const char *zPort, int localOnly){
-  int listener[20];            /* The server sockets */
-  int connection;              /* A socket for each individual connection */
-  fd_set readfds;              /* Set of file descriptors for select() */
-  address inaddr;              /* Remote address */
-  socklen_t lenaddr;           /* Length of the inaddr structure */
-  int child;                   /* PID of the child process */
-  int nchildren = 0;           /* Number of child processes */
-  struct timeval delay;        /* How long to wait inside select() */
-  int opt = 1;                 /* setsockopt flag */
-  struct addrinfo sHints;      /* Address hints */
-  struct addrinfo *pAddrs, *p; /* */
-  int rc;                      /* Result code */
-  int i, n;
-  int maxFd = -1;
-  
-  memset(&sHints, 0, sizeof(sHints));
-  if( ipv4Only ){
-    sHints.ai_family = PF_INET;
-    /*printf("ipv4 only\n");*/
-  }else if( ipv6Only ){
-    sHints.ai_family = PF_INET6;
-    /*printf("ipv6 only\n");*/
-  }else{
-    sHints.ai_family = PF_UNSPEC;
+  if( N<=0 ) N = 1000;
+  n = (int)readlink("/proc/self/exe", zReplayExe, sizeof(zReplayExe)-1);
+  if( n<=0 ){
+    fprintf(stderr, "cannot find the althttpd executable\n");
+    exit(1);
   }
-  sHints.ai_socktype = SOCK_STREAM;
-  sHints.ai_flags = AI_PASSIVE;
-  sHints.ai_protocol = 0;
-  rc = getaddrinfo(localOnly ? "localhost": 0, zPort, &sHints, &pAddrs);
-  if( rc ){
-    fprintf(stderr, "could not get addr info: %s", 
-            rc!=EAI_SYSTEM ? gai_strerror(rc) : strerror(errno));
-    return 1;
+  zReplayExe[n] = 0;
+  if( zReplayCorpus ){
+    if( zRoot==0 ){
+      fprintf(stderr, "--replay-corpus requires --root\n");
+      exit(1);
+    }
+    zReplayRoot = zRoot;
+    ReplayLoadCorpus(zReplayCorpus, &aReq, &nReq);
+  }else{
+    pidScgi = ReplaySetup(&aReq, &nReq);
   }
-  for(n=0, p=pAddrs; n<(int)(sizeof(listener)/sizeof(listener[0])) && p!=0;
-        p=p->ai_next){
-    listener[n] = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-    if( listener[n]>=0 ){
-      /* if we can't terminate nicely, at least allow the socket to be reused */
-      setsockopt(listener[n], SOL_SOCKET, SO_REUSEADDR,&opt, sizeof(opt));
-      
-#if defined(IPV6_V6ONLY)
-      if( p->ai_family==AF_INET6 ){
-        int v6only = 1;
-        setsockopt(listener[n], IPPROTO_IPV6, IPV6_V6ONLY,
-                    &v6only, sizeof(v6only));
-      }
-#endif
-      
-      if( bind(listener[n], p->ai_addr, p->ai_addrlen)<0 ){
-        printf("bind failed: %s\n", strerror(errno));
-        close(listener[n]);
-        continue;
-      }
-      if( listen(listener[n], 20)<0 ){
-        printf("listen() failed: %s\n", strerror(errno));
-        close(listener[n]);
-        continue;
-      }
-      n++;
+  if( zReplayOut ){
+    struct stat st;
+    out = fopen(zReplayOut, "ab");
+    if( out==0 ){
+      fprintf(stderr, "cannot open --replay-out file %s\n", zReplayOut);
+      exit(1);
+    }
+    if( fstat(fileno(out), &st)==0 && st.st_size==0 ){
+      fprintf(out, "label,mode,request,clients,requests,rps,p50_us,p99_us,"
+                   "p999_us,syscalls_per_request,max_rss_kb,errors\n");
     }
   }
-  if( n==0 ){
-    fprintf(stderr, "cannot open any sockets\n");
-    return 1;
+  signal(SIGPIPE, SIG_IGN);
+  printf("%-5s %-12s %7s %8s %10s %8s %8s %8s %9s %8s %6s\n",
+         "mode", "request", "clients", "requests", "req/s", "p50-us",
+         "p99-us", "p99.9-us", "syscalls", "rss-kb", "errors");
+  for(i=0; i<nReq; i++){
+    ReplayRun(&aReq[i], N, 0, out);
+    ReplayRun(&aReq[i], N, 1, out);
+  }
+  if( out ) fclose(out);
+  if( pidScgi>0 ){
+    kill(-pidScgi, SIGKILL);
+    waitpid(pidScgi, 0, 0);
   }
+  if( zReplayTmp ){
+    for(i=0; i<nReq; i++) unlink(aReq[i].zFile);
+    snprintf(zName, sizeof(zName), "%s/default.website/index.html",
+             zReplayTmp);
+    unlink(zName);
+    snprintf(zName, sizeof(zName), "%s/default.website/echo.cgi",
+             zReplayTmp);
+    unlink(zName);
+    snprintf(zName, sizeof(zName), "%s/default.website/app.scgi",
+             zReplayTmp);
+    unlink(zName);
+    snprintf(zName, sizeof(zName), "%s/default.website", zReplayTmp);
+    rmdir(zName);
+    rmdir(zReplayTmp);
+  }
+}
+#endif /* ALTHTTPD_BENCH */
 
-  while( 1 ){
-    if( nchildren>MAX_PARALLEL ){
-      /* Slow down if connections are arriving too fast */
-      sleep( nchildren-MAX_PARALLEL );
+/*
+** Read a varint from the n bytes at a[].  Store the value in *pv and
+** return the number of bytes read, or 0 if the varint is cut short.
+*/
+static int LogGetVarint(const unsigned char *a, int n, unsigned long long *pv){
+  unsigned long long v = 0;
+  int i;
+  for(i=0; i<n && i<10; i++){
+    v |= (unsigned long long)(a[i] & 0x7f) << (7*i);
+    if( (a[i] & 0x80)==0 ){
+      *pv = v;
+      return i+1;
     }
-    delay.tv_sec = 60;
-    delay.tv_usec = 0;
-    FD_ZERO(&readfds);
-    for(i=0; i<n; i++){
-      assert( listener[i]>=0 );
-      FD_SET( listener[i], &readfds);
-      if( listener[i]>maxFd ) maxFd = listener[i];
+  }
+  return 0;
+}
+
+/*
+** Implementation of --log-decode.  Convert the binary log in file zFile
+** into text on standard output.
+*/
+static void LogDecode(const char *zFile){
+  FILE *in;
+  unsigned char *aBlk = 0;       /* Content of the current block */
+  int nAlloc = 0;                /* Bytes allocated for aBlk[] */
+  const unsigned char **azLit = 0;  /* Text strings in the block */
+  int *anLit = 0;                /* Length of each azLit[] */
+  unsigned char aHdr[LOG_BLOCK_HDR];
+  time_t tDate = -1;
+  char zDate[200];
+
+  in = strcmp(zFile,"-")==0 ? stdin : fopen(zFile, "rb");
+  if( in==0 ){
+    fprintf(stderr, "cannot open --log-decode file \"%s\"\n", zFile);
+    exit(1);
+  }
+  logBinary = 0;
+  fdLog = 1;
+  pidLog = getpid();
+  while( fread(aHdr, LOG_BLOCK_HDR, 1, in)==1 ){
+    int nBlk, i, nLit = 0;
+    long long tNow = 0;
+    if( memcmp(aHdr, "AHL\001", 4)!=0 ) break;
+    nBlk = aHdr[4] | (aHdr[5]<<8) | (aHdr[6]<<16) | ((aHdr[7]&0x7f)<<24);
+    if( nBlk>nAlloc ){
+      nAlloc = nBlk;
+      aBlk = realloc(aBlk, nAlloc);
+      azLit = realloc(azLit, nAlloc*sizeof(azLit[0]));
+      anLit = realloc(anLit, nAlloc*sizeof(anLit[0]));
+      if( aBlk==0 || azLit==0 || anLit==0 ){
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+      }
     }
-    select( maxFd+1, &readfds, 0, 0, &delay);
-    for(i=0; i<n; i++){
-      if( FD_ISSET(listener[i], &readfds) ){
-        lenaddr = sizeof(inaddr);
-        connection = accept(listener[i], &inaddr.sa, &lenaddr);
-        if( connection>=0 ){
-          child = fork();
-          if( child!=0 ){
-            if( child>0 ) nchildren++;
-            close(connection);
-            /* printf("subprocess %d started...\n", child); fflush(stdout); */
-          }else{
-            int nErr = 0, fd;
-            close(0);
-            fd = dup(connection);
-            if( fd!=0 ) nErr++;
-            close(1);
-            fd = dup(connection);
-            if( fd!=1 ) nErr++;
-            close(connection);
-            return nErr;
-          }
+    if( nBlk>0 && fread(aBlk, nBlk, 1, in)!=1 ) break;
+    for(i=0; i+2<=nBlk; ){
+      const unsigned char *a = &aBlk[i+2];
+      int nRec = aBlk[i] | (aBlk[i+1]<<8);
+      int j, k, nStr = 0;
+      unsigned long long aV[11];
+      LogRecord rec;
+      if( i+2+nRec>nBlk ) break;
+      i += 2 + nRec;
+      for(j=k=0; j<11; j++){
+        int got = LogGetVarint(&a[k], nRec-k, &aV[j]);
+        if( got==0 ) break;
+        k += got;
+        aV[j] = (aV[j]>>1) ^ (0-(aV[j]&1));
+      }
+      if( j<11 ) continue;
+      tNow += (long long)aV[0];
+      rec.tNow = tNow;
+      for(j=0; j<5; j++) rec.aUs[j] = (long long)aV[j+1];
+      rec.nIn = (int)aV[6];
+      rec.nOut = (int)aV[7];
+      rec.nRequest = (int)aV[8];
+      rec.nScriptName = (int)aV[9];
+      rec.lineNum = (int)aV[10];
+      for(j=0; j<=LOGSTR_COUNT; j++){
+        unsigned long long t;
+        const unsigned char *z;
+        int nZ, got = LogGetVarint(&a[k], nRec-k, &t);
+        if( got==0 ) break;
+        k += got;
+        if( t & 1 ){
+          if( (t>>1)>=(unsigned long long)nLit ) break;
+          z = azLit[t>>1];
+          nZ = anLit[t>>1];
+        }else{
+          if( (t>>1)>(unsigned long long)(nRec-k) ) break;
+          z = &a[k];
+          nZ = (int)(t>>1);
+          k += nZ;
+          azLit[nLit] = z;
+          anLit[nLit++] = nZ;
+        }
+        if( j==0 ){
+          if( nZ>=(int)sizeof(rec.zStatus) ) nZ = sizeof(rec.zStatus)-1;
+          memcpy(rec.zStatus, z, nZ);
+          rec.zStatus[nZ] = 0;
+        }else{
+          char zBuf[LOG_RECORD_TEXT];
+          if( nZ>=(int)sizeof(zBuf) ) nZ = sizeof(zBuf)-1;
+          memcpy(zBuf, z, nZ);
+          zBuf[nZ] = 0;
+          nStr = LogRecordString(&rec, j-1, zBuf, nStr);
         }
       }
-      /* Bury dead children */
-      while( (child = waitpid(0, 0, WNOHANG))>0 ){
-        /* printf("process %d ends\n", child); fflush(stdout); */
-        nchildren--;
+      if( j<=LOGSTR_COUNT ) continue;
+      rec.nPhase = 0;
+      if( k<nRec ){
+        unsigned long long nP, v;
+        int got = LogGetVarint(&a[k], nRec-k, &nP);
+        k += got;
+        for(j=0; got && j<(int)nP && j<STATS_NPHASE-1; j++){
+          got = LogGetVarint(&a[k], nRec-k, &v);
+          if( got==0 ) break;
+          k += got;
+          rec.aPhase[j] = (int)((v>>1) ^ (0-(v&1)));
+        }
+        if( got ) rec.nPhase = j;
+      }
+      if( (time_t)tNow!=tDate ){
+        tDate = (time_t)tNow;
+        strftime(zDate, sizeof(zDate), LOG_DATE_FORMAT, localtime(&tDate));
       }
+      LogRecordText(&rec, zDate);
+      ArenaReset();
     }
   }
-  /* NOT REACHED */  
-  exit(1);
+  LogFlush();
+  if( in!=stdin ) fclose(in);
+  free(aBlk);
+  free(azLit);
+  free(anLit);
 }
 
-
 int main(int argc, char **argv){
   int i;                    /* Loop counter */
   char *zPermUser = 0;      /* Run daemon with this user's permissions */
@@ -2377,6 +7401,7 @@ int main(int argc, char **argv){
   /* Record the time when processing begins.
   */
   gettimeofday(&beginTime, 0);
+  sLocalStats.tStart = beginTime.tv_sec;
 
   /* Parse command-line arguments
   */
@@ -2390,6 +7415,16 @@ int main(int argc, char **argv){
       zRoot = zArg;
     }else if( strcmp(z,"-logfile")==0 ){
       zLogFile = zArg;
+    }else if( strcmp(z,"-log-flush")==0 ){
+      logFlush = atoi(zArg);
+    }else if( strcmp(z,"-log-binary")==0 ){
+      logBinary = atoi(zArg);
+    }else if( strcmp(z,"-log-phases")==0 ){
+      logPhases = atoi(zArg);
+    }else if( strcmp(z,"-log-ring")==0 ){
+      nLogRing = atoi(zArg);
+    }else if( strcmp(z,"-status-auth")==0 ){
+      zStatusAuth = zArg;
     }else if( strcmp(z,"-max-age")==0 ){
       mxAge = atoi(zArg);
     }else if( strcmp(z,"-max-cpu")==0 ){
@@ -2402,6 +7437,32 @@ int main(int argc, char **argv){
       zPort = zArg;
       standalone = 1;
      
+    }else if( strcmp(z, "-workers")==0 ){
+      nWorker = atoi(zArg);
+    }else if( strcmp(z, "-reuseport")==0 ){
+      reusePort = atoi(zArg);
+    }else if( strcmp(z, "-backlog")==0 ){
+      listenBacklog = atoi(zArg);
+      if( listenBacklog<1 ) listenBacklog = 20;
+    }else if( strcmp(z, "-max-requests")==0 ){
+      maxRequest = atoi(zArg);
+    }else if( strcmp(z, "-keepalive-timeout")==0 ){
+      keepAliveTimeout = atoi(zArg);
+      if( keepAliveTimeout<1 ) keepAliveTimeout = 1;
+    }else if( strcmp(z, "-max-lifetime")==0 ){
+      maxLifetime = atoi(zArg);
+    }else if( strcmp(z, "-shed-load")==0 ){
+      shedLoad = atoi(zArg);
+    }else if( strcmp(z, "-file-cache")==0 ){
+      nFileCache = atoi(zArg);
+    }else if( strcmp(z, "-file-cache-ttl")==0 ){
+      fileCacheTtl = atoi(zArg);
+    }else if( strcmp(z, "-scgi-spares")==0 ){
+      nScgiSpare = atoi(zArg);
+    }else if( strcmp(z, "-spool-post")==0 ){
+      spoolPost = atoi(zArg);
+    }else if( strcmp(z, "-scgi-dns-ttl")==0 ){
+      scgiDnsTtl = atoi(zArg);
     }else if( strcmp(z, "-family")==0 ){
       if( strcmp(zArg, "ipv4")==0 ){
         ipv4Only = 1;
@@ -2424,10 +7485,31 @@ int main(int argc, char **argv){
         Malfunction(501, /* LOG: cannot open --input file */
                     "cannot open --input file \"%s\"\n", zArg);
       }
+    }else if( strcmp(z, "-log-decode")==0 ){
+      LogDecode(zArg);
+      exit(0);
     }else if( strcmp(z, "-datetest")==0 ){
       TestParseRfc822Date();
       printf("Ok\n");
       exit(0);
+#ifdef ALTHTTPD_BENCH
+    }else if( strcmp(z, "-bench")==0 ){
+      Bench(atoi(zArg));
+      exit(0);
+    }else if( strcmp(z, "-bench-fuzz")==0 ){
+      exit(BenchFuzz(atoi(zArg))!=0);
+    }else if( strcmp(z, "-replay-clients")==0 ){
+      nReplayClient = atoi(zArg);
+    }else if( strcmp(z, "-replay-corpus")==0 ){
+      zReplayCorpus = zArg;
+    }else if( strcmp(z, "-replay-out")==0 ){
+      zReplayOut = zArg;
+    }else if( strcmp(z, "-replay-label")==0 ){
+      zReplayLabel = zArg;
+    }else if( strcmp(z, "-replay")==0 ){
+      Replay(atoi(zArg));
+      exit(0);
+#endif
     }else{
       Malfunction(510, /* LOG: unknown command-line argument on launch */
                   "unknown argument: [%s]\n", z);
@@ -2472,10 +7554,15 @@ int main(int argc, char **argv){
   }
 
 #ifdef RLIMIT_CPU
-  if( maxCpu>0 ){
+  if( maxCpu>0 && !inLogWriter ){
     struct rlimit rlim;
     rlim.rlim_cur = maxCpu;
     rlim.rlim_max = maxCpu;
+    if( inWorker ){
+      /* WorkerCpuLimit() raises the soft limit for each connection.  The
+      ** hard limit bounds the whole life of the worker. */
+      rlim.rlim_max = (rlim_t)maxCpu*WORKER_CPU_BUDGET;
+    }
     setrlimit(RLIMIT_CPU, &rlim);
   }
 #endif
@@ -2502,17 +7589,16 @@ int main(int argc, char **argv){
                 "cannot run as root");
   }
 
+  /* A worker process accepts its own connections from here on */
+  if( inLogWriter ) LogWriterLoop();
+  if( inWorker ) WorkerLoop();
+
   /* Get the IP address from whence the request originates
   */
   if( zRemoteAddr==0 ){
-    address remoteAddr;
-    unsigned int size = sizeof(remoteAddr);
-    char zHost[NI_MAXHOST];
-    if( getpeername(0, &remoteAddr.sa, &size)>=0 ){
-      getnameinfo(&remoteAddr.sa, size, zHost, sizeof(zHost), 0, 0,
-                  NI_NUMERICHOST);
-      zRemoteAddr = StrDup(zHost);
-    }
+    static char zHost[NI_MAXHOST];
+    GetRemoteAddr(0, zHost, sizeof(zHost));
+    if( zHost[0] ) zRemoteAddr = zHost;
   }
   if( zRemoteAddr!=0
    && strncmp(zRemoteAddr, "::ffff:", 7)==0
@@ -2523,10 +7609,11 @@ int main(int argc, char **argv){
   }
 
   /* Process the input stream */
-  for(i=0; i<100; i++){
-    ProcessOneRequest(0);
-  }
-  ProcessOneRequest(1);
+  time(&connBegin);
+  do{
+    i = ConnectionDone();
+    ProcessOneRequest(i);
+  }while( !i );
   exit(0);
 }
 
@@ -2547,6 +7634,7 @@ INSERT INTO xref VALUES(160,'http request on https-only page');
 INSERT INTO xref VALUES(170,'-auth redirect');
 INSERT INTO xref VALUES(180,'malformed entry in -auth file');
 INSERT INTO xref VALUES(190,'chdir() failed');
+INSERT INTO xref VALUES(195,'Request header too large');
 INSERT INTO xref VALUES(200,'bad protocol in HTTP header');
 INSERT INTO xref VALUES(210,'Empty request URI');
 INSERT INTO xref VALUES(220,'Unknown request method');
@@ -2556,7 +7644,9 @@ INSERT INTO xref VALUES(250,'Disallowed user agent');
 INSERT INTO xref VALUES(260,'Disallowed referrer');
 INSERT INTO xref VALUES(270,'Request too large');
 INSERT INTO xref VALUES(280,'mkstemp() failed');
-INSERT INTO xref VALUES(290,'cannot create temp file for POST content');
+INSERT INTO xref VALUES(290,'cannot create pipe for POST content');
+INSERT INTO xref VALUES(291,'cannot fork to copy POST content');
+INSERT INTO xref VALUES(292,'cannot write POST content to spool file');
 INSERT INTO xref VALUES(300,'Path element begins with . or -');
 INSERT INTO xref VALUES(310,'URI does not start with /');
 INSERT INTO xref VALUES(320,'URI too long');
@@ -2576,6 +7666,8 @@ INSERT INTO xref VALUES(450,'dup(1) failed');
 INSERT INTO xref VALUES(460,'Excess URI content past static file name');
 INSERT INTO xref VALUES(470,'ETag Cache Hit');
 INSERT INTO xref VALUES(480,'fopen() failed for static content');
+INSERT INTO xref VALUES(5,'Normal reply from the file cache');
+INSERT INTO xref VALUES(6,'Server status page');
 INSERT INTO xref VALUES(2,'Normal HEAD reply');
 INSERT INTO xref VALUES(0,'Normal reply');
 INSERT INTO xref VALUES(500,'unknown IP protocol');